@@ -11,6 +11,11 @@ BuildRoot:      %{_tmppath}/%{name}-%{version}-%{release}-root-%(%{__id_u} -n)
 
 BuildRequires:  glib2-devel device-mapper-devel libblkid-devel
 BuildRequires:  e2fsprogs-devel ntfsprogs-devel
+# Build with --without uring where liburing isn't packaged
+%bcond_without uring
+%if %{with uring}
+BuildRequires:  liburing-devel
+%endif
 
 Requires:       notify-python pygtk2
 # For show_isr_storage
@@ -29,7 +34,7 @@ disk space into a device-mapper volume and an initscript to create transient
 %setup -q
 
 %build
-%configure --enable-silent-rules
+%configure --enable-silent-rules %{?with_uring:--with-liburing}%{!?with_uring:--without-liburing}
 make %{?_smp_mflags}
 
 %install
@@ -47,6 +52,8 @@ rm -rf $RPM_BUILD_ROOT
 %{_bindir}/show_isr_storage
 %{_sbindir}/gather_free_space
 %{_sbindir}/remount_live_volume
+%{_sbindir}/scratch-extend
+/lib/udev/rules.d/70-scratch-extend.rules
 
 %post
 /sbin/chkconfig --add early-scratch-setup
@@ -0,0 +1,145 @@
+/*
+ * fragment - Allocate a pattern of blocks on a fresh filesystem image, for
+ *            benchmarking gather_free_space on fragmented free space
+ *
+ * Copyright (C) 2009-2010 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <ext2fs.h>
+#include <ntfs/volume.h>
+#include <ntfs/attrib.h>
+#include <glib.h>
+
+/* Bytes of the NTFS volume bitmap rewritten at a time */
+#define NTFS_CHUNK (1 << 20)
+
+enum pattern {
+	PATTERN_CHECKERBOARD,
+	PATTERN_RANDOM,
+};
+
+/* Fixed, so that runs can be compared */
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+static G_GNUC_PRINTF(1, 2) G_GNUC_NORETURN void die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+/* The next 64 blocks to allocate: every other one, or each with
+   probability 1/2 */
+static uint64_t pattern_word(enum pattern pattern)
+{
+	if (pattern == PATTERN_CHECKERBOARD)
+		return 0x5555555555555555ULL;
+	/* xorshift64 */
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+/* ext2fs_block_alloc_stats2() keeps the group descriptors and superblock
+   counts in step with the bitmap, which gather_free_space relies on to
+   skip full groups */
+static void fragment_ext(const char *path, enum pattern pattern)
+{
+	ext2_filsys fs;
+	blk64_t blk;
+	blk64_t end;
+	uint64_t word = 0;
+
+	if (ext2fs_open(path, EXT2_FLAG_RW | EXT2_FLAG_64BITS, 0, 0,
+				unix_io_manager, &fs))
+		die("Couldn't open filesystem on %s", path);
+	/* The default rbtree bitmap grows a node per run, which is the
+	   worst case for these patterns */
+	fs->default_bitmap_type = EXT2FS_BMAP64_BITARRAY;
+	if (ext2fs_read_bitmaps(fs))
+		die("Couldn't read bitmaps on %s", path);
+	end = ext2fs_blocks_count(fs->super);
+	for (blk = fs->super->s_first_data_block; blk < end; blk++) {
+		if (blk % 64 == 0 || blk == fs->super->s_first_data_block)
+			word = pattern_word(pattern);
+		if (!((word >> (blk % 64)) & 1))
+			continue;
+		if (!ext2fs_test_block_bitmap2(fs->block_map, blk))
+			ext2fs_block_alloc_stats2(fs, blk, +1);
+	}
+	if (ext2fs_close(fs))
+		die("Couldn't write filesystem on %s", path);
+}
+
+static void fragment_ntfs(const char *path, enum pattern pattern)
+{
+	ntfs_volume *vol;
+	ntfs_attr *na;
+	uint64_t *buf;
+	int64_t offset;
+	int64_t len;
+	unsigned n;
+
+	vol = ntfs_mount(path, 0);
+	if (vol == NULL)
+		die("Couldn't open filesystem on %s", path);
+	na = vol->lcnbmp_na;
+	buf = g_malloc(NTFS_CHUNK);
+	for (offset = 0; offset < na->data_size; offset += len) {
+		len = MIN(NTFS_CHUNK, na->data_size - offset);
+		memset(buf, 0, NTFS_CHUNK);
+		if (ntfs_attr_pread(na, offset, len, buf) != len)
+			die("Couldn't read volume bitmap on %s", path);
+		/* Stored little-endian, bit i of each word is cluster i */
+		for (n = 0; n < (len + 7) / 8; n++)
+			buf[n] |= GUINT64_TO_LE(pattern_word(pattern));
+		if (ntfs_attr_pwrite(na, offset, len, buf) != len)
+			die("Couldn't write volume bitmap on %s", path);
+	}
+	g_free(buf);
+	if (ntfs_umount(vol, FALSE))
+		die("Couldn't close filesystem on %s", path);
+}
+
+int main(int argc, char **argv)
+{
+	enum pattern pattern;
+
+	if (argc != 4)
+		die("Usage: %s ext4|ntfs image checkerboard|random", argv[0]);
+	if (!strcmp(argv[3], "checkerboard"))
+		pattern = PATTERN_CHECKERBOARD;
+	else if (!strcmp(argv[3], "random"))
+		pattern = PATTERN_RANDOM;
+	else
+		die("Unknown pattern %s", argv[3]);
+
+	if (!strcmp(argv[1], "ext4"))
+		fragment_ext(argv[2], pattern);
+	else if (!strcmp(argv[1], "ntfs"))
+		fragment_ntfs(argv[2], pattern);
+	else
+		die("Unknown filesystem %s", argv[1]);
+	return 0;
+}
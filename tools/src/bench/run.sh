@@ -0,0 +1,134 @@
+#!/bin/sh
+# Time gather_free_space --plan-only on sparse ext4, NTFS and swap images,
+# empty and with half their blocks allocated at random or in a
+# checkerboard.  For each image, print the scan rate in 4 KB blocks per
+# second, the time spent planning the map, and peak RSS.  Filesystems
+# whose mkfs tool isn't installed are skipped.
+#
+# BENCH_SIZES	image sizes (default: 1G 64G 1T 4T)
+# BENCH_OPTS	extra gather_free_space options (default: -m 0 -e 0, so that
+#		every fragment reaches extent selection)
+
+gfs=${GATHER_FREE_SPACE:-./gather_free_space}
+fragment=${FRAGMENT:-./bench/fragment}
+sizes=${BENCH_SIZES:-1G 64G 1T 4T}
+opts=${BENCH_OPTS:--m 0 -e 0}
+# mkfs tools usually live in sbin, which isn't always in PATH
+PATH=$PATH:/sbin:/usr/sbin
+workdir=$(mktemp -d "${TMPDIR:-/tmp}/gfs-bench.XXXXXX") || exit 1
+shmdir=
+trap 'rm -rf "$workdir" $shmdir' EXIT
+
+# sparse_image SIZE
+# Create a sparse file and set $image to its path, falling back to tmpfs
+# past the 16 TiB many filesystems cap files at
+sparse_image() {
+	image=$workdir/image
+	rm -f "$image" ${shmdir:+"$shmdir/image"}
+	truncate -s "$1" "$image" 2>/dev/null && return
+	rm -f "$image"
+	if [ -z "$shmdir" ] && [ -d /dev/shm ]; then
+		shmdir=$(mktemp -d /dev/shm/gfs-bench.XXXXXX) || shmdir=
+	fi
+	[ -n "$shmdir" ] || return 1
+	image=$shmdir/image
+	truncate -s "$1" "$image" 2>/dev/null
+}
+
+# report_value KEY
+# Print the first value of KEY in the report
+report_value() {
+	awk -v key="$1:" '$1 == key || ($1 == "-" && $2 == key) \
+				{print $NF; exit}' "$workdir/report"
+}
+
+# stage_ms STAGE
+stage_ms() {
+	awk -v name="$1" '$1 == "-" && $2 == "name:" && $3 == name \
+				{getline; print $NF; exit}' "$workdir/report"
+}
+
+mkfs_image() {
+	case $1 in
+	ext4)
+		mkfs.ext4 -q -F \
+					-E nodiscard,lazy_itable_init=1,lazy_journal_init=1 \
+					"$image" ;;
+	ntfs)
+		mkntfs -q -F -Q "$image" ;;
+	swap)
+		mkswap "$image" ;;
+	esac >/dev/null 2>&1
+}
+
+bench() {
+	fs=$1
+	size=$2
+	pattern=$3
+
+	if ! sparse_image "$size"; then
+		echo "$fs $size: nowhere to create a sparse file" >&2
+		return
+	fi
+	if ! mkfs_image "$fs"; then
+		echo "$fs $size: mkfs failed" >&2
+		return
+	fi
+	if [ "$pattern" != empty ] &&
+				! "$fragment" "$fs" "$image" "$pattern"; then
+		echo "$fs $size $pattern: fragment failed" >&2
+		return
+	fi
+	if ! "$gfs" --plan-only -q -r "$workdir/report" $opts "$image" \
+				bench-node >/dev/null; then
+		echo "$fs $size $pattern: gather_free_space failed" >&2
+		return
+	fi
+	problem=$(report_value problem)
+	if [ -n "$problem" ]; then
+		echo "$fs $size $pattern: rejected: $problem" >&2
+		return
+	fi
+	size_kb=$(report_value size-kb)
+	scan_ms=$(report_value scan-ms)
+	awk -v fs="$fs" -v size="$size" -v pattern="$pattern" \
+				-v size_kb="$size_kb" -v scan_ms="$scan_ms" \
+				-v extents="$(report_value free-extents)" \
+				-v plan_ms="$(stage_ms plan)" \
+				-v rss_kb="$(report_value peak-rss-kb)" \
+				'BEGIN {
+		rate = "-"
+		if (scan_ms > 0)
+			rate = sprintf("%.0f", size_kb / 4 * 1000 / scan_ms)
+		printf "%-5s %5s %-12s %12s %8s %14s %8s %11s\n", fs, size,
+					pattern, extents, scan_ms, rate,
+					plan_ms, rss_kb
+	}'
+}
+
+[ -x "$gfs" ] || { echo "$gfs not found" >&2; exit 1; }
+printf "%-5s %5s %-12s %12s %8s %14s %8s %11s\n" fs size pattern \
+			free-extents scan-ms blocks/s plan-ms peak-rss-kb
+for fs in ext4 ntfs swap; do
+	case $fs in
+	ext4)	tool=mkfs.ext4 ;;
+	ntfs)	tool=mkntfs ;;
+	swap)	tool=mkswap ;;
+	esac
+	if ! command -v $tool >/dev/null 2>&1; then
+		echo "$fs: skipped, $tool not found" >&2
+		continue
+	fi
+	for size in $sizes; do
+		# A swap area is one extent whatever is in it, so there is
+		# nothing to fragment
+		if [ $fs = swap ]; then
+			bench $fs "$size" empty
+			continue
+		fi
+		for pattern in empty random checkerboard; do
+			bench $fs "$size" "$pattern"
+		done
+	done
+done
+exit 0
@@ -15,8 +15,13 @@
  * for more details.
  */
 
+#include "config.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <linux/if_alg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -24,21 +29,49 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 #include <libdevmapper.h>
 #include <blkid.h>
 #include <ext2fs.h>
 #include <ntfs/volume.h>
 #include <ntfs/attrib.h>
-#include <ntfs/bitmap.h>
 #include <ntfs/logging.h>
 #include <glib.h>
 
 /* Command-line options */
 const char **exclude;
 const char *report_file;
+const char *cache_file;
+const char *trace_file;
+const char *replay_file;
 unsigned minsize = 4;  /* MiB */
+unsigned target_mb;
+unsigned headroom_pct = 5;
 unsigned min_extent_kb = 4096;
 unsigned max_extent_count = 100000;
+unsigned table_targets;
+unsigned bitmap_chunk_mb = 4;
+unsigned jobs;
+unsigned fs_jobs;
+unsigned io_depth = 32;
+unsigned detect_timeout = 10;
+const char *layout_name = "linear";
+unsigned stripe_chunk_kb = 512;
+unsigned align_kb;
+const char *placement_name = "physical";
+const char *stack_prefix;
+unsigned swap_mb = 2048;
+const char *cipher_name = "auto";
+gboolean probe_disks;
+gboolean unallocated;
+gboolean extend;
+gboolean plan_only;
 gboolean quiet;
 gboolean verbose;
 gboolean dry_run;
@@ -47,21 +80,52 @@ gboolean log_extents;
 static const GOptionEntry options[] = {
 	{"exclude", 'x', 0, G_OPTION_ARG_STRING_ARRAY, &exclude, "Skip the specified device", "DEVICE"},
 	{"min", 'm', 0, G_OPTION_ARG_INT, &minsize, "Minimum size for new device", "MB"},
+	{"target-size", 'T', 0, G_OPTION_ARG_INT, &target_mb, "Use only the fewest, largest extents needed to reach MB plus headroom", "MB"},
+	{"headroom", 0, 0, G_OPTION_ARG_INT, &headroom_pct, "Extra space to gather with --target-size (default: 5)", "PERCENT"},
 	{"min-extent-size", 'e', 0, G_OPTION_ARG_INT, &min_extent_kb, "Minimum length of free space extent", "KB"},
 	{"max-extent-count", 'E', 0, G_OPTION_ARG_INT, &max_extent_count, "Maximum number of free space extents", "N"},
+	{"table-targets", 0, 0, G_OPTION_ARG_INT, &table_targets, "Split the map into child devices of at most N extents each", "N"},
+	{"bitmap-chunk-size", 0, 0, G_OPTION_ARG_INT, &bitmap_chunk_mb, "Amount of free space bitmap to read at once", "MB"},
+	{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, "Scan up to N devices at once (default: one per disk, up to the CPU count)", "N"},
+	{"fs-jobs", 0, 0, G_OPTION_ARG_INT, &fs_jobs, "Split large filesystems across up to N threads (default: CPU count)", "N"},
+	{"io-depth", 0, 0, G_OPTION_ARG_INT, &io_depth, "Keep up to N metadata reads in flight per scan thread, or in total without io_uring", "N"},
+	{"detect-timeout", 0, 0, G_OPTION_ARG_INT, &detect_timeout, "Give up identifying devices after SECONDS (default: 10)", "SECONDS"},
+	{"layout", 'l', 0, G_OPTION_ARG_STRING, &layout_name, "Arrangement of extents in the new device: linear or stripe", "LAYOUT"},
+	{"stripe-chunk-size", 0, 0, G_OPTION_ARG_INT, &stripe_chunk_kb, "Chunk size for striped layout", "KB"},
+	{"align", 'a', 0, G_OPTION_ARG_INT, &align_kb, "Align extents to KB on disk (default: from the disk's I/O limits)", "KB"},
+	{"placement", 'p', 0, G_OPTION_ARG_STRING, &placement_name, "Order of disks in the new device: physical or fast-first", "POLICY"},
+	{"probe", 0, 0, G_OPTION_ARG_NONE, &probe_disks, "Time a short read from each disk to rank disks within a speed tier", NULL},
+	{"unallocated", 'u', 0, G_OPTION_ARG_NONE, &unallocated, "Also collect space outside partitions, blank disks, and free LVM extents", NULL},
+	{"stack", 'S', 0, G_OPTION_ARG_STRING, &stack_prefix, "Also create PREFIX-crypt on NODE with a random key, and PREFIX-swap and PREFIX-home on that", "PREFIX"},
+	{"swap-size", 0, 0, G_OPTION_ARG_INT, &swap_mb, "Size of PREFIX-swap (default: 2048)", "MB"},
+	{"cipher", 0, 0, G_OPTION_ARG_STRING, &cipher_name, "Cipher for PREFIX-crypt: aes-xts, serpent-xts, twofish-xts, adiantum-xchacha12, adiantum-xchacha20, or auto to pick the fastest (default: auto)", "CIPHER"},
+	{"extend", 0, 0, G_OPTION_ARG_NONE, &extend, "Append free space to the existing NODE, skipping devices it already uses", NULL},
+	{"plan-only", 0, 0, G_OPTION_ARG_NONE, &plan_only, "Print the table in dmsetup format instead of creating NODE; needs no privileges, and DEVICEs may be image files", NULL},
 	{"test", 't', 0, G_OPTION_ARG_NONE, &dry_run, "Do everything except create the device", NULL},
 	{"quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet, "Suppress summary information", NULL},
 	{"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Be verbose", NULL},
 	{"report", 'r', 0, G_OPTION_ARG_FILENAME, &report_file, "Write YAML-formatted summary report to FILE", "FILE"},
+	{"cache", 'C', 0, G_OPTION_ARG_FILENAME, &cache_file, "Reuse scans of unchanged filesystems from FILE, and update it", "FILE"},
 	{"dump", 'd', 0, G_OPTION_ARG_NONE, &log_extents, "Log every examined extent to stdout", NULL},
+	{"trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_file, "Record every examined extent in binary form to FILE", "FILE"},
+	{"replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_file, "Plan from a --trace FILE instead of scanning; implies --plan-only", "FILE"},
 	{NULL, 0, 0, 0, NULL, NULL, NULL}
 };
 
 /* Other globals */
-struct extent *extents;
-unsigned used_extents;
+enum layout {
+	LAYOUT_LINEAR,
+	LAYOUT_STRIPE,
+} layout;
+enum placement {
+	PLACEMENT_PHYSICAL,
+	PLACEMENT_FAST_FIRST,
+} placement;
+struct extent_set *extents;
 unsigned min_extent_sectors;
+GMutex ntfs_lock;
 GString *report_str;
+GArray *stages;
 
 /* Logging */
 
@@ -69,13 +133,17 @@ static G_GNUC_PRINTF(3, 4) void _log(gboolean do_squash, gboolean do_exit,
 			const char *fmt, ...)
 {
 	va_list ap;
+	gchar *msg;
 
 	if (do_squash)
 		return;
+	/* Format the whole line first, so that messages from concurrent
+	   scans don't interleave */
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
-	fprintf(stderr, "\n");
+	msg = g_strdup_vprintf(fmt, ap);
 	va_end(ap);
+	fprintf(stderr, "%s\n", msg);
+	g_free(msg);
 	if (do_exit)
 		exit(1);
 }
@@ -116,6 +184,18 @@ static void _dm_log(int level, const char *file, int line, const char *fmt,
 	va_end(ap);
 }
 
+static void report_rejection(const char *path, const char *fstype,
+			uint64_t sectors, const char *problem)
+{
+	report(1, "- device: %s", path);
+	report(2, "error: true");
+	report(2, "problem: %s", problem);
+	if (fstype != NULL)
+		report(2, "filesystem: %s", fstype);
+	if (sectors)
+		report(2, "size-kb: %"PRIu64, sectors / 2);
+}
+
 static G_GNUC_PRINTF(4, 5) void _reject(const char *path, const char *fstype,
 			uint64_t sectors, const char *fmt, ...)
 {
@@ -125,33 +205,75 @@ static G_GNUC_PRINTF(4, 5) void _reject(const char *path, const char *fstype,
 	va_start(ap, fmt);
 	msg = g_strdup_vprintf(fmt, ap);
 	msg("%s: %s, skipping", path, msg);
-	report(1, "- device: %s", path);
-	report(2, "error: true");
-	report(2, "problem: %s", msg);
-	if (fstype != NULL)
-		report(2, "filesystem: %s", fstype);
-	if (sectors)
-		report(2, "size-kb: %"PRIu64, sectors / 2);
+	report_rejection(path, fstype, sectors, msg);
 	g_free(msg);
 	va_end(ap);
 }
 
-#define reject(device, fmt, args...) \
-	_reject(device->path, device->fstype, device->sectors, fmt, ## args)
-
 /* blkid helpers */
 
+/* Speed tiers, fastest first */
+enum disk_tier {
+	TIER_NVME,
+	TIER_SSD,
+	TIER_HDD,
+	TIER_UNKNOWN,
+	TIER_REMOVABLE,
+};
+
+static const char *tier_names[] = {
+	[TIER_NVME] = "nvme",
+	[TIER_SSD] = "ssd",
+	[TIER_HDD] = "hdd",
+	[TIER_UNKNOWN] = "unknown",
+	[TIER_REMOVABLE] = "removable",
+};
+
+/* A physical disk, or a block device which isn't a partition.  For
+   regular files, the file itself. */
+struct disk {
+	gchar *name;
+	gchar *path;
+	unsigned index;
+	enum disk_tier tier;
+	uint64_t read_kbps;  /* 0 if not probed */
+	unsigned align_sectors;
+};
+
 struct device {
 	GQuark id;
+	unsigned index;
 	gchar *path;
 	gchar *fstype;
+	struct disk *disk;
+	uint64_t disk_start;
+	gboolean whole_disk;
+	gchar *problem;
+	struct extent_set *extents;
 	uint64_t sectors;
 	uint64_t free_sectors;
 	uint64_t accepted_sectors;
+	uint64_t align_loss_sectors;
 	unsigned free_extents;
 	unsigned accepted_extents;
+	uint64_t scan_usec;
 };
 
+/* Devices are scanned concurrently, so rejections are recorded here and
+   reported afterward in device order. */
+static G_GNUC_PRINTF(2, 3) void reject(struct device *device,
+			const char *fmt, ...)
+{
+	va_list ap;
+
+	if (device->problem != NULL)
+		return;
+	va_start(ap, fmt);
+	device->problem = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+	msg("%s: %s, skipping", device->path, device->problem);
+}
+
 static void device_tree_insert(GTree *devices, const char *path,
 			const char *fstype)
 {
@@ -164,354 +286,6233 @@ static void device_tree_insert(GTree *devices, const char *path,
 	g_tree_insert(devices, device->path, device);
 }
 
-static void device_free(void *_device)
+static void device_free(void *_device)
+{
+	struct device *device = _device;
+
+	g_free(device->path);
+	g_free(device->fstype);
+	g_free(device->problem);
+	g_slice_free(struct device, device);
+}
+
+static int compare_device_names(const void *a, const void *b, void *data)
+{
+	(void) data;
+	return strcmp(a, b);
+}
+
+static GTree *device_tree_new(void)
+{
+	return g_tree_new_full(compare_device_names, NULL, NULL, device_free);
+}
+
+/* sysfs helpers */
+
+/* Table of struct disk, keyed by name */
+GHashTable *disks;
+
+static gboolean sysfs_read_u64(const char *dir, const char *attr,
+			uint64_t *val)
+{
+	gchar *file;
+	gchar *buf;
+	gchar *end;
+	gboolean ret = FALSE;
+
+	file = g_build_filename(dir, attr, NULL);
+	if (g_file_get_contents(file, &buf, NULL, NULL)) {
+		*val = g_ascii_strtoull(buf, &end, 10);
+		ret = end != buf;
+		g_free(buf);
+	}
+	g_free(file);
+	return ret;
+}
+
+/* Returns the sysfs directory of a block device, to be freed with
+   free(), or NULL. */
+static char *sysfs_device_dir(const char *path)
+{
+	struct stat st;
+	gchar *link;
+	char *dir;
+
+	if (stat(path, &st) || !S_ISBLK(st.st_mode))
+		return NULL;
+	link = g_strdup_printf("/sys/dev/block/%u:%u", major(st.st_rdev),
+				minor(st.st_rdev));
+	dir = realpath(link, NULL);
+	g_free(link);
+	return dir;
+}
+
+/* A writable disk which isn't a partition or a device-mapper node */
+static gboolean sysfs_is_whole_disk(const char *dir)
+{
+	gchar *file;
+	uint64_t val;
+	gboolean ret;
+
+	if (sysfs_read_u64(dir, "partition", &val) ||
+				!sysfs_read_u64(dir, "ro", &val) || val)
+		return FALSE;
+	file = g_build_filename(dir, "dm", NULL);
+	ret = !g_file_test(file, G_FILE_TEST_EXISTS);
+	g_free(file);
+	return ret;
+}
+
+struct sector_range {
+	uint64_t start;
+	uint64_t end;
+};
+
+/* Append the partitions the kernel has found on the disk at dir */
+static gboolean sysfs_partitions(const char *dir, GArray *ranges)
+{
+	struct sector_range range;
+	GDir *dh;
+	const char *name;
+	gchar *child;
+	uint64_t val;
+
+	dh = g_dir_open(dir, 0, NULL);
+	if (dh == NULL)
+		return FALSE;
+	while ((name = g_dir_read_name(dh)) != NULL) {
+		child = g_build_filename(dir, name, NULL);
+		if (sysfs_read_u64(child, "partition", &val) &&
+					sysfs_read_u64(child, "start",
+					&range.start) &&
+					sysfs_read_u64(child, "size", &val)) {
+			range.end = range.start + val;
+			g_array_append_val(ranges, range);
+		}
+		g_free(child);
+	}
+	g_dir_close(dh);
+	return TRUE;
+}
+
+static void disk_free(void *_disk)
+{
+	struct disk *disk = _disk;
+
+	g_free(disk->name);
+	g_free(disk->path);
+	g_slice_free(struct disk, disk);
+}
+
+/* Guess the speed of a disk from its sysfs directory.  Anything behind
+   a USB bridge, and SD/MMC cards, are slow regardless of the medium. */
+static enum disk_tier disk_classify(const char *name, const char *dir)
+{
+	uint64_t val;
+
+	if (dir == NULL)
+		return TIER_UNKNOWN;
+	if (strstr(dir, "/usb") != NULL || g_str_has_prefix(name, "mmcblk"))
+		return TIER_REMOVABLE;
+	if (sysfs_read_u64(dir, "removable", &val) && val)
+		return TIER_REMOVABLE;
+	if (g_str_has_prefix(name, "nvme"))
+		return TIER_NVME;
+	if (!sysfs_read_u64(dir, "queue/rotational", &val))
+		return TIER_UNKNOWN;
+	return val ? TIER_HDD : TIER_SSD;
+}
+
+#define MAX_OPTIMAL_IO_SECTORS (16 << 11)
+
+/* Extents should start and end on a boundary which avoids
+   read-modify-write cycles in the disk: the physical block size, the
+   minimum I/O size (e.g. a RAID chunk), and the optimal I/O size if it's
+   sane.  Some USB bridges report nonsense optimal I/O sizes, so ignore
+   one which is very large or not a multiple of the others. */
+static unsigned disk_alignment(const char *dir)
+{
+	uint64_t align = 512;
+	uint64_t val;
+
+	if (align_kb)
+		return align_kb << 1;
+	if (dir == NULL)
+		return 1;
+	if (sysfs_read_u64(dir, "queue/physical_block_size", &val) &&
+				val > align)
+		align = val;
+	if (sysfs_read_u64(dir, "queue/minimum_io_size", &val) &&
+				val > align && val % align == 0)
+		align = val;
+	if (sysfs_read_u64(dir, "queue/optimal_io_size", &val) &&
+				val > align && val % align == 0 &&
+				val >> 9 <= MAX_OPTIMAL_IO_SECTORS)
+		align = val;
+	return align >> 9;
+}
+
+/* dir is the disk's sysfs directory, or NULL if it has none */
+static struct disk *disk_get(const char *name, const char *path,
+			const char *dir)
+{
+	struct disk *disk;
+
+	disk = g_hash_table_lookup(disks, name);
+	if (disk == NULL) {
+		disk = g_slice_new0(struct disk);
+		disk->name = g_strdup(name);
+		disk->path = g_strdup(path);
+		disk->tier = disk_classify(name, dir);
+		disk->align_sectors = disk_alignment(dir);
+		g_hash_table_insert(disks, disk->name, disk);
+		msg("%s: %s, %u KB alignment", disk->path,
+					tier_names[disk->tier],
+					disk->align_sectors / 2);
+	}
+	return disk;
+}
+
+/* Find the whole disk containing the device and the device's offset
+   within it. */
+static void device_resolve_disk(struct device *device)
+{
+	char *dir;
+	gchar *parent = NULL;
+	gchar *name;
+	gchar *path;
+	uint64_t start;
+
+	device->disk_start = 0;
+	dir = sysfs_device_dir(device->path);
+	if (dir == NULL)
+		goto fallback;
+	if (sysfs_read_u64(dir, "partition", &start) &&
+				sysfs_read_u64(dir, "start", &start)) {
+		parent = g_path_get_dirname(dir);
+		name = g_path_get_basename(parent);
+		device->disk_start = start;
+	} else {
+		name = g_path_get_basename(dir);
+		device->whole_disk = TRUE;
+	}
+	path = g_strdup_printf("/dev/%s", name);
+	/* sysfs uses '!' for '/' in names such as cciss!c0d0 */
+	g_strdelimit(path + 5, "!", '/');
+	device->disk = disk_get(name, path, parent ? parent : dir);
+	g_free(path);
+	g_free(name);
+	g_free(parent);
+	free(dir);
+	return;
+
+fallback:
+	device->disk = disk_get(device->path, device->path, NULL);
+}
+
+#define PROBE_READS 8
+#define PROBE_READ_SIZE (1 << 20)
+
+/* Time a few direct reads spread across the disk.  This is only a rough
+   measure, but it's enough to tell a fast disk from a slow one within
+   the same tier. */
+static void disk_probe(struct disk *disk)
+{
+	struct stat st;
+	void *buf;
+	off_t size;
+	off_t offset;
+	int64_t start;
+	int64_t usec;
+	unsigned n;
+	int fd;
+
+	fd = open(disk->path, O_RDONLY | O_DIRECT);
+	if (fd == -1)
+		return;
+	if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+		goto out;
+	size = lseek(fd, 0, SEEK_END);
+	if (size < PROBE_READ_SIZE)
+		goto out;
+	if (posix_memalign(&buf, 4096, PROBE_READ_SIZE))
+		goto out;
+	start = g_get_monotonic_time();
+	for (n = 0; n < PROBE_READS; n++) {
+		offset = (size - PROBE_READ_SIZE) / PROBE_READS * n;
+		offset &= ~(off_t) 4095;
+		if (pread(fd, buf, PROBE_READ_SIZE, offset) !=
+					PROBE_READ_SIZE) {
+			msg("%s: probe read failed", disk->path);
+			goto out_free;
+		}
+	}
+	usec = MAX(g_get_monotonic_time() - start, 1);
+	disk->read_kbps = (uint64_t) PROBE_READS * (PROBE_READ_SIZE >> 10) *
+				G_USEC_PER_SEC / usec;
+	msg("%s: read %"PRIu64" KB/s", disk->path, disk->read_kbps);
+out_free:
+	free(buf);
+out:
+	close(fd);
+}
+
+static int disk_compare_order(const void *a, const void *b)
+{
+	const struct disk *da = *(struct disk * const *) a;
+	const struct disk *db = *(struct disk * const *) b;
+
+	if (placement == PLACEMENT_FAST_FIRST) {
+		if (da->tier != db->tier)
+			return da->tier < db->tier ? -1 : 1;
+		if (da->read_kbps != db->read_kbps)
+			return da->read_kbps > db->read_kbps ? -1 : 1;
+	}
+	return strcmp(da->name, db->name);
+}
+
+static void disk_collect(void *key, void *disk, void *array)
+{
+	(void) key;
+	g_ptr_array_add(array, disk);
+}
+
+/* Number the disks in table order: by name, or with --placement
+   fast-first, by speed tier and then probed read rate. */
+static void disks_assign_order(void)
+{
+	GPtrArray *all;
+	unsigned n;
+
+	all = g_ptr_array_new();
+	g_hash_table_foreach(disks, disk_collect, all);
+	if (probe_disks)
+		for (n = 0; n < all->len; n++)
+			disk_probe(g_ptr_array_index(all, n));
+	g_ptr_array_sort(all, disk_compare_order);
+	for (n = 0; n < all->len; n++)
+		((struct disk *) g_ptr_array_index(all, n))->index = n;
+	g_ptr_array_free(all, TRUE);
+}
+
+/* Devices are identified with one low-level blkid probe per device, all
+   running at once, so that slow disks and card readers don't hold up the
+   rest.  A probe which hasn't finished by the deadline is abandoned to
+   its thread, which frees it whenever the probe returns. */
+struct probe {
+	gchar *path;
+	gboolean explicit;  /* named on the command line */
+	gchar *fstype;
+	gboolean failed;
+	gboolean done;
+	gboolean abandoned;
+};
+
+GMutex probe_lock;
+GCond probe_cond;
+
+static void probe_add(GPtrArray *probes, const char *path,
+			gboolean explicit)
+{
+	struct probe *probe;
+
+	probe = g_slice_new0(struct probe);
+	probe->path = g_strdup(path);
+	probe->explicit = explicit;
+	g_ptr_array_add(probes, probe);
+}
+
+static void probe_free(struct probe *probe)
+{
+	g_free(probe->path);
+	g_free(probe->fstype);
+	g_slice_free(struct probe, probe);
+}
+
+/* With --unallocated, whole disks are also checked for a partition
+   table.  A disk with a table gets the table type ("dos", "gpt") as its
+   filesystem type, and one with nothing recognizable on it is "blank". */
+static void *probe_thread(void *_probe)
+{
+	struct probe *probe = _probe;
+	blkid_probe pr;
+	const char *type;
+	gchar *fstype = NULL;
+	gboolean failed = TRUE;
+	gboolean whole = FALSE;
+	char *dir;
+	int ret;
+
+	if (unallocated && (dir = sysfs_device_dir(probe->path)) != NULL) {
+		whole = sysfs_is_whole_disk(dir);
+		free(dir);
+	}
+	pr = blkid_new_probe_from_filename(probe->path);
+	if (pr != NULL) {
+		blkid_probe_enable_superblocks(pr, 1);
+		blkid_probe_set_superblocks_flags(pr, BLKID_SUBLKS_TYPE);
+		if (whole)
+			blkid_probe_enable_partitions(pr, 1);
+		/* 1 means nothing found, -2 conflicting signatures */
+		ret = blkid_do_safeprobe(pr);
+		if (ret != -1)
+			failed = FALSE;
+		if (ret == 0 && (!blkid_probe_lookup_value(pr, "TYPE", &type,
+					NULL) || !blkid_probe_lookup_value(pr,
+					"PTTYPE", &type, NULL)))
+			fstype = g_strdup(type);
+		else if (ret == 1 && whole)
+			fstype = g_strdup("blank");
+		blkid_free_probe(pr);
+	}
+
+	g_mutex_lock(&probe_lock);
+	if (probe->abandoned) {
+		g_free(fstype);
+		probe_free(probe);
+	} else {
+		probe->fstype = fstype;
+		probe->failed = failed;
+		probe->done = TRUE;
+		g_cond_broadcast(&probe_cond);
+	}
+	g_mutex_unlock(&probe_lock);
+	return NULL;
+}
+
+/* Identify the devices in probes and add them to the tree.  Devices
+   named on the command line are reported if they can't be used. */
+static void probe_devices(GPtrArray *probes, GTree *devices)
+{
+	struct probe *probe;
+	struct probe *copy;
+	int64_t deadline;
+	unsigned n;
+
+	deadline = g_get_monotonic_time() + detect_timeout *
+				(int64_t) G_USEC_PER_SEC;
+	for (n = 0; n < probes->len; n++)
+		g_thread_unref(g_thread_new("probe", probe_thread,
+					g_ptr_array_index(probes, n)));
+
+	g_mutex_lock(&probe_lock);
+	for (n = 0; n < probes->len; n++) {
+		probe = g_ptr_array_index(probes, n);
+		while (!probe->done)
+			if (!g_cond_wait_until(&probe_cond, &probe_lock,
+						deadline))
+				break;
+		if (!probe->done) {
+			/* The thread may free the probe as soon as we unlock,
+			   so keep a copy to report from */
+			probe->abandoned = TRUE;
+			copy = g_slice_new0(struct probe);
+			copy->path = g_strdup(probe->path);
+			copy->explicit = probe->explicit;
+			copy->abandoned = TRUE;
+			g_ptr_array_index(probes, n) = copy;
+		}
+	}
+	g_mutex_unlock(&probe_lock);
+
+	for (n = 0; n < probes->len; n++) {
+		probe = g_ptr_array_index(probes, n);
+		if (probe->abandoned) {
+			if (probe->explicit)
+				_reject(probe->path, NULL, 0,
+						"Timed out probing device");
+			else
+				msg("%s: Timed out probing device, skipping",
+						probe->path);
+		} else if (probe->failed) {
+			if (probe->explicit)
+				_reject(probe->path, NULL, 0,
+						"Couldn't probe device");
+		} else if (probe->fstype == NULL) {
+			if (probe->explicit)
+				_reject(probe->path, NULL, 0, "Couldn't "
+						"determine filesystem type");
+		} else {
+			device_tree_insert(devices, probe->path,
+						probe->fstype);
+		}
+		probe_free(probe);
+	}
+}
+
+/* Excluded devices are matched by path, and by device number so that
+   e.g. /dev/mapper/foo also excludes /dev/dm-0. */
+static GHashTable *excluded_new(void)
+{
+	GHashTable *excluded;
+	struct stat st;
+	const char **path;
+
+	excluded = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+				NULL);
+	for (path = exclude; path != NULL && *path != NULL; path++) {
+		g_hash_table_add(excluded, g_strdup(*path));
+		if (!stat(*path, &st) && S_ISBLK(st.st_mode))
+			g_hash_table_add(excluded, g_strdup_printf("%u:%u",
+						major(st.st_rdev),
+						minor(st.st_rdev)));
+	}
+	return excluded;
+}
+
+static gboolean is_excluded(GHashTable *excluded, const char *path,
+			const char *devnum)
+{
+	if (g_hash_table_contains(excluded, path) ||
+				(devnum != NULL &&
+				g_hash_table_contains(excluded, devnum))) {
+		msg("%s: Excluded", path);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Only sysfs is read here; the devices themselves aren't touched. */
+static void find_all_devices(GHashTable *excluded, GPtrArray *probes)
+{
+	GDir *dir;
+	const char *name;
+	gchar *sysdir;
+	gchar *devnum;
+	gchar *dmname;
+	gchar *path;
+	gchar *file;
+	uint64_t sectors;
+
+	dir = g_dir_open("/sys/class/block", 0, NULL);
+	if (dir == NULL)
+		die("Couldn't list block devices");
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		if (g_str_has_prefix(name, "loop") ||
+					g_str_has_prefix(name, "ram"))
+			continue;
+		sysdir = g_build_filename("/sys/class/block", name, NULL);
+		file = g_build_filename(sysdir, "dev", NULL);
+		/* Skip empty card readers and the like */
+		if (!sysfs_read_u64(sysdir, "size", &sectors) || sectors == 0 ||
+					!g_file_get_contents(file, &devnum,
+					NULL, NULL)) {
+			g_free(file);
+			g_free(sysdir);
+			continue;
+		}
+		g_free(file);
+		g_strstrip(devnum);
+
+		file = g_build_filename(sysdir, "dm", "name", NULL);
+		if (g_file_get_contents(file, &dmname, NULL, NULL)) {
+			path = g_strdup_printf("/dev/mapper/%s",
+						g_strstrip(dmname));
+			g_free(dmname);
+		} else {
+			path = g_strdup_printf("/dev/%s", name);
+			/* sysfs uses '!' for '/' */
+			g_strdelimit(path + 5, "!", '/');
+		}
+		g_free(file);
+
+		if (!is_excluded(excluded, path, devnum))
+			probe_add(probes, path, FALSE);
+		g_free(path);
+		g_free(devnum);
+		g_free(sysdir);
+	}
+	g_dir_close(dir);
+}
+
+static void find_devices(GHashTable *excluded, GPtrArray *probes,
+			int argc, char **argv)
+{
+	struct stat st;
+	gchar *devnum;
+
+	for (; argc; argc--, argv++) {
+		devnum = NULL;
+		if (!stat(*argv, &st) && S_ISBLK(st.st_mode))
+			devnum = g_strdup_printf("%u:%u", major(st.st_rdev),
+						minor(st.st_rdev));
+		if (!is_excluded(excluded, *argv, devnum))
+			probe_add(probes, *argv, TRUE);
+		g_free(devnum);
+	}
+}
+
+/* dm helpers */
+
+/* Extents are packed into 16 bytes, since there can be millions of
+   them.  48 bits of sector number is enough for 128 PiB. */
+struct extent {
+	uint64_t start_sect:48;
+	uint64_t device:16;  /* index into device_list */
+	uint64_t sect_count;
+};
+
+#define EXTENT_MAX_DEVICES (1 << 16)
+
+/* All candidate devices, by index */
+GPtrArray *device_list;
+
+static struct device *extent_device(const struct extent *extent)
+{
+	return g_ptr_array_index(device_list, extent->device);
+}
+
+static gboolean dm_device_exists(const char *name)
+{
+	struct dm_task *dmt;
+	struct dm_info info;
+
+	dmt = dm_task_create(DM_DEVICE_INFO);
+	if (dmt == NULL)
+		die("Couldn't create DM task");
+	if (!dm_task_set_name(dmt, name))
+		die("Couldn't configure device name");
+	if (!dm_task_run(dmt))
+		die("Couldn't query device");
+	if (!dm_task_get_info(dmt, &info))
+		die("Couldn't get device info");
+	dm_task_destroy(dmt);
+	return info.exists;
+}
+
+/* With --table-targets, the map is split into child devices named
+   NODE-0, NODE-1, ..., each holding a bounded number of targets, and NODE
+   is a linear concatenation of the children.  This lifts the limit on the
+   total number of extents without any single table growing too large for
+   the kernel. */
+struct table_child {
+	gchar *name;
+	struct dm_task *task;
+	uint64_t start;  /* offset within the top-level device */
+	uint64_t sectors;
+	unsigned targets;
+	gboolean created;
+};
+
+struct table {
+	const char *name;
+	struct dm_task *task;
+	GPtrArray *children;  /* NULL unless split */
+	unsigned first_child;  /* number of the first new child */
+	gboolean reload;  /* task replaces the table of an existing device */
+	uint64_t base_sectors;  /* length of the existing table */
+	enum disk_tier tier;  /* slowest disk added; TIER_NVME is zero */
+	uint64_t sectors;
+	unsigned targets;
+	unsigned stripe_width;
+	uint64_t striped_sectors;
+	gboolean unaligned_4k;  /* some target isn't on 4 KB boundaries */
+};
+
+#define TABLE_4K_SECTORS 8
+
+/* Note whether an extent starts on a 4 KB boundary of its disk */
+static void table_check_aligned(struct table *table,
+			const struct extent *extent)
+{
+	if ((extent_device(extent)->disk_start + extent->start_sect) %
+				TABLE_4K_SECTORS)
+		table->unaligned_4k = TRUE;
+}
+
+static void table_child_free(void *_child)
+{
+	struct table_child *child = _child;
+
+	dm_task_destroy(child->task);
+	g_free(child->name);
+	g_slice_free(struct table_child, child);
+}
+
+static void table_init(struct table *table, struct dm_task *task,
+			const char *name)
+{
+	memset(table, 0, sizeof(*table));
+	table->task = task;
+	table->name = name;
+	if (table_targets)
+		table->children = g_ptr_array_new_with_free_func(
+					table_child_free);
+}
+
+static void table_free(struct table *table)
+{
+	if (table->children != NULL)
+		g_ptr_array_free(table->children, TRUE);
+	dm_task_destroy(table->task);
+}
+
+static void table_add_target(struct table *table, uint64_t sectors,
+			const char *type, const char *args)
+{
+	struct table_child *child = NULL;
+	struct dm_task *task = table->task;
+	uint64_t offset = table->sectors;
+
+	if (table->children != NULL) {
+		if (table->children->len)
+			child = g_ptr_array_index(table->children,
+						table->children->len - 1);
+		if (child == NULL || child->targets == table_targets) {
+			child = g_slice_new0(struct table_child);
+			child->name = g_strdup_printf("%s-%u", table->name,
+						table->first_child +
+						table->children->len);
+			child->start = table->sectors;
+			child->task = dm_task_create(DM_DEVICE_CREATE);
+			if (child->task == NULL)
+				die("Couldn't create DM task");
+			if (!dm_task_set_name(child->task, child->name))
+				die("Couldn't set device name");
+			g_ptr_array_add(table->children, child);
+		}
+		task = child->task;
+		offset = child->sectors;
+	}
+	if (!dm_task_add_target(task, offset, sectors, type, args))
+		die("Couldn't add %s target of %"PRIu64" sectors to map",
+					type, sectors);
+	if (sectors % TABLE_4K_SECTORS)
+		table->unaligned_4k = TRUE;
+	if (child != NULL) {
+		child->sectors += sectors;
+		child->targets++;
+	}
+	table->sectors += sectors;
+	table->targets++;
+}
+
+static void table_add_linear(struct table *table, struct extent *extent)
+{
+	gchar *args;
+
+	args = g_strdup_printf("%s %"PRIu64, extent_device(extent)->path,
+				(uint64_t) extent->start_sect);
+	table->tier = MAX(table->tier, extent_device(extent)->disk->tier);
+	table_check_aligned(table, extent);
+	table_add_target(table, extent->sect_count, "linear", args);
+	g_free(args);
+}
+
+/* Add a striped target using stripe_sectors from each of the width
+   extents in stripes, starting at their start_sect. */
+static void table_add_striped(struct table *table, struct extent *stripes,
+			unsigned width, uint64_t chunk_sectors,
+			uint64_t stripe_sectors)
+{
+	GString *args;
+	unsigned n;
+
+	args = g_string_new(NULL);
+	g_string_append_printf(args, "%u %"PRIu64, width, chunk_sectors);
+	for (n = 0; n < width; n++) {
+		g_string_append_printf(args, " %s %"PRIu64,
+					extent_device(&stripes[n])->path,
+					(uint64_t) stripes[n].start_sect);
+		table->tier = MAX(table->tier,
+					extent_device(&stripes[n])->disk->tier);
+		table_check_aligned(table, &stripes[n]);
+	}
+	if (chunk_sectors % TABLE_4K_SECTORS)
+		table->unaligned_4k = TRUE;
+	table_add_target(table, width * stripe_sectors, "striped", args->str);
+	g_string_free(args, TRUE);
+	table->striped_sectors += width * stripe_sectors;
+}
+
+/* Run a DM task which takes nothing but a device name */
+static gboolean dm_device_simple(int type, const char *name)
+{
+	struct dm_task *dmt;
+	gboolean ret;
+
+	dmt = dm_task_create(type);
+	if (dmt == NULL)
+		die("Couldn't create DM task");
+	if (!dm_task_set_name(dmt, name))
+		die("Couldn't configure device name");
+	ret = dm_task_run(dmt);
+	dm_task_destroy(dmt);
+	return ret;
+}
+
+/* When extending, the reloaded table only takes effect on resume.  If
+   that fails, discard it again, so that the children it refers to can be
+   removed and the device keeps its old table. */
+static gboolean table_resume(struct table *table)
+{
+	if (!table->reload)
+		return TRUE;
+	if (dm_device_simple(DM_DEVICE_RESUME, table->name))
+		return TRUE;
+	warn("Couldn't resume device %s", table->name);
+	if (!dm_device_simple(DM_DEVICE_CLEAR, table->name))
+		warn("Couldn't clear inactive table of %s", table->name);
+	return FALSE;
+}
+
+/* Remove a device created by table_create(), children last */
+static void table_remove(struct table *table)
+{
+	struct table_child *child;
+	unsigned n;
+
+	if (!dm_device_simple(DM_DEVICE_REMOVE, table->name))
+		warn("Couldn't remove device %s", table->name);
+	for (n = table->children ? table->children->len : 0; n > 0; n--) {
+		child = g_ptr_array_index(table->children, n - 1);
+		if (!dm_device_simple(DM_DEVICE_REMOVE, child->name))
+			warn("Couldn't remove device %s", child->name);
+	}
+}
+
+/* Create the children, then the top-level device on top of them.  On
+   failure, remove whichever children were created. */
+static gboolean table_create(struct table *table)
+{
+	struct table_child *child;
+	struct dm_info info;
+	gchar *args;
+	unsigned n;
+
+	if (table->children == NULL)
+		return dm_task_run(table->task) && table_resume(table);
+
+	for (n = 0; n < table->children->len; n++) {
+		child = g_ptr_array_index(table->children, n);
+		if (dm_device_exists(child->name)) {
+			warn("Device %s already exists", child->name);
+			goto fail;
+		}
+	}
+	for (n = 0; n < table->children->len; n++) {
+		child = g_ptr_array_index(table->children, n);
+		if (!dm_task_run(child->task)) {
+			warn("Couldn't create device %s", child->name);
+			goto fail;
+		}
+		child->created = TRUE;
+		if (!dm_task_get_info(child->task, &info) || !info.exists) {
+			warn("Couldn't get info for device %s", child->name);
+			goto fail;
+		}
+		args = g_strdup_printf("%u:%u 0", info.major, info.minor);
+		if (!dm_task_add_target(table->task, child->start,
+					child->sectors, "linear", args))
+			die("Couldn't add %s to map", child->name);
+		g_free(args);
+	}
+	if (dm_task_run(table->task) && table_resume(table))
+		return TRUE;
+
+fail:
+	for (n = table->children->len; n > 0; n--) {
+		child = g_ptr_array_index(table->children, n - 1);
+		if (child->created && !dm_device_simple(DM_DEVICE_REMOVE,
+					child->name))
+			warn("Couldn't remove device %s", child->name);
+	}
+	return FALSE;
+}
+
+static void dm_task_print(struct dm_task *dmt)
+{
+	void *next = NULL;
+	uint64_t start;
+	uint64_t length;
+	char *type;
+	char *params;
+
+	do {
+		next = dm_get_next_target(dmt, next, &start, &length, &type,
+					&params);
+		if (type != NULL)
+			printf("%"PRIu64" %"PRIu64" %s %s\n", start, length,
+						type, params);
+	} while (next != NULL);
+}
+
+/* Write the table to stdout for --plan-only.  A split map is printed as
+   each child's table and then the top-level one, each introduced by a
+   comment line naming the device, which dmsetup ignores. */
+static void table_print(struct table *table)
+{
+	struct table_child *child;
+	unsigned n;
+
+	if (table->children == NULL) {
+		dm_task_print(table->task);
+		return;
+	}
+	for (n = 0; n < table->children->len; n++) {
+		child = g_ptr_array_index(table->children, n);
+		printf("# %s\n", child->name);
+		dm_task_print(child->task);
+	}
+	printf("# %s\n", table->name);
+	for (n = 0; n < table->children->len; n++) {
+		child = g_ptr_array_index(table->children, n);
+		printf("%"PRIu64" %"PRIu64" linear %s/%s 0\n", child->start,
+					child->sectors, dm_dir(), child->name);
+	}
+}
+
+static void table_report(struct table *table)
+{
+	struct table_child *child;
+	unsigned n;
+
+	if (table->children == NULL)
+		return;
+	info("Split map into %u child devices", table->children->len);
+	report(0, "tables:");
+	for (n = 0; n < table->children->len; n++) {
+		child = g_ptr_array_index(table->children, n);
+		report(1, "- name: %s", child->name);
+		report(2, "size-kb: %"PRIu64, child->sectors / 2);
+		report(2, "targets: %u", child->targets);
+	}
+}
+
+/* Existing maps, for --extend.  The new table is the old one with the
+   new extents appended, loaded with a reload and resume so that the
+   device stays open and the layers above it can grow into the new space.
+   Every device the old table uses, directly or through a child of a split
+   map, is excluded from the scan. */
+
+/* The table of a crypt target includes its key, so have libdevmapper
+   wipe its buffers.  Callers which see one must wipe the params they
+   were given, and any copies, before destroying the task. */
+static struct dm_task *dm_table_get(const char *name)
+{
+	struct dm_task *dmt;
+
+	dmt = dm_task_create(DM_DEVICE_TABLE);
+	if (dmt == NULL)
+		die("Couldn't create DM task");
+	if (!dm_task_set_name(dmt, name))
+		die("Couldn't configure device name");
+	if (!dm_task_secure_data(dmt))
+		die("Couldn't configure DM task");
+	if (!dm_task_run(dmt))
+		die("Couldn't read table of %s", name);
+	return dmt;
+}
+
+static void dm_table_mapped(const char *top, const char *name,
+			GHashTable *mapped, unsigned *next_child);
+
+/* Record a "major:minor" from a table line, and follow it if it is one
+   of our children */
+static void dm_table_add_mapped(const char *top, const char *devnum,
+			GHashTable *mapped, unsigned *next_child)
+{
+	gchar *file;
+	gchar *dmname;
+	const char *suffix;
+	char *end;
+	unsigned long n;
+
+	g_hash_table_add(mapped, g_strdup(devnum));
+	file = g_build_filename("/sys/dev/block", devnum, "dm", "name", NULL);
+	if (!g_file_get_contents(file, &dmname, NULL, NULL)) {
+		g_free(file);
+		return;
+	}
+	g_free(file);
+	g_strstrip(dmname);
+	if (g_str_has_prefix(dmname, top) && dmname[strlen(top)] == '-') {
+		suffix = dmname + strlen(top) + 1;
+		n = strtoul(suffix, &end, 10);
+		if (g_ascii_isdigit(*suffix) && *end == 0) {
+			*next_child = MAX(*next_child, n + 1);
+			dm_table_mapped(top, dmname, mapped, next_child);
+		}
+	}
+	g_free(dmname);
+}
+
+/* We only ever create linear and striped targets */
+static void dm_table_mapped(const char *top, const char *name,
+			GHashTable *mapped, unsigned *next_child)
+{
+	struct dm_task *dmt;
+	void *next = NULL;
+	uint64_t start;
+	uint64_t length;
+	char *type;
+	char *params;
+	gchar **words;
+	unsigned width;
+	unsigned n;
+
+	dmt = dm_table_get(name);
+	do {
+		next = dm_get_next_target(dmt, next, &start, &length, &type,
+					&params);
+		if (type == NULL)
+			continue;
+		words = g_strsplit(params, " ", 0);
+		if (!strcmp(type, "linear") && g_strv_length(words) == 2) {
+			dm_table_add_mapped(top, words[0], mapped,
+						next_child);
+		} else if (!strcmp(type, "striped") &&
+					g_strv_length(words) >= 2 &&
+					(width = strtoul(words[0], NULL, 10))
+					> 0 && g_strv_length(words) ==
+					2 + 2 * width) {
+			for (n = 0; n < width; n++)
+				dm_table_add_mapped(top, words[2 + 2 * n],
+							mapped, next_child);
+		} else {
+			/* Not params, which may hold a crypt key */
+			die("%s: Can't extend table containing %s target",
+						name, type);
+		}
+		g_strfreev(words);
+	} while (next != NULL);
+	dm_task_destroy(dmt);
+}
+
+/* Add the device numbers used by name, and name itself, to excluded.
+   Returns the number to give the first new child. */
+static unsigned extend_exclude(const char *name, GHashTable *excluded)
+{
+	struct dm_task *dmt;
+	struct dm_info info;
+	unsigned next_child = 0;
+
+	dmt = dm_table_get(name);
+	if (!dm_task_get_info(dmt, &info) || !info.exists)
+		die("Couldn't get info for device %s", name);
+	g_hash_table_add(excluded, g_strdup_printf("%u:%u", info.major,
+				info.minor));
+	dm_task_destroy(dmt);
+	dm_table_mapped(name, name, excluded, &next_child);
+	return next_child;
+}
+
+/* Start the new table with the targets of the existing one */
+static void table_init_extend(struct table *table, unsigned first_child)
+{
+	struct dm_task *dmt;
+	void *next = NULL;
+	uint64_t start;
+	uint64_t length;
+	char *type;
+	char *params;
+
+	table->reload = TRUE;
+	table->first_child = first_child;
+	dmt = dm_table_get(table->name);
+	do {
+		next = dm_get_next_target(dmt, next, &start, &length, &type,
+					&params);
+		if (type == NULL)
+			continue;
+		if (start != table->sectors)
+			die("%s: Table has a hole at sector %"PRIu64,
+						table->name, table->sectors);
+		if (!dm_task_add_target(table->task, start, length, type,
+					params))
+			die("Couldn't copy existing table of %s",
+						table->name);
+		if (length % TABLE_4K_SECTORS)
+			table->unaligned_4k = TRUE;
+		table->sectors += length;
+	} while (next != NULL);
+	dm_task_destroy(dmt);
+	table->base_sectors = table->sectors;
+}
+
+/* Scratch stack */
+
+/* --stack replaces cryptsetup, LVM, and mkswap at boot: NODE is encrypted
+   with a throwaway key into PREFIX-crypt, which is split by two linear
+   targets into PREFIX-swap and PREFIX-home.  The key is never stored, so
+   the contents are unrecoverable once the devices are removed. */
+
+/* Candidate ciphers for PREFIX-crypt.  Without AES instructions, one of
+   the software-friendly ciphers can be several times faster than AES, so
+   with --cipher auto each is timed through the kernel crypto API (AF_ALG),
+   which picks the same implementation dm-crypt will, and the fastest is
+   used.  The first entry is the fallback if none can be timed. */
+struct crypt_cipher {
+	const char *name;
+	const char *spec;  /* dm-crypt */
+	const char *alg;  /* kernel crypto API */
+	unsigned key_bytes;
+	unsigned iv_bytes;
+};
+
+static const struct crypt_cipher crypt_ciphers[] = {
+	{"aes-xts", "aes-xts-plain64", "xts(aes)", 64, 16},
+	{"serpent-xts", "serpent-xts-plain64", "xts(serpent)", 64, 16},
+	{"twofish-xts", "twofish-xts-plain64", "xts(twofish)", 64, 16},
+	{"adiantum-xchacha12", "capi:adiantum(xchacha12,aes)-plain64",
+				"adiantum(xchacha12,aes)", 32, 32},
+	{"adiantum-xchacha20", "capi:adiantum(xchacha20,aes)-plain64",
+				"adiantum(xchacha20,aes)", 32, 32},
+};
+
+#define CRYPT_MAX_KEY_BYTES 64
+#define CRYPT_MAX_IV_BYTES 32
+#define CRYPT_BENCH_USEC 10000
+#define CRYPT_BENCH_ROUNDS 3
+/* Optional parameters for 4 KB crypt sectors, with IVs counting them */
+#define CRYPT_4K_OPTIONS "sector_size:4096 iv_large_sectors"
+
+/* Return the encryption throughput of the cipher in MB/s, or 0 if the
+   kernel doesn't have it.  Each request is one crypt sector of
+   sector_bytes with its own IV, which is how dm-crypt drives the cipher,
+   so that per-sector setup cost counts against ciphers which have more
+   of it. */
+static uint64_t crypt_benchmark(const struct crypt_cipher *cipher,
+			unsigned sector_bytes)
+{
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "skcipher",
+	};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(uint32_t)) +
+					CMSG_SPACE(sizeof(struct af_alg_iv) +
+					CRYPT_MAX_IV_BYTES)];
+	} control;
+	uint8_t key[CRYPT_MAX_KEY_BYTES];
+	struct msghdr msgh;
+	struct cmsghdr *cmsg;
+	struct af_alg_iv *iv;
+	struct iovec iov;
+	uint8_t *buf;
+	int64_t start;
+	int64_t elapsed = 0;
+	uint64_t bytes = 0;
+	uint64_t sector;
+	unsigned n;
+	int tfmfd;
+	int opfd = -1;
+
+	g_strlcpy((char *) sa.salg_name, cipher->alg, sizeof(sa.salg_name));
+	/* xts rejects keys whose halves match */
+	for (n = 0; n < sizeof(key); n++)
+		key[n] = n;
+	tfmfd = socket(AF_ALG, SOCK_SEQPACKET, 0);
+	if (tfmfd == -1)
+		return 0;
+	if (bind(tfmfd, (struct sockaddr *) &sa, sizeof(sa)) ||
+				setsockopt(tfmfd, SOL_ALG, ALG_SET_KEY, key,
+				cipher->key_bytes) ||
+				(opfd = accept(tfmfd, NULL, 0)) == -1) {
+		close(tfmfd);
+		return 0;
+	}
+
+	memset(&control, 0, sizeof(control));
+	memset(&msgh, 0, sizeof(msgh));
+	buf = g_malloc0(sector_bytes);
+	iov.iov_base = buf;
+	iov.iov_len = sector_bytes;
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_control = control.buf;
+	msgh.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msgh);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type = ALG_SET_OP;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+	*(uint32_t *) CMSG_DATA(cmsg) = ALG_OP_ENCRYPT;
+	cmsg = CMSG_NXTHDR(&msgh, cmsg);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type = ALG_SET_IV;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) +
+				cipher->iv_bytes);
+	iv = (struct af_alg_iv *) CMSG_DATA(cmsg);
+	iv->ivlen = cipher->iv_bytes;
+	msgh.msg_controllen = CMSG_SPACE(sizeof(uint32_t)) +
+				CMSG_SPACE(sizeof(struct af_alg_iv) +
+				cipher->iv_bytes);
+
+	start = g_get_monotonic_time();
+	do {
+		/* plain64: the little-endian sector number */
+		sector = GUINT64_TO_LE(bytes / sector_bytes);
+		memcpy(iv->iv, &sector, sizeof(sector));
+		if (sendmsg(opfd, &msgh, 0) != (ssize_t) sector_bytes ||
+					read(opfd, buf, sector_bytes) !=
+					(ssize_t) sector_bytes) {
+			bytes = 0;
+			break;
+		}
+		bytes += sector_bytes;
+		elapsed = g_get_monotonic_time() - start;
+	} while (elapsed < CRYPT_BENCH_USEC);
+
+	g_free(buf);
+	close(opfd);
+	close(tfmfd);
+	if (bytes == 0)
+		return 0;
+	return MAX(bytes * 1000000 / elapsed >> 20, 1);
+}
+
+/* Pick the cipher for PREFIX-crypt, recording the measurements.  A
+   single short run is at the mercy of frequency scaling and other
+   processes, so the ciphers are timed in several interleaved rounds and
+   each keeps its best. */
+static const struct crypt_cipher *crypt_select(unsigned sector_bytes)
+{
+	const struct crypt_cipher *best = NULL;
+	uint64_t mbps[G_N_ELEMENTS(crypt_ciphers)] = {0};
+	uint64_t best_mbps = 0;
+	unsigned round;
+	unsigned n;
+
+	if (strcmp(cipher_name, "auto")) {
+		for (n = 0; n < G_N_ELEMENTS(crypt_ciphers); n++)
+			if (!strcmp(cipher_name, crypt_ciphers[n].name))
+				return &crypt_ciphers[n];
+		die("Unknown cipher %s", cipher_name);
+	}
+
+	for (round = 0; round < CRYPT_BENCH_ROUNDS; round++)
+		for (n = 0; n < G_N_ELEMENTS(crypt_ciphers); n++)
+			if (round == 0 || mbps[n])
+				mbps[n] = MAX(mbps[n], crypt_benchmark(
+							&crypt_ciphers[n],
+							sector_bytes));
+	report(0, "cipher-benchmark:");
+	for (n = 0; n < G_N_ELEMENTS(crypt_ciphers); n++) {
+		if (mbps[n] == 0) {
+			msg("Cipher %s: unavailable", crypt_ciphers[n].name);
+			continue;
+		}
+		msg("Cipher %s: %"PRIu64" MB/s", crypt_ciphers[n].name,
+					mbps[n]);
+		report(1, "- cipher: %s", crypt_ciphers[n].name);
+		report(2, "mbps: %"PRIu64, mbps[n]);
+		if (mbps[n] > best_mbps) {
+			best = &crypt_ciphers[n];
+			best_mbps = mbps[n];
+		}
+	}
+	if (best == NULL) {
+		warn("Couldn't benchmark ciphers; using %s",
+					crypt_ciphers[0].name);
+		return &crypt_ciphers[0];
+	}
+	info("Using cipher %s, %"PRIu64" MB/s", best->name, best_mbps);
+	return best;
+}
+
+/* dm-crypt normally defers encryption to workqueues, which lets it batch
+   and sort writes for slow disks but adds latency in front of fast ones.
+   If every disk in the map is solid-state, bypass the queues (Linux
+   5.9+).  Otherwise keep them, but encrypt on the submitting CPU so that
+   requests stay in order per CPU. */
+static const char *crypt_flags(struct table *table)
+{
+	if (table->tier <= TIER_SSD)
+		return "no_read_workqueue no_write_workqueue";
+	return "same_cpu_crypt";
+}
+
+/* Append the optional parameters of a crypt target, which are preceded
+   by their count */
+static void crypt_append_options(GString *params, const char *flags,
+			const char *sector_options)
+{
+	gchar *options;
+	gchar **words;
+	unsigned count = 0;
+	unsigned n;
+
+	options = g_strdup_printf("%s %s", flags, sector_options);
+	words = g_strsplit(options, " ", 0);
+	for (n = 0; words[n] != NULL; n++)
+		if (*words[n])
+			count++;
+	if (count)
+		g_string_append_printf(params, " %u", count);
+	for (n = 0; words[n] != NULL; n++)
+		if (*words[n])
+			g_string_append_printf(params, " %s", words[n]);
+	g_strfreev(words);
+	g_free(options);
+}
+
+struct stage {
+	const char *name;
+	int64_t usec;
+};
+
+/* Record the time since *start for the named stage, and restart the
+   clock */
+static void stage_done(const char *name, int64_t *start)
+{
+	struct stage stage = {
+		.name = name,
+	};
+	int64_t now = g_get_monotonic_time();
+
+	stage.usec = now - *start;
+	*start = now;
+	msg("Stage %s: %"PRId64" ms", name, stage.usec / 1000);
+	g_array_append_val(stages, stage);
+}
+
+static void stage_report(void)
+{
+	struct stage *stage;
+	unsigned n;
+
+	report(0, "stages:");
+	for (n = 0; n < stages->len; n++) {
+		stage = &g_array_index(stages, struct stage, n);
+		report(1, "- name: %s", stage->name);
+		report(2, "ms: %"PRId64, stage->usec / 1000);
+	}
+}
+
+/* Create a single-target device and wait for its node to appear.  Returns
+   its device number, or NULL on failure. */
+static gchar *dm_create_single(const char *name, uint64_t sectors,
+			const char *type, const char *params,
+			gboolean secure)
+{
+	struct dm_task *dmt;
+	struct dm_info info;
+	uint32_t cookie = 0;
+	gchar *devnum = NULL;
+
+	dmt = dm_task_create(DM_DEVICE_CREATE);
+	if (dmt == NULL)
+		die("Couldn't create DM task");
+	if (!dm_task_set_name(dmt, name))
+		die("Couldn't set device name");
+	if (secure && !dm_task_secure_data(dmt))
+		die("Couldn't configure DM task");
+	if (!dm_task_add_target(dmt, 0, sectors, type, params))
+		die("Couldn't add %s target to %s", type, name);
+	if (!dm_task_set_cookie(dmt, &cookie, 0))
+		die("Couldn't configure DM task");
+	if (!dm_task_run(dmt)) {
+		msg("Couldn't create device %s", name);
+		dm_udev_wait(cookie);
+		dm_task_destroy(dmt);
+		return NULL;
+	}
+	dm_udev_wait(cookie);
+	if (dm_task_get_info(dmt, &info) && info.exists)
+		devnum = g_strdup_printf("%u:%u", info.major, info.minor);
+	else
+		warn("Couldn't get info for device %s", name);
+	dm_task_destroy(dmt);
+	return devnum;
+}
+
+/* Write a version 1 swap header, as mkswap would.  The header is in
+   native byte order, and its size fields count pages. */
+static gboolean stack_format_swap(const char *path, uint64_t sectors)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	uint8_t *page;
+	uint32_t field;
+	int fd;
+	gboolean ret = FALSE;
+
+	page = g_malloc0(pagesize);
+	field = 1;  /* version */
+	memcpy(page + 1024, &field, 4);
+	field = (sectors << 9) / pagesize - 1;  /* last page */
+	memcpy(page + 1028, &field, 4);
+	/* bytes 1032-1035 hold the bad page count, which is zero */
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd == -1 || read(fd, page + 1036, 16) != 16) {
+		warn("Couldn't generate swap UUID");
+		goto out;
+	}
+	close(fd);
+	/* RFC 4122 version 4 */
+	page[1036 + 6] = (page[1036 + 6] & 0x0f) | 0x40;
+	page[1036 + 8] = (page[1036 + 8] & 0x3f) | 0x80;
+	memcpy(page + pagesize - 10, "SWAPSPACE2", 10);
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1) {
+		warn("Couldn't open %s", path);
+		goto out;
+	}
+	if (pwrite(fd, page, pagesize, 0) != pagesize || fsync(fd)) {
+		warn("Couldn't write swap header to %s", path);
+		goto out;
+	}
+	ret = TRUE;
+out:
+	if (fd != -1)
+		close(fd);
+	g_free(page);
+	return ret;
+}
+
+/* Remove whichever of the stack devices exist, top first */
+static void stack_remove(void)
+{
+	static const char *const suffixes[] = {"home", "swap", "crypt"};
+	gchar *name;
+	unsigned n;
+
+	for (n = 0; n < G_N_ELEMENTS(suffixes); n++) {
+		name = g_strdup_printf("%s-%s", stack_prefix, suffixes[n]);
+		if (dm_device_exists(name) &&
+					!dm_device_simple(DM_DEVICE_REMOVE,
+					name))
+			warn("Couldn't remove device %s", name);
+		g_free(name);
+	}
+}
+
+/* Build the stack on top of the newly created table */
+static gboolean stack_create(struct table *table, int64_t *start)
+{
+	struct dm_info info;
+	const struct crypt_cipher *cipher;
+	const char *flags;
+	const char *sector_options;
+	unsigned sector_bytes;
+	uint8_t key[CRYPT_MAX_KEY_BYTES];
+	GString *params;
+	gchar *name;
+	gchar *crypt_dev;
+	gchar *dev;
+	gchar *path;
+	uint64_t swap_sectors = (uint64_t) swap_mb << 11;
+	unsigned n;
+	int fd;
+	gboolean ret;
+
+	if (!dm_task_get_info(table->task, &info) || !info.exists) {
+		warn("Couldn't get info for device %s", table->name);
+		return FALSE;
+	}
+	/* 4 KB crypt sectors cut the per-sector cost to an eighth, but a
+	   target boundary inside one would leave the kernel a partial
+	   sector */
+	if (table->unaligned_4k) {
+		sector_options = "";
+		sector_bytes = 512;
+	} else {
+		sector_options = CRYPT_4K_OPTIONS;
+		sector_bytes = 4096;
+	}
+	cipher = crypt_select(sector_bytes);
+	flags = crypt_flags(table);
+	stage_done("cipher-select", start);
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd == -1 || read(fd, key, cipher->key_bytes) !=
+				cipher->key_bytes) {
+		warn("Couldn't generate encryption key");
+		if (fd != -1)
+			close(fd);
+		return FALSE;
+	}
+	close(fd);
+	params = g_string_new(cipher->spec);
+	g_string_append_c(params, ' ');
+	for (n = 0; n < cipher->key_bytes; n++)
+		g_string_append_printf(params, "%.2x", key[n]);
+	g_string_append_printf(params, " 0 %u:%u 0", info.major, info.minor);
+	memset(key, 0, sizeof(key));
+	name = g_strdup_printf("%s-crypt", stack_prefix);
+	n = params->len;
+	crypt_append_options(params, flags, sector_options);
+	crypt_dev = dm_create_single(name, table->sectors, "crypt",
+				params->str, TRUE);
+	if (crypt_dev == NULL) {
+		/* Kernels before 5.9 don't know the workqueue flags */
+		msg("Retrying %s without \"%s\"", name, flags);
+		flags = "";
+		g_string_truncate(params, n);
+		crypt_append_options(params, flags, sector_options);
+		crypt_dev = dm_create_single(name, table->sectors, "crypt",
+					params->str, TRUE);
+	}
+	memset(params->str, 0, params->len);
+	g_string_free(params, TRUE);
+	if (crypt_dev == NULL) {
+		warn("Couldn't create device %s", name);
+		g_free(name);
+		return FALSE;
+	}
+	g_free(name);
+	report(0, "crypt-cipher: %s", cipher->spec);
+	report(0, "crypt-key-bits: %u", cipher->key_bytes * 8);
+	report(0, "crypt-flags: \"%s\"", flags);
+	report(0, "crypt-sector-bytes: %u", sector_bytes);
+	stage_done("crypt", start);
+
+	params = g_string_new(NULL);
+	g_string_printf(params, "%s 0", crypt_dev);
+	name = g_strdup_printf("%s-swap", stack_prefix);
+	dev = dm_create_single(name, swap_sectors, "linear", params->str,
+				FALSE);
+	if (dev == NULL)
+		warn("Couldn't create device %s", name);
+	g_free(name);
+	if (dev == NULL)
+		goto fail;
+	g_free(dev);
+	g_string_printf(params, "%s %"PRIu64, crypt_dev, swap_sectors);
+	name = g_strdup_printf("%s-home", stack_prefix);
+	dev = dm_create_single(name, table->sectors - swap_sectors, "linear",
+				params->str, FALSE);
+	if (dev == NULL)
+		warn("Couldn't create device %s", name);
+	g_free(name);
+	if (dev == NULL)
+		goto fail;
+	g_free(dev);
+	stage_done("volumes", start);
+
+	path = g_strdup_printf("%s/%s-swap", dm_dir(), stack_prefix);
+	ret = stack_format_swap(path, swap_sectors);
+	g_free(path);
+	if (!ret)
+		goto fail;
+	stage_done("swap-format", start);
+
+	report(0, "swap-kb: %"PRIu64, swap_sectors / 2);
+	report(0, "home-kb: %"PRIu64, (table->sectors - swap_sectors) / 2);
+	g_string_free(params, TRUE);
+	g_free(crypt_dev);
+	return TRUE;
+
+fail:
+	g_string_free(params, TRUE);
+	g_free(crypt_dev);
+	stack_remove();
+	return FALSE;
+}
+
+/* Grow a single linear or crypt target to the end of its grown backing
+   device, which is end sectors long.  A crypt target with 4 KB sectors
+   can only grow over 4 KB aligned targets; returns FALSE if it was left
+   alone for that reason. */
+static gboolean stack_grow_one(const char *name, uint64_t end,
+			gboolean unaligned_4k)
+{
+	struct dm_task *old;
+	struct dm_task *dmt;
+	void *next;
+	uint64_t start;
+	uint64_t length;
+	uint64_t offset;
+	char *type;
+	char *params;
+	gchar **words;
+	unsigned word;
+	unsigned n;
+
+	old = dm_table_get(name);
+	next = dm_get_next_target(old, NULL, &start, &length, &type,
+				&params);
+	if (next != NULL || type == NULL || start != 0)
+		die("%s: Expected a single target", name);
+	if (!strcmp(type, "linear"))
+		word = 1;
+	else if (!strcmp(type, "crypt"))
+		word = 4;
+	else
+		die("%s: Can't grow %s target", name, type);
+	words = g_strsplit(params, " ", 0);
+	if (g_strv_length(words) <= word)
+		die("%s: Couldn't parse table", name);
+	offset = g_ascii_strtoull(words[word], NULL, 10);
+	for (n = 0; words[n] != NULL; n++)
+		memset(words[n], 0, strlen(words[n]));
+	g_strfreev(words);
+	if (offset >= end)
+		die("%s: Backing device is too small", name);
+	if (unaligned_4k && strstr(params, " sector_size:4096") != NULL) {
+		memset(params, 0, strlen(params));
+		dm_task_destroy(old);
+		warn("%s: New space isn't 4 KB aligned, not growing", name);
+		return FALSE;
+	}
+
+	dmt = dm_task_create(DM_DEVICE_RELOAD);
+	if (dmt == NULL)
+		die("Couldn't create DM task");
+	if (!dm_task_set_name(dmt, name))
+		die("Couldn't set device name");
+	if (!dm_task_secure_data(dmt))
+		die("Couldn't configure DM task");
+	if (!dm_task_add_target(dmt, 0, end - offset, type, params))
+		die("Couldn't add %s target to %s", type, name);
+	if (!dm_task_run(dmt))
+		die("Couldn't reload device %s", name);
+	dm_task_destroy(dmt);
+	memset(params, 0, strlen(params));
+	dm_task_destroy(old);
+	/* Don't leave the new table loaded behind the old one */
+	if (!dm_device_simple(DM_DEVICE_RESUME, name)) {
+		if (!dm_device_simple(DM_DEVICE_CLEAR, name))
+			warn("Couldn't clear inactive table of %s", name);
+		die("Couldn't resume device %s", name);
+	}
+	msg("Grew %s to %"PRIu64" MB", name, (end - offset) >> 11);
+	return TRUE;
+}
+
+/* After --extend, grow PREFIX-crypt and then PREFIX-home into the new
+   space.  The filesystem on PREFIX-home is left to resize2fs. */
+static void stack_grow(struct table *table)
+{
+	gchar *name;
+	gboolean ret;
+
+	name = g_strdup_printf("%s-crypt", stack_prefix);
+	ret = stack_grow_one(name, table->sectors, table->unaligned_4k);
+	g_free(name);
+	if (!ret)
+		return;
+	name = g_strdup_printf("%s-home", stack_prefix);
+	stack_grow_one(name, table->sectors, FALSE);
+	g_free(name);
+}
+
+/* Extent list */
+
+/* The length of the DM table needs to be bounded, since it's just a
+   vmalloc'd array in kernel memory, and vmalloc space is generally
+   limited to 128 MiB.  (--table-targets splits the map across several
+   tables, so that max_extent_count can be raised well beyond what one
+   table could hold.)  We want the table to contain the largest
+   available extents, sorted by physical disk and absolute sector number,
+   so that a sequential pass over the DM device is a forward sweep of
+   each disk in turn.
+
+   Algorithm:
+
+   1. Append extents to an array with room for max_extent_count extents
+      plus a batch of extra candidates.
+   2. When max_extent_count extents have been collected, and whenever the
+      array fills up after that, partition it with a quickselect so that
+      the largest max_extent_count extents come first, and drop the rest.
+      The smallest survivor becomes the floor: later extents which don't
+      rank above it can never be selected and are discarded on arrival.
+   3. Once all extents have been offered, select one last time, then sort
+      the array by disk and sector number and add its entries to a DM
+      table.
+
+   Each insert is amortized constant time, rather than the O(log n) of
+   maintaining a heap.
+
+   Each scan thread fills its own set, and the sets are merged into the
+   global one once scanning is complete.  To make the merged result
+   independent of the order in which extents arrive, extents of equal
+   length are ranked by device and sector number, with earlier extents
+   ranking higher.
+ */
+
+struct extent_set {
+	struct extent *extents;
+	unsigned used;
+	unsigned allocated;
+	/* The smallest extent kept by the last selection, if any */
+	gboolean selected;
+	struct extent floor;
+};
+
+static gboolean extent_less(const struct extent *a, const struct extent *b)
+{
+	if (a->sect_count != b->sect_count)
+		return a->sect_count < b->sect_count;
+	if (a->device != b->device)
+		return a->device > b->device;
+	return a->start_sect > b->start_sect;
+}
+
+static void extent_swap(struct extent *a, struct extent *b)
+{
+	struct extent tmp;
+
+	tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+/* Largest first */
+static int extent_compare_rank(const void *_a, const void *_b)
+{
+	const struct extent *a = _a;
+	const struct extent *b = _b;
+
+	if (extent_less(b, a))
+		return -1;
+	if (extent_less(a, b))
+		return 1;
+	return 0;
+}
+
+#define EXTENT_SELECT_SORT 16
+
+/* Rearrange the n extents in list so that the k largest come first, in
+   no particular order, with the smallest of them at k - 1.  This is a
+   quickselect with a median-of-three pivot.  If partitioning stops
+   making progress we sort what's left instead, bounding the worst case
+   at O(n log n). */
+static void extent_select(struct extent *list, unsigned n, unsigned k)
+{
+	unsigned lo = 0;
+	unsigned hi = n;
+	unsigned mid;
+	unsigned store;
+	unsigned i;
+	unsigned depth = 2 * g_bit_storage(n);
+
+	while (hi - lo > EXTENT_SELECT_SORT) {
+		if (depth-- == 0)
+			break;
+		/* Move the median of three to hi - 1 */
+		mid = lo + (hi - lo) / 2;
+		if (extent_less(&list[lo], &list[mid]))
+			extent_swap(&list[lo], &list[mid]);
+		if (extent_less(&list[hi - 1], &list[mid]))
+			extent_swap(&list[hi - 1], &list[mid]);
+		else if (extent_less(&list[lo], &list[hi - 1]))
+			extent_swap(&list[lo], &list[hi - 1]);
+		/* Larger extents to the left of the pivot */
+		for (i = store = lo; i < hi - 1; i++)
+			if (extent_less(&list[hi - 1], &list[i]))
+				extent_swap(&list[i], &list[store++]);
+		extent_swap(&list[store], &list[hi - 1]);
+		if (store == k - 1)
+			return;
+		if (store > k - 1)
+			hi = store;
+		else
+			lo = store + 1;
+	}
+	qsort(list + lo, hi - lo, sizeof(*list), extent_compare_rank);
+}
+
+/* Room for the extents being kept plus a batch of new candidates */
+static unsigned extent_set_capacity(void)
+{
+	return max_extent_count + MAX(max_extent_count / 4, 1024);
+}
+
+/* Keep only the largest max_extent_count extents */
+static void extent_set_select(struct extent_set *set)
+{
+	if (set->used < max_extent_count)
+		return;
+	extent_select(set->extents, set->used, max_extent_count);
+	set->used = max_extent_count;
+	set->floor = set->extents[max_extent_count - 1];
+	set->selected = TRUE;
+}
+
+static struct extent_set *extent_set_new(void)
+{
+	return g_slice_new0(struct extent_set);
+}
+
+static void extent_set_free(struct extent_set *set)
+{
+	g_free(set->extents);
+	g_slice_free(struct extent_set, set);
+}
+
+static void extent_set_add(struct extent_set *set, const struct extent *new)
+{
+	if (new->sect_count == 0 || new->sect_count < min_extent_sectors)
+		return;
+	if (set->selected && !extent_less(&set->floor, new))
+		return;
+	if (set->used == set->allocated) {
+		if (set->allocated == extent_set_capacity()) {
+			extent_set_select(set);
+			if (!extent_less(&set->floor, new))
+				return;
+		} else {
+			set->allocated = MIN(MAX(2 * set->allocated, 1024),
+						extent_set_capacity());
+			set->extents = g_renew(struct extent, set->extents,
+						set->allocated);
+		}
+	}
+	set->extents[set->used++] = *new;
+	/* Establish a floor as early as possible, for pruning */
+	if (!set->selected && set->used == max_extent_count)
+		extent_set_select(set);
+}
+
+/* Keep only as many of the largest extents as are needed to reach
+   sectors.  Must follow a final extent_set_select(). */
+static void extent_set_limit(struct extent_set *set, uint64_t sectors)
+{
+	uint64_t total = 0;
+	unsigned n;
+
+	qsort(set->extents, set->used, sizeof(*set->extents),
+				extent_compare_rank);
+	for (n = 0; n < set->used && total < sectors; n++)
+		total += set->extents[n].sect_count;
+	set->used = n;
+}
+
+static void extent_set_merge(struct extent_set *dest, struct extent_set *src)
+{
+	unsigned n;
+
+	for (n = 0; n < src->used; n++)
+		extent_set_add(dest, &src->extents[n]);
+}
+
+/* Extent traces */
+
+/* --trace records every extent offered by the scanners, along with
+   enough about each device and disk to run them through selection and
+   layout again with --replay, without the disks.  Integers are unsigned
+   LEB128 varints; signed ones are zigzag-encoded first, and strings are
+   a length followed by the bytes.  The file is:
+
+     "GFSTRACE", version
+     disk count; for each: name, path, tier, alignment, read KB/s
+     device count; for each: path, type, sectors, disk, start on disk,
+         whole-disk flag
+     blocks of extent records, each preceded by its length in bytes
+     a zero length
+     problem count; for each: device, text
+
+   An extent record is the device index plus one, or zero if it's the
+   device of the previous record in the block; then the start, as a
+   signed delta from the end of that previous record if the device is the
+   same; then the length.  Each thread fills a block of its own, so
+   threads only contend to write a full one. */
+
+#define TRACE_MAGIC "GFSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BLOCK_SIZE 65536
+#define TRACE_RECORD_MAX 30
+
+struct trace_block {
+	uint8_t buf[TRACE_BLOCK_SIZE];
+	unsigned len;
+	unsigned device;  /* of the previous record, plus one */
+	uint64_t end;  /* of the previous record */
+};
+
+FILE *trace_out;
+GMutex trace_lock;
+
+static unsigned varint_encode(uint8_t *buf, uint64_t val)
+{
+	unsigned len = 0;
+
+	while (val >= 0x80) {
+		buf[len++] = val | 0x80;
+		val >>= 7;
+	}
+	buf[len++] = val;
+	return len;
+}
+
+static uint64_t zigzag_encode(int64_t val)
+{
+	return ((uint64_t) val << 1) ^ (uint64_t) (val >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t val)
+{
+	return (int64_t) (val >> 1) ^ -(int64_t) (val & 1);
+}
+
+static void trace_append_varint(GByteArray *arr, uint64_t val)
+{
+	uint8_t buf[10];
+
+	g_byte_array_append(arr, buf, varint_encode(buf, val));
+}
+
+static void trace_append_string(GByteArray *arr, const char *str)
+{
+	trace_append_varint(arr, strlen(str));
+	g_byte_array_append(arr, (const uint8_t *) str, strlen(str));
+}
+
+static void trace_write(GByteArray *arr)
+{
+	if (fwrite(arr->data, 1, arr->len, trace_out) != arr->len)
+		die("Couldn't write trace");
+}
+
+static void trace_block_write(struct trace_block *block)
+{
+	uint8_t hdr[10];
+	unsigned len;
+
+	if (block->len == 0)
+		return;
+	len = varint_encode(hdr, block->len);
+	g_mutex_lock(&trace_lock);
+	if (fwrite(hdr, 1, len, trace_out) != len ||
+				fwrite(block->buf, 1, block->len, trace_out) !=
+				block->len)
+		die("Couldn't write trace");
+	g_mutex_unlock(&trace_lock);
+	block->len = 0;
+	block->device = 0;
+}
+
+/* Runs when each scan thread exits */
+static void trace_block_free(void *block)
+{
+	trace_block_write(block);
+	g_free(block);
+}
+
+GPrivate trace_block_key = G_PRIVATE_INIT(trace_block_free);
+
+static void trace_open(void)
+{
+	trace_out = fopen(trace_file, "wb");
+	if (trace_out == NULL)
+		die("Couldn't open %s", trace_file);
+}
+
+/* Called once the disks are ordered and before any extents are found */
+static void trace_write_header(void)
+{
+	GByteArray *arr;
+	GHashTableIter iter;
+	struct disk **by_index;
+	struct disk *disk;
+	struct device *device;
+	unsigned count = g_hash_table_size(disks);
+	unsigned n;
+
+	by_index = g_new0(struct disk *, count);
+	g_hash_table_iter_init(&iter, disks);
+	while (g_hash_table_iter_next(&iter, NULL, (void **) &disk))
+		by_index[disk->index] = disk;
+
+	arr = g_byte_array_new();
+	g_byte_array_append(arr, (const uint8_t *) TRACE_MAGIC,
+				strlen(TRACE_MAGIC));
+	trace_append_varint(arr, TRACE_VERSION);
+	trace_append_varint(arr, count);
+	for (n = 0; n < count; n++) {
+		disk = by_index[n];
+		trace_append_string(arr, disk->name);
+		trace_append_string(arr, disk->path);
+		trace_append_varint(arr, disk->tier);
+		trace_append_varint(arr, disk->align_sectors);
+		trace_append_varint(arr, disk->read_kbps);
+	}
+	trace_append_varint(arr, device_list->len);
+	for (n = 0; n < device_list->len; n++) {
+		device = g_ptr_array_index(device_list, n);
+		trace_append_string(arr, device->path);
+		trace_append_string(arr, device->fstype);
+		trace_append_varint(arr, device->sectors);
+		trace_append_varint(arr, device->disk->index);
+		trace_append_varint(arr, device->disk_start);
+		trace_append_varint(arr, device->whole_disk);
+	}
+	trace_write(arr);
+	g_byte_array_free(arr, TRUE);
+	g_free(by_index);
+}
+
+static void trace_record(struct device *device, uint64_t start_sect,
+			uint64_t sect_count)
+{
+	struct trace_block *block;
+	uint8_t *p;
+	int64_t delta = start_sect;
+
+	block = g_private_get(&trace_block_key);
+	if (block == NULL) {
+		block = g_new0(struct trace_block, 1);
+		g_private_set(&trace_block_key, block);
+	}
+	if (block->len + TRACE_RECORD_MAX > TRACE_BLOCK_SIZE)
+		trace_block_write(block);
+	p = block->buf + block->len;
+	if (block->device == device->index + 1) {
+		p += varint_encode(p, 0);
+		delta = start_sect - block->end;
+	} else {
+		p += varint_encode(p, device->index + 1);
+		block->device = device->index + 1;
+	}
+	p += varint_encode(p, zigzag_encode(delta));
+	p += varint_encode(p, sect_count);
+	block->len = p - block->buf;
+	block->end = start_sect + sect_count;
+}
+
+/* Called after the scan threads have exited */
+static void trace_close(void)
+{
+	GByteArray *arr;
+	struct device *device;
+	unsigned count = 0;
+	unsigned n;
+
+	/* Flush the main thread's block */
+	g_private_replace(&trace_block_key, NULL);
+
+	arr = g_byte_array_new();
+	trace_append_varint(arr, 0);
+	for (n = 0; n < device_list->len; n++)
+		if (((struct device *) g_ptr_array_index(device_list,
+					n))->problem != NULL)
+			count++;
+	trace_append_varint(arr, count);
+	for (n = 0; n < device_list->len; n++) {
+		device = g_ptr_array_index(device_list, n);
+		if (device->problem == NULL)
+			continue;
+		trace_append_varint(arr, n);
+		trace_append_string(arr, device->problem);
+	}
+	trace_write(arr);
+	g_byte_array_free(arr, TRUE);
+	if (fclose(trace_out))
+		die("Couldn't write trace");
+	trace_out = NULL;
+}
+
+/* Shrink the extent to the disk's alignment, measured from the start
+   of the disk rather than of the partition.  Returns the number of
+   sectors given up, counting only extents which would otherwise have
+   been large enough to use. */
+static uint64_t extent_align(struct extent *extent)
+{
+	struct device *device = extent_device(extent);
+	uint64_t align = device->disk->align_sectors;
+	uint64_t offset = device->disk_start;
+	uint64_t start = offset + extent->start_sect;
+	uint64_t end = start + extent->sect_count;
+	uint64_t count = extent->sect_count;
+
+	start = (start + align - 1) / align * align;
+	end = end / align * align;
+	extent->start_sect = start - offset;
+	extent->sect_count = end > start ? end - start : 0;
+	if (count < min_extent_sectors)
+		return 0;
+	return count - extent->sect_count;
+}
+
+/* Offer a free extent of device to set, without updating the device's
+   statistics.  Returns the number of sectors lost to alignment. */
+static uint64_t offer_extent(struct extent_set *set, struct device *device,
+			uint64_t start_sect, uint64_t sect_count)
+{
+	struct extent new = {
+		.device = device->index,
+		.start_sect = start_sect,
+		.sect_count = sect_count
+	};
+	uint64_t lost;
+
+	if (log_extents)
+		printf("%s %"PRIu64" %"PRIu64"\n", device->path, start_sect,
+					sect_count);
+	if (trace_out != NULL)
+		trace_record(device, start_sect, sect_count);
+	lost = extent_align(&new);
+	extent_set_add(set, &new);
+	return lost;
+}
+
+static void add_extent(struct device *device, uint64_t start_sect,
+			uint64_t sect_count)
+{
+	device->free_extents++;
+	device->free_sectors += sect_count;
+	device->align_loss_sectors += offer_extent(device->extents, device,
+				start_sect, sect_count);
+}
+
+/* A scanner which adds extents as it goes, and can still fail partway
+   through, collects them into a private set so that a rejected device
+   leaves nothing behind in the shared one.  Returns the shared set, to
+   be passed to device_extents_commit(). */
+static struct extent_set *device_extents_begin(struct device *device)
+{
+	struct extent_set *shared = device->extents;
+
+	device->extents = extent_set_new();
+	/* Nothing below the shared floor would survive the merge */
+	device->extents->floor = shared->floor;
+	device->extents->selected = shared->selected;
+	return shared;
+}
+
+static void device_extents_commit(struct device *device,
+			struct extent_set *shared, gboolean ok)
+{
+	if (ok)
+		extent_set_merge(shared, device->extents);
+	extent_set_free(device->extents);
+	device->extents = shared;
+}
+
+struct trace_reader {
+	const uint8_t *pos;
+	const uint8_t *end;
+};
+
+static uint64_t trace_get_varint(struct trace_reader *rd)
+{
+	uint64_t val = 0;
+	unsigned shift;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (rd->pos == rd->end)
+			die("%s: Truncated trace", replay_file);
+		val |= (uint64_t) (*rd->pos & 0x7f) << shift;
+		if (!(*rd->pos++ & 0x80))
+			return val;
+	}
+	die("%s: Corrupt trace", replay_file);
+	return 0;
+}
+
+static gchar *trace_get_string(struct trace_reader *rd)
+{
+	uint64_t len = trace_get_varint(rd);
+
+	if (len > (uint64_t) (rd->end - rd->pos))
+		die("%s: Truncated trace", replay_file);
+	rd->pos += len;
+	return g_strndup((const char *) rd->pos - len, len);
+}
+
+/* Recreate the disks and devices from the trace and offer its extents
+   as a scan would have */
+static void trace_replay(GTree *devices)
+{
+	GMappedFile *file;
+	GError *err = NULL;
+	GPtrArray *disk_list;
+	struct trace_reader rd;
+	struct trace_reader records;
+	struct trace_reader block;
+	struct disk *disk;
+	struct device *device = NULL;
+	gchar *path;
+	gchar *fstype;
+	uint64_t count;
+	uint64_t tag;
+	uint64_t start;
+	uint64_t len;
+	uint64_t end = 0;
+	uint64_t replayed = 0;
+	unsigned n;
+
+	file = g_mapped_file_new(replay_file, FALSE, &err);
+	if (file == NULL)
+		die("%s", err->message);
+	rd.pos = (const uint8_t *) g_mapped_file_get_contents(file);
+	rd.end = rd.pos + g_mapped_file_get_length(file);
+	if (rd.end - rd.pos < (ptrdiff_t) strlen(TRACE_MAGIC) ||
+				memcmp(rd.pos, TRACE_MAGIC, strlen(TRACE_MAGIC)))
+		die("%s: Not a trace", replay_file);
+	rd.pos += strlen(TRACE_MAGIC);
+	if (trace_get_varint(&rd) != TRACE_VERSION)
+		die("%s: Unsupported trace version", replay_file);
+
+	disk_list = g_ptr_array_new();
+	count = trace_get_varint(&rd);
+	for (n = 0; n < count; n++) {
+		disk = g_slice_new0(struct disk);
+		disk->name = trace_get_string(&rd);
+		disk->path = trace_get_string(&rd);
+		disk->tier = trace_get_varint(&rd);
+		disk->align_sectors = trace_get_varint(&rd);
+		disk->read_kbps = trace_get_varint(&rd);
+		if (disk->tier > TIER_REMOVABLE || disk->align_sectors == 0 ||
+					g_hash_table_contains(disks,
+					disk->name))
+			die("%s: Corrupt disk table", replay_file);
+		/* Allow trying other alignments */
+		if (align_kb)
+			disk->align_sectors = align_kb << 1;
+		g_hash_table_insert(disks, disk->name, disk);
+		g_ptr_array_add(disk_list, disk);
+	}
+
+	device_list = g_ptr_array_new();
+	count = trace_get_varint(&rd);
+	if (count > EXTENT_MAX_DEVICES)
+		die("%s: Corrupt device table", replay_file);
+	for (n = 0; n < count; n++) {
+		path = trace_get_string(&rd);
+		fstype = trace_get_string(&rd);
+		if (g_tree_lookup(devices, path) != NULL)
+			die("%s: Corrupt device table", replay_file);
+		device_tree_insert(devices, path, fstype);
+		device = g_tree_lookup(devices, path);
+		g_free(path);
+		g_free(fstype);
+		device->index = n;
+		device->sectors = trace_get_varint(&rd);
+		tag = trace_get_varint(&rd);
+		if (tag >= disk_list->len)
+			die("%s: Corrupt device table", replay_file);
+		device->disk = g_ptr_array_index(disk_list, tag);
+		device->disk_start = trace_get_varint(&rd);
+		device->whole_disk = trace_get_varint(&rd) != 0;
+		device->extents = extents;
+		g_ptr_array_add(device_list, device);
+	}
+	g_ptr_array_free(disk_list, TRUE);
+	disks_assign_order();
+
+	/* The problem list follows the records, but a device the traced
+	   run rejected must contribute no extents, so skip ahead to it
+	   first */
+	records = rd;
+	while ((len = trace_get_varint(&rd)) != 0) {
+		if (len > (uint64_t) (rd.end - rd.pos))
+			die("%s: Truncated trace", replay_file);
+		rd.pos += len;
+	}
+	count = trace_get_varint(&rd);
+	for (n = 0; n < count; n++) {
+		tag = trace_get_varint(&rd);
+		if (tag >= device_list->len)
+			die("%s: Corrupt problem list", replay_file);
+		path = trace_get_string(&rd);
+		reject(g_ptr_array_index(device_list, tag), "%s", path);
+		g_free(path);
+	}
+
+	while ((len = trace_get_varint(&records)) != 0) {
+		block.pos = records.pos;
+		block.end = records.pos + len;
+		records.pos += len;
+		device = NULL;
+		while (block.pos < block.end) {
+			tag = trace_get_varint(&block);
+			if (tag > device_list->len || (tag == 0 &&
+						device == NULL))
+				die("%s: Corrupt extent record", replay_file);
+			start = zigzag_decode(trace_get_varint(&block));
+			if (tag) {
+				device = g_ptr_array_index(device_list,
+							tag - 1);
+			} else {
+				start += end;
+			}
+			len = trace_get_varint(&block);
+			if (start > device->sectors ||
+						len > device->sectors - start)
+				die("%s: Corrupt extent record", replay_file);
+			if (device->problem == NULL) {
+				add_extent(device, start, len);
+				replayed++;
+			}
+			end = start + len;
+		}
+	}
+
+	for (n = 0; n < device_list->len; n++)
+		((struct device *) g_ptr_array_index(device_list,
+					n))->extents = NULL;
+	g_mapped_file_unref(file);
+	info("Replayed %"PRIu64" extents from %u devices", replayed,
+				device_list->len);
+}
+
+static void extent_count_accepted(void)
+{
+	struct extent *extent;
+	unsigned n;
+
+	for (n = 0; n < extents->used; n++) {
+		extent = &extents->extents[n];
+		extent_device(extent)->accepted_extents++;
+		extent_device(extent)->accepted_sectors += extent->sect_count;
+	}
+}
+
+static int extent_compare_offsets(const void *_a, const void *_b)
+{
+	const struct extent *a = _a;
+	const struct extent *b = _b;
+	const struct device *a_dev = extent_device(a);
+	const struct device *b_dev = extent_device(b);
+	uint64_t a_sect = a_dev->disk_start + a->start_sect;
+	uint64_t b_sect = b_dev->disk_start + b->start_sect;
+
+	if (a_dev->disk->index != b_dev->disk->index)
+		return a_dev->disk->index < b_dev->disk->index ? -1 : 1;
+	if (a_sect != b_sect)
+		return a_sect < b_sect ? -1 : 1;
+	/* Only possible for distinct devices with the same backing store */
+	if (a->device != b->device)
+		return a->device < b->device ? -1 : 1;
+	return 0;
+}
+
+static void extent_populate_linear(struct table *table,
+			struct extent *list, unsigned count)
+{
+	unsigned n;
+
+	for (n = 0; n < count; n++)
+		table_add_linear(table, &list[n]);
+}
+
+/* Interleave the extents of each disk with those of every other disk.
+   The array is sorted by disk, so each disk's extents are contiguous.
+   We repeatedly take the same length from the current extent of every
+   disk, rounded down to a whole number of chunks, and emit it as one
+   striped target.  Extent tails shorter than a chunk, and whatever is
+   left once any disk runs out, are appended as linear targets. */
+static void extent_populate_striped(struct table *table)
+{
+	struct extent *list = extents->extents;
+	struct extent *cur;
+	struct extent *stripes;
+	unsigned *next;
+	unsigned *end;
+	GArray *leftover;
+	uint64_t chunk = stripe_chunk_kb << 1;
+	uint64_t len;
+	unsigned width = 0;
+	unsigned n;
+	unsigned d;
+
+	for (n = 0; n < extents->used; n++)
+		if (n == 0 || extent_device(&list[n])->disk !=
+					extent_device(&list[n - 1])->disk)
+			width++;
+	if (width < 2) {
+		msg("Only one disk available, not striping");
+		extent_populate_linear(table, list, extents->used);
+		return;
+	}
+
+	/* cur[d] is the unconsumed part of disk d's current extent;
+	   next[d] is the index of the extent after it */
+	cur = g_new(struct extent, width);
+	stripes = g_new(struct extent, width);
+	next = g_new(unsigned, width);
+	end = g_new(unsigned, width);
+	for (n = 0, d = 0; n < extents->used; n++) {
+		if (n > 0 && extent_device(&list[n])->disk ==
+					extent_device(&list[n - 1])->disk)
+			continue;
+		if (n > 0)
+			end[d++] = n;
+		cur[d] = list[n];
+		next[d] = n + 1;
+	}
+	end[d] = extents->used;
+	leftover = g_array_new(FALSE, FALSE, sizeof(struct extent));
+
+	for (;;) {
+		len = UINT64_MAX;
+		for (d = 0; d < width; d++)
+			len = MIN(len, cur[d].sect_count);
+		len -= len % chunk;
+		if (len == 0) {
+			/* Set aside current extents shorter than a chunk */
+			for (d = 0; d < width; d++) {
+				if (cur[d].sect_count >= chunk)
+					continue;
+				g_array_append_val(leftover, cur[d]);
+				cur[d].sect_count = 0;
+				if (next[d] == end[d])
+					goto done;
+				cur[d] = list[next[d]++];
+			}
+			continue;
+		}
+		for (d = 0; d < width; d++) {
+			stripes[d] = cur[d];
+			cur[d].start_sect += len;
+			cur[d].sect_count -= len;
+		}
+		table_add_striped(table, stripes, width, chunk, len);
+		for (d = 0; d < width; d++) {
+			if (cur[d].sect_count)
+				continue;
+			if (next[d] == end[d])
+				goto done;
+			cur[d] = list[next[d]++];
+		}
+	}
+
+done:
+	table->stripe_width = width;
+	for (d = 0; d < width; d++) {
+		if (cur[d].sect_count)
+			g_array_append_val(leftover, cur[d]);
+		for (n = next[d]; n < end[d]; n++)
+			g_array_append_val(leftover, list[n]);
+	}
+	g_array_sort(leftover, extent_compare_offsets);
+	extent_populate_linear(table, (struct extent *) leftover->data,
+				leftover->len);
+	g_array_free(leftover, TRUE);
+	g_free(end);
+	g_free(next);
+	g_free(stripes);
+	g_free(cur);
+}
+
+static void extent_populate_table(struct table *table,
+			uint64_t *smallest_extent)
+{
+	unsigned n;
+	uint64_t smallest = UINT64_MAX;
+
+	qsort(extents->extents, extents->used, sizeof(*extents->extents),
+				extent_compare_offsets);
+	for (n = 0; n < extents->used; n++)
+		if (extents->extents[n].sect_count < smallest)
+			smallest = extents->extents[n].sect_count;
+	if (extents->used)
+		*smallest_extent = smallest;
+	else
+		*smallest_extent = 0;
+
+	if (layout == LAYOUT_STRIPE)
+		extent_populate_striped(table);
+	else
+		extent_populate_linear(table, extents->extents,
+					extents->used);
+}
+
+/* Free space bitmaps */
+
+/* ext[234] and NTFS both describe free space with a bitmap in which a set
+   bit marks an allocated unit, stored least-significant bit first.  Rather
+   than testing each bit individually, we walk the bitmap a 64-bit word at a
+   time and use count-trailing-zeros to find the edges of free runs.  Words
+   which cannot end the current run (all ones while looking for free space,
+   all zeros while inside a free run) are skipped in bulk, using vector
+   compares if the CPU supports them.  The scanner can be fed in pieces; an
+   open run is carried from one piece to the next. */
+
+struct bitmap_scan {
+	void (*emit)(void *ctx, uint64_t start_sect, uint64_t sect_count);
+	void *ctx;
+	unsigned unit_sectors;
+	gboolean in_run;
+	uint64_t run_start;
+};
+
+/* Return the length of the prefix of buf, in whole 64-bit words, which
+   consists entirely of the byte fill. */
+static size_t (*bitmap_skip)(const uint8_t *buf, size_t len, uint8_t fill);
+
+static size_t bitmap_skip_scalar(const uint8_t *buf, size_t len, uint8_t fill)
+{
+	uint64_t pattern = fill ? UINT64_MAX : 0;
+	uint64_t word;
+	size_t off;
+
+	for (off = 0; off + 8 <= len; off += 8) {
+		memcpy(&word, buf + off, 8);
+		if (word != pattern)
+			break;
+	}
+	return off;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((target("sse2")))
+static size_t bitmap_skip_sse2(const uint8_t *buf, size_t len, uint8_t fill)
+{
+	__m128i pattern = _mm_set1_epi8((char) fill);
+	__m128i cur;
+	size_t off;
+
+	for (off = 0; off + 16 <= len; off += 16) {
+		cur = _mm_loadu_si128((const __m128i *) (buf + off));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(cur, pattern)) != 0xffff)
+			break;
+	}
+	return off + bitmap_skip_scalar(buf + off, len - off, fill);
+}
+
+__attribute__((target("avx2")))
+static size_t bitmap_skip_avx2(const uint8_t *buf, size_t len, uint8_t fill)
+{
+	__m256i pattern = _mm256_set1_epi8((char) fill);
+	__m256i cur;
+	size_t off;
+
+	for (off = 0; off + 32 <= len; off += 32) {
+		cur = _mm256_loadu_si256((const __m256i *) (buf + off));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, pattern)) !=
+					-1)
+			break;
+	}
+	return off + bitmap_skip_scalar(buf + off, len - off, fill);
+}
+#endif
+
+static void bitmap_skip_select(void)
+{
+	bitmap_skip = bitmap_skip_scalar;
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		bitmap_skip = bitmap_skip_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		bitmap_skip = bitmap_skip_sse2;
+#endif
+}
+
+static void bitmap_scan_add_extent(void *device, uint64_t start_sect,
+			uint64_t sect_count)
+{
+	add_extent(device, start_sect, sect_count);
+}
+
+/* Free runs are passed to emit, or to add_extent() on ctx if emit is
+   NULL. */
+static void bitmap_scan_init(struct bitmap_scan *scan, unsigned unit_sectors,
+			void (*emit)(void *ctx, uint64_t start_sect,
+			uint64_t sect_count), void *ctx)
+{
+	scan->emit = emit ? emit : bitmap_scan_add_extent;
+	scan->ctx = ctx;
+	scan->unit_sectors = unit_sectors;
+	scan->in_run = FALSE;
+	scan->run_start = 0;
+}
+
+static void bitmap_scan_end_run(struct bitmap_scan *scan, uint64_t end)
+{
+	scan->emit(scan->ctx, scan->run_start * scan->unit_sectors,
+				(end - scan->run_start) * scan->unit_sectors);
+	scan->in_run = FALSE;
+}
+
+/* Process the low limit bits of word, which describe the units starting
+   at base. */
+static void bitmap_scan_word(struct bitmap_scan *scan, uint64_t word,
+			uint64_t base, unsigned limit)
+{
+	unsigned pos = 0;
+	uint64_t bits;
+
+	while (pos < limit) {
+		if (scan->in_run) {
+			bits = word >> pos;
+			if (bits == 0)
+				return;
+			pos += __builtin_ctzll(bits);
+			if (pos >= limit)
+				return;
+			bitmap_scan_end_run(scan, base + pos);
+		} else {
+			bits = ~word >> pos;
+			if (bits == 0)
+				return;
+			pos += __builtin_ctzll(bits);
+			if (pos >= limit)
+				return;
+			scan->in_run = TRUE;
+			scan->run_start = base + pos;
+		}
+	}
+}
+
+/* Bit 0 of bitmap describes unit first.  first must follow directly from
+   the previous call. */
+static void bitmap_scan_feed(struct bitmap_scan *scan, const uint8_t *bitmap,
+			uint64_t first, uint64_t units)
+{
+	uint64_t words = units / 64;
+	uint64_t word;
+	uint64_t skip_word;
+	uint64_t n;
+	unsigned tail;
+
+	for (n = 0; n < words; n++) {
+		memcpy(&word, bitmap + 8 * n, 8);
+		word = GUINT64_FROM_LE(word);
+		skip_word = scan->in_run ? 0 : UINT64_MAX;
+		if (word == skip_word) {
+			n += bitmap_skip(bitmap + 8 * (n + 1),
+						8 * (words - n - 1),
+						(uint8_t) skip_word) / 8;
+			continue;
+		}
+		bitmap_scan_word(scan, word, first + 64 * n, 64);
+	}
+	tail = units % 64;
+	if (tail) {
+		word = 0;
+		memcpy(&word, bitmap + 8 * words, (tail + 7) / 8);
+		word = GUINT64_FROM_LE(word);
+		bitmap_scan_word(scan, word, first + 64 * words, tail);
+	}
+}
+
+/* Mark the units starting at first as entirely free or entirely in use,
+   without examining a bitmap for them. */
+static void bitmap_scan_span(struct bitmap_scan *scan, uint64_t first,
+			gboolean free)
+{
+	if (free && !scan->in_run) {
+		scan->in_run = TRUE;
+		scan->run_start = first;
+	} else if (!free && scan->in_run) {
+		bitmap_scan_end_run(scan, first);
+	}
+}
+
+/* end is the unit following the last one fed to the scanner. */
+static void bitmap_scan_finish(struct bitmap_scan *scan, uint64_t end)
+{
+	if (scan->in_run)
+		bitmap_scan_end_run(scan, end);
+}
+
+/* Bitmaps which live on disk rather than in memory are streamed through a
+   pair of fixed-size buffers, so that peak memory use doesn't depend on the
+   size of the volume.  A reader thread fills one buffer while the caller
+   scans the other. */
+
+struct bitmap_chunk {
+	uint8_t *data;
+	uint64_t offset;
+	size_t len;
+	gboolean error;
+};
+
+struct bitmap_reader {
+	gboolean (*read)(void *ctx, uint64_t offset, void *buf, size_t len);
+	void *ctx;
+	uint64_t len;
+	GAsyncQueue *empty;
+	GAsyncQueue *full;
+	GThread *thread;
+	struct bitmap_chunk chunks[2];
+};
+
+static size_t bitmap_chunk_bytes(void)
+{
+	return ((size_t) bitmap_chunk_mb) << 20;
+}
+
+static void *bitmap_reader_thread(void *_reader)
+{
+	struct bitmap_reader *reader = _reader;
+	struct bitmap_chunk *chunk;
+	uint64_t offset;
+
+	for (offset = 0; offset < reader->len; offset += chunk->len) {
+		chunk = g_async_queue_pop(reader->empty);
+		chunk->offset = offset;
+		chunk->len = MIN(reader->len - offset, bitmap_chunk_bytes());
+		chunk->error = !reader->read(reader->ctx, offset, chunk->data,
+					chunk->len);
+		g_async_queue_push(reader->full, chunk);
+		if (chunk->error)
+			break;
+	}
+	return NULL;
+}
+
+static void bitmap_reader_start(struct bitmap_reader *reader,
+			gboolean (*read)(void *ctx, uint64_t offset, void *buf,
+			size_t len), void *ctx, uint64_t len)
+{
+	unsigned n;
+
+	reader->read = read;
+	reader->ctx = ctx;
+	reader->len = len;
+	reader->empty = g_async_queue_new();
+	reader->full = g_async_queue_new();
+	for (n = 0; n < G_N_ELEMENTS(reader->chunks); n++) {
+		reader->chunks[n].data = g_malloc(MIN(len,
+					bitmap_chunk_bytes()));
+		g_async_queue_push(reader->empty, &reader->chunks[n]);
+	}
+	reader->thread = g_thread_new("bitmap-reader", bitmap_reader_thread,
+				reader);
+}
+
+/* Returns the next chunk in offset order.  Must not be called again after
+   the final chunk or a chunk with the error flag set. */
+static struct bitmap_chunk *bitmap_reader_next(struct bitmap_reader *reader)
+{
+	return g_async_queue_pop(reader->full);
+}
+
+static void bitmap_reader_release(struct bitmap_reader *reader,
+			struct bitmap_chunk *chunk)
+{
+	g_async_queue_push(reader->empty, chunk);
+}
+
+static void bitmap_reader_finish(struct bitmap_reader *reader)
+{
+	unsigned n;
+
+	g_thread_join(reader->thread);
+	for (n = 0; n < G_N_ELEMENTS(reader->chunks); n++)
+		g_free(reader->chunks[n].data);
+	g_async_queue_unref(reader->empty);
+	g_async_queue_unref(reader->full);
+}
+
+/* Batched reads */
+
+/* Scattered metadata reads, such as ext block bitmaps, are seek-bound when
+   issued one at a time.  An I/O batch takes all of the reads a scan will
+   need, issues them in disk offset order with up to io_depth of them in
+   flight, and lets the caller wait for them in whatever order it
+   consumes them.  We use io_uring where available.  Otherwise we hint the
+   whole batch to the kernel with posix_fadvise() and have a pool of
+   threads issue the preads.  The pool is shared by every batch in the
+   process, so scanning many filesystems at once doesn't multiply it; its
+   io_depth threads bound the preads in flight overall. */
+
+struct io_request {
+	uint64_t offset;
+	size_t len;
+	uint8_t *buf;
+	gboolean done;
+	gboolean ok;
+};
+
+struct io_batch {
+	int fd;
+	struct io_request **sorted;
+	unsigned count;
+	unsigned submitted;
+	unsigned inflight;
+#ifdef HAVE_LIBURING
+	gboolean use_ring;
+	struct io_uring ring;
+#endif
+	unsigned workers;  /* pool jobs not yet finished */
+	volatile gint next;
+	GMutex lock;
+	GCond cond;
+};
+
+static int io_request_compare(const void *_a, const void *_b)
+{
+	const struct io_request *a = *(struct io_request * const *) _a;
+	const struct io_request *b = *(struct io_request * const *) _b;
+
+	if (a->offset != b->offset)
+		return a->offset < b->offset ? -1 : 1;
+	return 0;
+}
+
+static gboolean io_read_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, offset);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return FALSE;
+		buf = (uint8_t *) buf + ret;
+		len -= ret;
+		offset += ret;
+	}
+	return TRUE;
+}
+
+static void io_request_complete(struct io_batch *batch,
+			struct io_request *req, gboolean ok)
+{
+	g_mutex_lock(&batch->lock);
+	req->ok = ok;
+	req->done = TRUE;
+	g_cond_broadcast(&batch->cond);
+	g_mutex_unlock(&batch->lock);
+}
+
+GThreadPool *io_pool;
+GMutex io_pool_lock;
+
+/* A pool job: issue reads from the batch until none are left */
+static void io_batch_work(void *_batch, void *data G_GNUC_UNUSED)
+{
+	struct io_batch *batch = _batch;
+	struct io_request *req;
+	gint n;
+
+	while ((n = g_atomic_int_add(&batch->next, 1)) <
+				(gint) batch->count) {
+		req = batch->sorted[n];
+		io_request_complete(batch, req, io_read_full(batch->fd,
+					req->buf, req->len, req->offset));
+	}
+	g_mutex_lock(&batch->lock);
+	batch->workers--;
+	g_cond_broadcast(&batch->cond);
+	g_mutex_unlock(&batch->lock);
+}
+
+#ifdef HAVE_LIBURING
+static void io_ring_submit(struct io_batch *batch)
+{
+	struct io_uring_sqe *sqe;
+	struct io_request *req;
+	unsigned queued = 0;
+
+	while (batch->submitted < batch->count &&
+				batch->inflight < io_depth) {
+		sqe = io_uring_get_sqe(&batch->ring);
+		if (sqe == NULL)
+			break;
+		req = batch->sorted[batch->submitted++];
+		io_uring_prep_read(sqe, batch->fd, req->buf, req->len,
+					req->offset);
+		io_uring_sqe_set_data(sqe, req);
+		batch->inflight++;
+		queued++;
+	}
+	if (queued && io_uring_submit(&batch->ring) < 0)
+		die("Couldn't submit reads");
+}
+
+static void io_ring_reap(struct io_batch *batch)
+{
+	struct io_uring_cqe *cqe;
+	struct io_request *req;
+	int ret;
+
+	do {
+		ret = io_uring_wait_cqe(&batch->ring, &cqe);
+	} while (ret == -EINTR);
+	if (ret < 0)
+		die("Couldn't wait for reads");
+	req = io_uring_cqe_get_data(cqe);
+	req->ok = cqe->res == (int) req->len;
+	/* Retry short reads synchronously */
+	if (!req->ok && cqe->res > 0)
+		req->ok = io_read_full(batch->fd, req->buf + cqe->res,
+					req->len - cqe->res,
+					req->offset + cqe->res);
+	req->done = TRUE;
+	io_uring_cqe_seen(&batch->ring, cqe);
+	batch->inflight--;
+}
+#endif
+
+static void io_batch_start(struct io_batch *batch, int fd,
+			struct io_request *reqs, unsigned count)
+{
+	unsigned n;
+
+	memset(batch, 0, sizeof(*batch));
+	batch->fd = fd;
+	batch->count = count;
+	batch->sorted = g_new(struct io_request *, count);
+	for (n = 0; n < count; n++) {
+		reqs[n].done = FALSE;
+		batch->sorted[n] = &reqs[n];
+	}
+	qsort(batch->sorted, count, sizeof(*batch->sorted),
+				io_request_compare);
+	if (count == 0)
+		return;
+
+#ifdef HAVE_LIBURING
+	if (io_uring_queue_init(MIN(io_depth, 4096), &batch->ring, 0) == 0) {
+		batch->use_ring = TRUE;
+		io_ring_submit(batch);
+		return;
+	}
+#endif
+
+	g_mutex_init(&batch->lock);
+	g_cond_init(&batch->cond);
+	for (n = 0; n < count; n++)
+		posix_fadvise(fd, batch->sorted[n]->offset,
+					batch->sorted[n]->len,
+					POSIX_FADV_WILLNEED);
+	g_mutex_lock(&io_pool_lock);
+	if (io_pool == NULL)
+		io_pool = g_thread_pool_new(io_batch_work, NULL, io_depth,
+					FALSE, NULL);
+	g_mutex_unlock(&io_pool_lock);
+	batch->workers = MIN(io_depth, count);
+	for (n = 0; n < batch->workers; n++)
+		g_thread_pool_push(io_pool, batch, NULL);
+}
+
+/* Returns FALSE if the read failed. */
+static gboolean io_batch_wait(struct io_batch *batch, struct io_request *req)
+{
+#ifdef HAVE_LIBURING
+	if (batch->use_ring) {
+		while (!req->done) {
+			io_ring_reap(batch);
+			io_ring_submit(batch);
+		}
+		return req->ok;
+	}
+#endif
+	g_mutex_lock(&batch->lock);
+	while (!req->done)
+		g_cond_wait(&batch->cond, &batch->lock);
+	g_mutex_unlock(&batch->lock);
+	return req->ok;
+}
+
+static void io_batch_finish(struct io_batch *batch)
+{
+	if (batch->count == 0)
+		goto out;
+#ifdef HAVE_LIBURING
+	if (batch->use_ring) {
+		while (batch->inflight)
+			io_ring_reap(batch);
+		io_uring_queue_exit(&batch->ring);
+		goto out;
+	}
+#endif
+	g_mutex_lock(&batch->lock);
+	while (batch->workers)
+		g_cond_wait(&batch->cond, &batch->lock);
+	g_mutex_unlock(&batch->lock);
+	g_mutex_clear(&batch->lock);
+	g_cond_clear(&batch->cond);
+out:
+	g_free(batch->sorted);
+}
+
+/* Scan cache */
+
+/* Scanning a large filesystem takes a while, and the host's filesystems
+   usually haven't changed since the last boot.  With --cache, the extents
+   each device contributed are saved, keyed on the filesystem's identity
+   and on state markers which change whenever it's written, and reused
+   while the markers still match.  The entry also records everything else
+   which shapes the extent list, so changing options just forces a
+   rescan.  Only devices seen in this run are written back.
+
+   A cached device gets its own extent set during the scan so that its
+   contribution can be saved; pruning then only considers that device's
+   own extents, which is what makes the saved list complete. */
+
+#define CACHE_VERSION 1
+
+GKeyFile *cache_in;
+GKeyFile *cache_out;
+GMutex cache_lock;
+
+static gchar *cache_hex(const uint8_t *buf, unsigned len)
+{
+	GString *str;
+	unsigned n;
+
+	str = g_string_sized_new(2 * len);
+	for (n = 0; n < len; n++)
+		g_string_append_printf(str, "%.2x", buf[n]);
+	return g_string_free(str, FALSE);
+}
+
+static gchar *cache_group(struct device *device, const char *ident)
+{
+	return g_strdup_printf("%s %s", device->fstype, ident);
+}
+
+/* Everything besides the filesystem contents which affects the result */
+static gchar *cache_params(struct device *device)
+{
+	return g_strdup_printf("%"PRIu64" %"PRIu64" %u %u %u",
+				device->sectors, device->disk_start,
+				device->disk->align_sectors,
+				min_extent_sectors, max_extent_count);
+}
+
+static void cache_open(void)
+{
+	GError *err = NULL;
+
+	cache_in = g_key_file_new();
+	cache_out = g_key_file_new();
+	g_key_file_set_integer(cache_out, "cache", "version", CACHE_VERSION);
+	if (!g_key_file_load_from_file(cache_in, cache_file, G_KEY_FILE_NONE,
+				&err)) {
+		if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			warn("Couldn't read cache: %s", err->message);
+		g_clear_error(&err);
+		return;
+	}
+	if (g_key_file_get_integer(cache_in, "cache", "version", NULL) !=
+				CACHE_VERSION) {
+		msg("Ignoring cache with different version");
+		g_key_file_free(cache_in);
+		cache_in = g_key_file_new();
+	}
+}
+
+/* With --extend only the new devices are scanned, so keep the entries
+   of the ones already in the map */
+static void cache_carry_over(void)
+{
+	gchar **groups;
+	gchar **keys;
+	gchar *value;
+	unsigned g;
+	unsigned k;
+
+	groups = g_key_file_get_groups(cache_in, NULL);
+	for (g = 0; groups[g] != NULL; g++) {
+		if (!strcmp(groups[g], "cache") ||
+					g_key_file_has_group(cache_out,
+					groups[g]))
+			continue;
+		keys = g_key_file_get_keys(cache_in, groups[g], NULL, NULL);
+		for (k = 0; keys != NULL && keys[k] != NULL; k++) {
+			value = g_key_file_get_value(cache_in, groups[g],
+						keys[k], NULL);
+			if (value != NULL)
+				g_key_file_set_value(cache_out, groups[g],
+							keys[k], value);
+			g_free(value);
+		}
+		g_strfreev(keys);
+	}
+	g_strfreev(groups);
+}
+
+static void cache_close(void)
+{
+	GError *err = NULL;
+	gchar *data;
+	gsize len;
+
+	if (extend)
+		cache_carry_over();
+	data = g_key_file_to_data(cache_out, &len, NULL);
+	if (!g_file_set_contents(cache_file, data, len, &err)) {
+		warn("Couldn't write cache: %s", err->message);
+		g_clear_error(&err);
+	}
+	g_free(data);
+	g_key_file_free(cache_out);
+	g_key_file_free(cache_in);
+}
+
+static gboolean cache_parse_extents(struct device *device, const char *str,
+			GArray *list)
+{
+	struct extent extent = {
+		.device = device->index,
+	};
+	gchar *end;
+
+	while (*str) {
+		extent.start_sect = g_ascii_strtoull(str, &end, 10);
+		if (end == str || *end != ':')
+			return FALSE;
+		str = end + 1;
+		extent.sect_count = g_ascii_strtoull(str, &end, 10);
+		if (end == str || (*end != ' ' && *end != 0))
+			return FALSE;
+		str = *end ? end + 1 : end;
+		if (extent.sect_count == 0 ||
+					extent.start_sect > device->sectors ||
+					extent.sect_count > device->sectors -
+					extent.start_sect)
+			return FALSE;
+		g_array_append_val(list, extent);
+	}
+	return TRUE;
+}
+
+/* Returns TRUE if the device's extents were loaded from the cache. */
+static gboolean cache_load(struct device *device, const char *ident,
+			const char *state)
+{
+	GArray *list;
+	gchar *group;
+	gchar *params;
+	gchar *val;
+	gboolean ok;
+	unsigned n;
+
+	group = cache_group(device, ident);
+	params = cache_params(device);
+	list = g_array_new(FALSE, FALSE, sizeof(struct extent));
+	g_mutex_lock(&cache_lock);
+	val = g_key_file_get_string(cache_in, group, "state", NULL);
+	ok = val != NULL && !strcmp(val, state);
+	g_free(val);
+	val = g_key_file_get_string(cache_in, group, "params", NULL);
+	ok = ok && val != NULL && !strcmp(val, params);
+	g_free(val);
+	val = g_key_file_get_string(cache_in, group, "extents", NULL);
+	ok = ok && val != NULL && cache_parse_extents(device, val, list);
+	g_free(val);
+	if (ok) {
+		device->free_sectors = g_key_file_get_uint64(cache_in, group,
+					"free-sectors", NULL);
+		device->free_extents = g_key_file_get_integer(cache_in, group,
+					"free-extents", NULL);
+		device->align_loss_sectors = g_key_file_get_uint64(cache_in,
+					group, "alignment-loss-sectors", NULL);
+	}
+	g_mutex_unlock(&cache_lock);
+
+	if (ok) {
+		msg("%s: Using cached scan", device->path);
+		for (n = 0; n < list->len; n++)
+			extent_set_add(device->extents,
+						&g_array_index(list, struct extent,
+						n));
+	}
+	g_array_free(list, TRUE);
+	g_free(params);
+	g_free(group);
+	return ok;
+}
+
+static void cache_store(struct device *device, const char *ident,
+			const char *state)
+{
+	struct extent_set *set = device->extents;
+	GString *str;
+	gchar *group;
+	gchar *params;
+	unsigned n;
+
+	if (device->problem != NULL)
+		return;
+	extent_set_select(set);
+	group = cache_group(device, ident);
+	params = cache_params(device);
+	str = g_string_new("");
+	for (n = 0; n < set->used; n++)
+		g_string_append_printf(str, "%s%"PRIu64":%"PRIu64,
+					n ? " " : "",
+					(uint64_t) set->extents[n].start_sect,
+					set->extents[n].sect_count);
+	g_mutex_lock(&cache_lock);
+	g_key_file_set_string(cache_out, group, "device", device->path);
+	g_key_file_set_string(cache_out, group, "state", state);
+	g_key_file_set_string(cache_out, group, "params", params);
+	g_key_file_set_uint64(cache_out, group, "free-sectors",
+				device->free_sectors);
+	g_key_file_set_integer(cache_out, group, "free-extents",
+				device->free_extents);
+	g_key_file_set_uint64(cache_out, group, "alignment-loss-sectors",
+				device->align_loss_sectors);
+	g_key_file_set_string(cache_out, group, "extents", str->str);
+	g_mutex_unlock(&cache_lock);
+	g_string_free(str, TRUE);
+	g_free(params);
+	g_free(group);
+}
+
+/* ext[234] */
+
+/* We work from the group descriptors rather than the full block bitmap.
+   Groups with no free space are skipped and completely free groups are
+   treated as a single free run, without reading their bitmaps.  Groups
+   whose free space is too small to produce an extent that could displace
+   the smallest member of a full extent set are skipped as well, counting
+   their free space but not their extents.  Only the remaining groups
+   have their bitmap blocks read from disk.  Groups with BLOCK_UNINIT set
+   have no bitmap on disk; if one of them is partially used (e.g. by a
+   superblock backup), its bitmap is built from the locations of the
+   metadata in it.  Bitmap blocks are read
+   through an I/O batch a window of groups at a time, so that the reads
+   are issued in disk order and overlap with scanning.
+
+   Large filesystems are also split into ranges of whole block groups,
+   which are scanned on separate threads into separate extent sets.  A
+   free run which starts at the beginning of a range, or is still open at
+   its end, may continue into the neighboring range, so those runs are
+   held back and stitched together once all ranges are done.  This
+   produces exactly the extents of a serial scan.
+
+   All units here are clusters, which are the same as blocks unless the
+   filesystem has the bigalloc feature. */
+
+#define EXT_MIN_RANGE_GROUPS 16
+#define EXT_IO_WINDOW_GROUPS 1024
+
+enum ext_group_action {
+	EXT_GROUP_USED,
+	EXT_GROUP_FREE,
+	EXT_GROUP_PRUNE,
+	EXT_GROUP_READ,
+	EXT_GROUP_BUILD,
+};
+
+struct ext_scan {
+	ext2_filsys fs;
+	struct device *device;
+	int fd;
+	unsigned unit_sectors;
+	GMutex bitmap_lock;
+	gboolean bitmap_loaded;
+	/* Upper bound on the number of free units which may be contiguous
+	   with each group, on either side */
+	uint64_t *free_before;
+	uint64_t *free_after;
+};
+
+struct ext_range {
+	GThread *thread;
+	struct ext_scan *scan;
+	dgrp_t first_group;
+	dgrp_t end_group;
+	blk64_t start;
+	blk64_t end;
+	struct extent_set *extents;
+	uint64_t free_sectors;
+	uint64_t align_loss_sectors;
+	unsigned free_extents;
+	gboolean failed;
+	/* Length of the free run starting at start, if it ends in range */
+	uint64_t head_sectors;
+	/* State of the free run open at end */
+	gboolean tail_open;
+	blk64_t tail_start;
+};
+
+static blk64_t ext_group_first(ext2_filsys fs, dgrp_t group)
+{
+	return EXT2FS_B2C(fs, fs->super->s_first_data_block) +
+				(blk64_t) group *
+				EXT2_CLUSTERS_PER_GROUP(fs->super);
+}
+
+static blk64_t ext_group_units(ext2_filsys fs, dgrp_t group)
+{
+	blk64_t end = EXT2FS_B2C(fs, ext2fs_blocks_count(fs->super) - 1) + 1;
+
+	return MIN(end - ext_group_first(fs, group),
+				EXT2_CLUSTERS_PER_GROUP(fs->super));
+}
+
+static gboolean ext_group_is_free(ext2_filsys fs, dgrp_t group)
+{
+	return ext2fs_bg_free_blocks_count(fs, group) ==
+				ext_group_units(fs, group);
+}
+
+static void ext_compute_bounds(struct ext_scan *scan)
+{
+	ext2_filsys fs = scan->fs;
+	dgrp_t group;
+	dgrp_t count = fs->group_desc_count;
+
+	scan->free_before = g_new0(uint64_t, count);
+	scan->free_after = g_new0(uint64_t, count);
+	for (group = 1; group < count; group++) {
+		scan->free_before[group] =
+					ext2fs_bg_free_blocks_count(fs, group - 1);
+		if (ext_group_is_free(fs, group - 1))
+			scan->free_before[group] +=
+						scan->free_before[group - 1];
+	}
+	for (group = count - 1; group > 0; group--) {
+		scan->free_after[group - 1] =
+					ext2fs_bg_free_blocks_count(fs, group);
+		if (ext_group_is_free(fs, group))
+			scan->free_after[group - 1] +=
+						scan->free_after[group];
+	}
+}
+
+static uint64_t extent_set_threshold(struct extent_set *set)
+{
+	if (!set->selected)
+		return 0;
+	return set->floor.sect_count;
+}
+
+/* Returns TRUE if no free run touching this group can be large enough to
+   be selected. */
+static gboolean ext_group_prunable(struct ext_range *range, dgrp_t group)
+{
+	struct ext_scan *scan = range->scan;
+	uint64_t threshold;
+	uint64_t bound;
+
+	/* --dump and --trace want to see everything */
+	if (log_extents || trace_file != NULL)
+		return FALSE;
+	/* The worker's set isn't modified while its ranges are scanned */
+	threshold = MAX(extent_set_threshold(range->extents),
+				extent_set_threshold(scan->device->extents));
+	if (threshold == 0)
+		return FALSE;
+	bound = scan->free_before[group] +
+				ext2fs_bg_free_blocks_count(scan->fs, group) +
+				scan->free_after[group];
+	return bound * scan->unit_sectors < threshold;
+}
+
+static enum ext_group_action ext_group_classify(struct ext_range *range,
+			dgrp_t group)
+{
+	ext2_filsys fs = range->scan->fs;
+	blk64_t free_units = ext2fs_bg_free_blocks_count(fs, group);
+
+	if (free_units == 0)
+		return EXT_GROUP_USED;
+	if (free_units == ext_group_units(fs, group))
+		return EXT_GROUP_FREE;
+	if (ext_group_prunable(range, group))
+		return EXT_GROUP_PRUNE;
+	if (ext2fs_has_group_desc_csum(fs) &&
+				ext2fs_bg_flags_test(fs, group,
+				EXT2_BG_BLOCK_UNINIT))
+		return EXT_GROUP_BUILD;
+	return EXT_GROUP_READ;
+}
+
+/* Mark blocks [blk, blk + count) in use in buf, the bitmap of the group
+   whose units start at first.  Blocks outside the group are ignored. */
+static void ext_group_mark(ext2_filsys fs, uint8_t *buf, blk64_t first,
+			blk64_t units, blk64_t blk, blk64_t count)
+{
+	blk64_t unit;
+	blk64_t end;
+
+	if (count == 0)
+		return;
+	unit = MAX(EXT2FS_B2C(fs, blk), first);
+	end = MIN(EXT2FS_B2C(fs, blk + count - 1) + 1, first + units);
+	for (; unit < end; unit++)
+		buf[(unit - first) / 8] |= 1 << ((unit - first) % 8);
+}
+
+/* Build the bitmap of an uninitialized group the way the kernel does.
+   Only the superblock and descriptor backups are in use, plus the group's
+   own bitmaps and inode table if flex_bg hasn't placed them in another
+   group.  If the result doesn't match the descriptor's free count, fall
+   back to copying the group out of a bitmap built by libext2fs. */
+static gboolean ext_group_build_bitmap(struct ext_range *range,
+			dgrp_t group, uint8_t *buf)
+{
+	struct ext_scan *scan = range->scan;
+	ext2_filsys fs = scan->fs;
+	blk64_t first = ext_group_first(fs, group);
+	blk64_t units = ext_group_units(fs, group);
+	blk64_t super_blk;
+	blk64_t old_desc_blk;
+	blk64_t new_desc_blk;
+	blk64_t old_desc_blocks;
+	blk64_t used = 0;
+	blk64_t unit;
+	gboolean ok = TRUE;
+
+	memset(buf, 0, fs->blocksize);
+	ext2fs_super_and_bgd_loc2(fs, group, &super_blk, &old_desc_blk,
+				&new_desc_blk, NULL);
+	if (super_blk || group == 0)
+		ext_group_mark(fs, buf, first, units, super_blk, 1);
+	if (old_desc_blk) {
+		if (ext2fs_has_feature_meta_bg(fs->super))
+			old_desc_blocks = fs->super->s_first_meta_bg;
+		else
+			old_desc_blocks = fs->desc_blocks +
+						fs->super->s_reserved_gdt_blocks;
+		ext_group_mark(fs, buf, first, units, old_desc_blk,
+					old_desc_blocks);
+	}
+	if (new_desc_blk)
+		ext_group_mark(fs, buf, first, units, new_desc_blk, 1);
+	ext_group_mark(fs, buf, first, units,
+				ext2fs_block_bitmap_loc(fs, group), 1);
+	ext_group_mark(fs, buf, first, units,
+				ext2fs_inode_bitmap_loc(fs, group), 1);
+	ext_group_mark(fs, buf, first, units,
+				ext2fs_inode_table_loc(fs, group),
+				fs->inode_blocks_per_group);
+	for (unit = 0; unit < units; unit++)
+		used += (buf[unit / 8] >> (unit % 8)) & 1;
+	if (units - used == ext2fs_bg_free_blocks_count(fs, group))
+		return TRUE;
+
+	g_mutex_lock(&scan->bitmap_lock);
+	if (!scan->bitmap_loaded) {
+		msg("%s: Group %u doesn't match its free count, reading "
+					"full block bitmap", scan->device->path,
+					group);
+		ok = !ext2fs_read_block_bitmap(fs);
+		scan->bitmap_loaded = ok;
+	}
+	g_mutex_unlock(&scan->bitmap_lock);
+	return ok && !ext2fs_get_block_bitmap_range2(fs->block_map, first,
+				units, buf);
+}
+
+static void ext_range_emit(void *_range, uint64_t start_sect,
+			uint64_t sect_count)
+{
+	struct ext_range *range = _range;
+
+	if (start_sect == range->start * range->scan->unit_sectors &&
+				range->first_group != 0) {
+		range->head_sectors = sect_count;
+		return;
+	}
+	range->free_extents++;
+	range->free_sectors += sect_count;
+	range->align_loss_sectors += offer_extent(range->extents,
+				range->scan->device, start_sect, sect_count);
+}
+
+/* req is the read planned for this group, if any.  buf has room for one
+   bitmap block. */
+static void ext_range_scan_group(struct ext_range *range,
+			struct bitmap_scan *scan, dgrp_t group,
+			struct io_batch *batch, struct io_request *req,
+			uint8_t *buf)
+{
+	ext2_filsys fs = range->scan->fs;
+	blk64_t first = ext_group_first(fs, group);
+	blk64_t units = ext_group_units(fs, group);
+
+	switch (ext_group_classify(range, group)) {
+	case EXT_GROUP_USED:
+		bitmap_scan_span(scan, first, FALSE);
+		break;
+	case EXT_GROUP_FREE:
+		bitmap_scan_span(scan, first, TRUE);
+		break;
+	case EXT_GROUP_PRUNE:
+		range->free_sectors += ext2fs_bg_free_blocks_count(fs, group) *
+					(uint64_t) range->scan->unit_sectors;
+		bitmap_scan_span(scan, first, FALSE);
+		break;
+	case EXT_GROUP_BUILD:
+		if (!ext_group_build_bitmap(range, group, buf)) {
+			range->failed = TRUE;
+			return;
+		}
+		bitmap_scan_feed(scan, buf, first, units);
+		break;
+	case EXT_GROUP_READ:
+		/* Pruning thresholds only rise, so a read was planned for
+		   every group which can reach this point, unless its bitmap
+		   location was invalid */
+		if (req == NULL || !io_batch_wait(batch, req)) {
+			range->failed = TRUE;
+			return;
+		}
+		bitmap_scan_feed(scan, req->buf, first, units);
+		break;
+	}
+}
+
+static void *ext_range_scan(void *_range)
+{
+	struct ext_range *range = _range;
+	ext2_filsys fs = range->scan->fs;
+	struct bitmap_scan scan;
+	struct io_batch batch;
+	struct io_request *reqs;
+	struct io_request **group_reqs;
+	uint8_t *bufs;
+	uint8_t *buf;
+	dgrp_t window;
+	dgrp_t window_end;
+	dgrp_t group;
+	blk64_t loc;
+	unsigned count;
+
+	bufs = g_malloc((size_t) EXT_IO_WINDOW_GROUPS * fs->blocksize);
+	buf = g_malloc(fs->blocksize);
+	reqs = g_new(struct io_request, EXT_IO_WINDOW_GROUPS);
+	group_reqs = g_new(struct io_request *, EXT_IO_WINDOW_GROUPS);
+	bitmap_scan_init(&scan, range->scan->unit_sectors, ext_range_emit,
+				range);
+	for (window = range->first_group; window < range->end_group &&
+				!range->failed; window = window_end) {
+		window_end = MIN(window + EXT_IO_WINDOW_GROUPS,
+					range->end_group);
+
+		/* Plan the bitmap reads for this window */
+		for (group = window, count = 0; group < window_end; group++) {
+			group_reqs[group - window] = NULL;
+			if (ext_group_classify(range, group) !=
+						EXT_GROUP_READ)
+				continue;
+			loc = ext2fs_block_bitmap_loc(fs, group);
+			if (loc == 0 || loc >= ext2fs_blocks_count(fs->super))
+				continue;
+			reqs[count].offset = loc * fs->blocksize;
+			reqs[count].len = fs->blocksize;
+			reqs[count].buf = bufs + (size_t) count * fs->blocksize;
+			group_reqs[group - window] = &reqs[count++];
+		}
+
+		io_batch_start(&batch, range->scan->fd, reqs, count);
+		for (group = window; group < window_end && !range->failed;
+					group++)
+			ext_range_scan_group(range, &scan, group, &batch,
+						group_reqs[group - window], buf);
+		io_batch_finish(&batch);
+	}
+	range->tail_open = scan.in_run;
+	range->tail_start = scan.run_start;
+	g_free(group_reqs);
+	g_free(reqs);
+	g_free(buf);
+	g_free(bufs);
+	return NULL;
+}
+
+static void ext_scan_ranges(struct ext_scan *scan)
+{
+	ext2_filsys fs = scan->fs;
+	struct device *device = scan->device;
+	struct ext_range *ranges;
+	struct ext_range *range;
+	unsigned nr_ranges;
+	dgrp_t groups_per_range;
+	uint64_t carry_start = 0;
+	uint64_t carry_sectors = 0;
+	unsigned n;
+
+	nr_ranges = fs_jobs ? fs_jobs : g_get_num_processors();
+	nr_ranges = MIN(nr_ranges, fs->group_desc_count / EXT_MIN_RANGE_GROUPS);
+	nr_ranges = MAX(nr_ranges, 1);
+	groups_per_range = (fs->group_desc_count + nr_ranges - 1) / nr_ranges;
+	ranges = g_new0(struct ext_range, nr_ranges);
+	for (n = 0; n < nr_ranges; n++) {
+		range = &ranges[n];
+		range->scan = scan;
+		range->first_group = MIN(n * groups_per_range,
+					fs->group_desc_count);
+		range->end_group = MIN(range->first_group + groups_per_range,
+					fs->group_desc_count);
+		range->extents = extent_set_new();
+		if (range->first_group == range->end_group)
+			continue;
+		range->start = ext_group_first(fs, range->first_group);
+		range->end = ext_group_first(fs, range->end_group - 1) +
+					ext_group_units(fs, range->end_group - 1);
+		range->thread = g_thread_new("ext-scan", ext_range_scan,
+					range);
+	}
+	if (nr_ranges > 1)
+		msg("%s: Scanning %u block group ranges", device->path,
+					nr_ranges);
+
+	for (n = 0; n < nr_ranges; n++) {
+		if (ranges[n].thread != NULL)
+			g_thread_join(ranges[n].thread);
+		if (ranges[n].failed)
+			reject(device, "Couldn't read block bitmap");
+	}
+
+	for (n = 0; n < nr_ranges; n++) {
+		range = &ranges[n];
+		if (range->thread == NULL || device->problem != NULL) {
+			extent_set_free(range->extents);
+			continue;
+		}
+		device->free_extents += range->free_extents;
+		device->free_sectors += range->free_sectors;
+		device->align_loss_sectors += range->align_loss_sectors;
+		extent_set_merge(device->extents, range->extents);
+		extent_set_free(range->extents);
+
+		if (range->tail_open && range->tail_start == range->start &&
+					n > 0) {
+			/* Entirely free */
+			if (!carry_sectors)
+				carry_start = range->start *
+							scan->unit_sectors;
+			carry_sectors += (range->end - range->start) *
+						scan->unit_sectors;
+			continue;
+		}
+		if (range->head_sectors) {
+			if (!carry_sectors)
+				carry_start = range->start *
+							scan->unit_sectors;
+			carry_sectors += range->head_sectors;
+		}
+		if (carry_sectors)
+			add_extent(device, carry_start, carry_sectors);
+		carry_sectors = 0;
+		if (range->tail_open) {
+			carry_start = range->tail_start * scan->unit_sectors;
+			carry_sectors = (range->end - range->tail_start) *
+						scan->unit_sectors;
+		}
+	}
+	if (carry_sectors)
+		add_extent(device, carry_start, carry_sectors);
+	g_free(ranges);
+}
+
+static void handle_ext(struct device *device)
+{
+	struct ext_scan scan = {
+		.device = device,
+		.fd = -1,
+	};
+	ext2_filsys fs;
+
+	if (ext2fs_open(device->path, EXT2_FLAG_64BITS, 0, 0, unix_io_manager,
+				&fs)) {
+		reject(device, "Couldn't read filesystem");
+		return;
+	}
+	if (fs->super->s_state & EXT2_ERROR_FS) {
+		reject(device, "Filesystem has errors");
+		goto out;
+	}
+	if (!(fs->super->s_state & EXT2_VALID_FS)) {
+		reject(device, "Unclean filesystem");
+		goto out;
+	}
+	scan.fd = open(device->path, O_RDONLY);
+	if (scan.fd == -1) {
+		reject(device, "Couldn't open device");
+		goto out;
+	}
+	scan.fs = fs;
+	scan.unit_sectors = fs->blocksize / 512 * EXT2FS_CLUSTER_RATIO(fs);
+	g_mutex_init(&scan.bitmap_lock);
+	ext_compute_bounds(&scan);
+	ext_scan_ranges(&scan);
+	g_free(scan.free_before);
+	g_free(scan.free_after);
+	g_mutex_clear(&scan.bitmap_lock);
+	close(scan.fd);
+out:
+	if (ext2fs_close(fs))
+		die("Couldn't close filesystem on %s", device->path);
+}
+
+/* The superblock is rewritten whenever the filesystem is mounted or
+   unmounted, so the write time and mount count change whenever the free
+   space might have.  Only the superblock is read. */
+static gboolean ext_cache_key(struct device *device, gchar **ident,
+			gchar **state)
+{
+	struct ext2_super_block *sb;
+	ext2_filsys fs;
+	gboolean ret = FALSE;
+
+	if (ext2fs_open(device->path, EXT2_FLAG_64BITS | EXT2_FLAG_SUPER_ONLY,
+				0, 0, unix_io_manager, &fs))
+		return FALSE;
+	sb = fs->super;
+	if ((sb->s_state & EXT2_ERROR_FS) || !(sb->s_state & EXT2_VALID_FS))
+		goto out;
+	*ident = cache_hex(sb->s_uuid, sizeof(sb->s_uuid));
+	*state = g_strdup_printf("%u-%u-%u-%u-%"PRIu64"-%llu-%llu",
+				sb->s_wtime, sb->s_mtime, sb->s_mnt_count,
+				sb->s_state, (uint64_t) sb->s_kbytes_written,
+				(unsigned long long) ext2fs_blocks_count(sb),
+				(unsigned long long)
+				ext2fs_free_blocks_count(sb));
+	ret = TRUE;
+out:
+	if (ext2fs_close(fs))
+		die("Couldn't close filesystem on %s", device->path);
+	return ret;
+}
+
+/* ntfs */
+
+/* Reading the volume bitmap doesn't need a full ntfs_mount(), which
+   loads the MFT, upcase table and journal state.  The light reader below
+   parses the boot sector and only the file records involved: $Volume for
+   the version and dirty flag, $LogFile for a clean shutdown, the root
+   directory to find hiberfil.sys, and $Bitmap itself, whose clusters are
+   then streamed directly.  Anything it doesn't expect sends the volume
+   to libntfs instead. */
+
+#define NTFS_FILE_MFT 0
+#define NTFS_FILE_LOGFILE 2
+#define NTFS_FILE_VOLUME 3
+#define NTFS_FILE_ROOT 5
+#define NTFS_FILE_BITMAP 6
+#define NTFS_BLOCK_SIZE 512
+#define NTFS_MIN_RECORD_SIZE 1024
+#define NTFS_MAX_RECORD_SIZE 65536
+#define NTFS_MREF_MASK 0xffffffffffffULL
+#define NTFS_RECORD_IN_USE 0x1
+#define NTFS_AT_STANDARD_INFORMATION 0x10
+#define NTFS_AT_ATTRIBUTE_LIST 0x20
+#define NTFS_AT_VOLUME_INFORMATION 0x70
+#define NTFS_AT_DATA 0x80
+#define NTFS_AT_INDEX_ROOT 0x90
+#define NTFS_AT_INDEX_ALLOCATION 0xa0
+#define NTFS_AT_END 0xffffffff
+#define NTFS_VOLUME_IS_DIRTY 0x1
+#define NTFS_LOGFILE_NO_CLIENT 0xffff
+#define NTFS_RESTART_VOLUME_IS_CLEAN 0x2
+#define NTFS_INDEX_ENTRY_END 0x2
+#define NTFS_MAX_INDEX_BYTES (64 << 20)
+#define NTFS_HIBERFILE_NAME "hiberfil.sys"
+#define NTFS_SERIAL_OFFSET 0x48
+#define NTFS_LOGFILE_RESTART_BYTES 8192
+#define NTFS_LOGFILE_EMPTY_MAGIC 0xffffffff
+
+struct ntfs_run {
+	uint64_t vcn;
+	uint64_t lcn;
+	uint64_t len;
+};
+
+struct ntfs_light {
+	struct device *device;
+	int fd;
+	unsigned cluster_size;
+	unsigned record_size;
+	uint64_t nr_clusters;
+	uint8_t serial[8];
+	GArray *mft_runs;
+	const char *unusual;  /* why we fell back to libntfs */
+};
+
+/* The unnamed $DATA attribute of a file, or a directory index */
+struct ntfs_light_stream {
+	struct ntfs_light *vol;
+	GArray *runs;  /* NULL if resident */
+	const uint8_t *value;
+	uint64_t data_size;
+	uint64_t initialized_size;
+};
+
+static const char ntfs_light_fallback[] = "";
+
+static uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (uint16_t) p[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return get_le16(p) | (uint32_t) get_le16(p + 2) << 16;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | (uint64_t) get_le32(p + 4) << 32;
+}
+
+static const char *ntfs_light_unusual(struct ntfs_light *vol,
+			const char *why)
+{
+	vol->unusual = why;
+	return ntfs_light_fallback;
+}
+
+/* Check the update sequence array of a multi-sector record and restore
+   the bytes it replaced */
+static gboolean ntfs_light_fixup(uint8_t *buf, unsigned size,
+			const char *magic)
+{
+	unsigned usa_ofs = get_le16(buf + 4);
+	unsigned usa_count = get_le16(buf + 6);
+	unsigned n;
+
+	if (memcmp(buf, magic, 4) || usa_count != size / NTFS_BLOCK_SIZE + 1 ||
+				usa_ofs < 8 || usa_ofs + 2 * usa_count > size)
+		return FALSE;
+	for (n = 1; n < usa_count; n++) {
+		if (memcmp(buf + n * NTFS_BLOCK_SIZE - 2, buf + usa_ofs, 2))
+			return FALSE;
+		memcpy(buf + n * NTFS_BLOCK_SIZE - 2, buf + usa_ofs + 2 * n, 2);
+	}
+	return TRUE;
+}
+
+static gboolean ntfs_light_pread(void *_stream, uint64_t offset, void *buf,
+			size_t len)
+{
+	struct ntfs_light_stream *stream = _stream;
+	uint64_t cluster_size = stream->vol->cluster_size;
+	struct ntfs_run *run;
+	uint64_t within;
+	size_t count;
+	unsigned n = 0;
+
+	if (offset > stream->initialized_size ||
+				len > stream->initialized_size - offset)
+		return FALSE;
+	if (stream->runs == NULL) {
+		memcpy(buf, stream->value + offset, len);
+		return TRUE;
+	}
+	while (len) {
+		for (; n < stream->runs->len; n++) {
+			run = &g_array_index(stream->runs, struct ntfs_run, n);
+			if (offset < (run->vcn + run->len) * cluster_size)
+				break;
+		}
+		if (n == stream->runs->len)
+			return FALSE;
+		within = offset - run->vcn * cluster_size;
+		count = MIN(len, run->len * cluster_size - within);
+		if (!io_read_full(stream->vol->fd, buf, count,
+					run->lcn * cluster_size + within))
+			return FALSE;
+		buf = (uint8_t *) buf + count;
+		offset += count;
+		len -= count;
+	}
+	return TRUE;
+}
+
+/* The volume bitmap is read a chunk at a time.  On a fragmented $Bitmap
+   one chunk covers many runs, so the pieces of each chunk are issued
+   together as an I/O batch rather than one pread at a time. */
+static gboolean ntfs_light_read_bitmap(void *_stream, uint64_t offset,
+			void *buf, size_t len)
+{
+	struct ntfs_light_stream *stream = _stream;
+	uint64_t cluster_size = stream->vol->cluster_size;
+	struct ntfs_run *run;
+	struct io_request req;
+	struct io_batch batch;
+	GArray *reqs;
+	unsigned n;
+	gboolean ok = TRUE;
+
+	if (stream->runs == NULL || offset > stream->initialized_size ||
+				len > stream->initialized_size - offset)
+		return ntfs_light_pread(stream, offset, buf, len);
+	reqs = g_array_new(FALSE, TRUE, sizeof(struct io_request));
+	for (n = 0; n < stream->runs->len && len; n++) {
+		run = &g_array_index(stream->runs, struct ntfs_run, n);
+		if (offset >= (run->vcn + run->len) * cluster_size)
+			continue;
+		if (offset < run->vcn * cluster_size)
+			break;
+		memset(&req, 0, sizeof(req));
+		req.offset = run->lcn * cluster_size + offset -
+					run->vcn * cluster_size;
+		req.len = MIN(len, (run->vcn + run->len) * cluster_size -
+					offset);
+		req.buf = buf;
+		g_array_append_val(reqs, req);
+		buf = (uint8_t *) buf + req.len;
+		offset += req.len;
+		len -= req.len;
+	}
+	if (len) {
+		g_array_free(reqs, TRUE);
+		return FALSE;
+	}
+	io_batch_start(&batch, stream->vol->fd,
+				(struct io_request *) reqs->data, reqs->len);
+	for (n = 0; n < reqs->len; n++)
+		if (!io_batch_wait(&batch, &g_array_index(reqs,
+					struct io_request, n)))
+			ok = FALSE;
+	io_batch_finish(&batch);
+	g_array_free(reqs, TRUE);
+	return ok;
+}
+
+/* Read an MFT record and check that it's a base record in use */
+static gboolean ntfs_light_read_record(struct ntfs_light *vol,
+			uint64_t mref, uint8_t *buf)
+{
+	struct ntfs_light_stream mft = {vol, vol->mft_runs, NULL,
+				UINT64_MAX, UINT64_MAX};
+	uint64_t recno = mref & NTFS_MREF_MASK;
+
+	if (!ntfs_light_pread(&mft, recno * vol->record_size, buf,
+				vol->record_size) ||
+				!ntfs_light_fixup(buf, vol->record_size,
+				"FILE"))
+		return FALSE;
+	/* A reference with a sequence number must match the record's */
+	if ((mref >> 48) && get_le16(buf + 16) != mref >> 48)
+		return FALSE;
+	return (get_le16(buf + 22) & NTFS_RECORD_IN_USE) &&
+				get_le64(buf + 32) == 0 &&
+				get_le32(buf + 24) <= vol->record_size;
+}
+
+/* Returns the first attribute of the given type, or NULL.  Sets *bad if
+   the record is malformed or has an attribute list, which would mean the
+   attribute might be continued elsewhere. */
+static const uint8_t *ntfs_light_find_attr(const uint8_t *rec, uint32_t type,
+			gboolean *bad)
+{
+	const uint8_t *end = rec + get_le32(rec + 24);
+	const uint8_t *attr = rec + get_le16(rec + 20);
+	uint32_t len;
+
+	*bad = TRUE;
+	while (attr + 8 <= end) {
+		if (get_le32(attr) == NTFS_AT_END) {
+			*bad = FALSE;
+			return NULL;
+		}
+		len = get_le32(attr + 4);
+		if (len < 24 || len % 8 || len > (size_t) (end - attr) ||
+					get_le32(attr) ==
+					NTFS_AT_ATTRIBUTE_LIST)
+			return NULL;
+		if (get_le32(attr) == type) {
+			*bad = FALSE;
+			return attr;
+		}
+		attr += len;
+	}
+	return NULL;
+}
+
+/* Set up stream for a resident or non-resident attribute.  Compressed,
+   sparse and encrypted attributes aren't handled. */
+static gboolean ntfs_light_attr_stream(struct ntfs_light *vol,
+			const uint8_t *attr, struct ntfs_light_stream *stream)
+{
+	uint32_t len = get_le32(attr + 4);
+	const uint8_t *p;
+	const uint8_t *end = attr + len;
+	struct ntfs_run run = {0};
+	uint64_t vcn = 0;
+	int64_t lcn = 0;
+	int64_t delta;
+	unsigned len_size;
+	unsigned off_size;
+	unsigned n;
+
+	stream->vol = vol;
+	stream->runs = NULL;
+	if (!attr[8]) {
+		if (get_le16(attr + 20) + (uint64_t) get_le32(attr + 16) > len)
+			return FALSE;
+		stream->value = attr + get_le16(attr + 20);
+		stream->data_size = get_le32(attr + 16);
+		stream->initialized_size = stream->data_size;
+		return TRUE;
+	}
+	if (len < 64 || get_le16(attr + 12) || get_le64(attr + 16) ||
+				get_le16(attr + 32) >= len)
+		return FALSE;
+	stream->data_size = get_le64(attr + 48);
+	stream->initialized_size = MIN(get_le64(attr + 56),
+				stream->data_size);
+	stream->runs = g_array_new(FALSE, FALSE, sizeof(struct ntfs_run));
+	for (p = attr + get_le16(attr + 32); p < end && *p; ) {
+		len_size = *p & 0xf;
+		off_size = *p >> 4;
+		p++;
+		/* No offset means a sparse run */
+		if (len_size == 0 || len_size > 8 || off_size == 0 ||
+					off_size > 8 ||
+					len_size + off_size > end - p)
+			goto bad;
+		run.len = 0;
+		for (n = 0; n < len_size; n++)
+			run.len |= (uint64_t) p[n] << (8 * n);
+		p += len_size;
+		delta = 0;
+		for (n = 0; n < off_size; n++)
+			delta |= (uint64_t) p[n] << (8 * n);
+		if (off_size < 8 && (p[off_size - 1] & 0x80))
+			delta |= ~(uint64_t) 0 << (8 * off_size);
+		p += off_size;
+		lcn += delta;
+		if (lcn < 0 || run.len == 0 || run.len > vol->nr_clusters ||
+					(uint64_t) lcn > vol->nr_clusters -
+					run.len)
+			goto bad;
+		run.vcn = vcn;
+		run.lcn = lcn;
+		g_array_append_val(stream->runs, run);
+		vcn += run.len;
+	}
+	/* The runlist must be complete in this attribute */
+	if (vcn != get_le64(attr + 24) + 1 ||
+				stream->data_size > vcn * vol->cluster_size)
+		goto bad;
+	return TRUE;
+
+bad:
+	g_array_free(stream->runs, TRUE);
+	stream->runs = NULL;
+	return FALSE;
+}
+
+static void ntfs_light_stream_free(struct ntfs_light_stream *stream)
+{
+	if (stream->runs != NULL)
+		g_array_free(stream->runs, TRUE);
+	stream->runs = NULL;
+}
+
+/* Read a record and set up a stream for an attribute of it, which must
+   not be compressed or continued in another record.  rec must remain
+   allocated while a resident stream is used. */
+static const char *ntfs_light_open_attr(struct ntfs_light *vol,
+			uint64_t mref, uint32_t type, uint8_t *rec,
+			struct ntfs_light_stream *stream)
+{
+	const uint8_t *attr;
+	gboolean bad;
+
+	if (!ntfs_light_read_record(vol, mref, rec))
+		return ntfs_light_unusual(vol, "Couldn't read MFT record");
+	attr = ntfs_light_find_attr(rec, type, &bad);
+	if (bad)
+		return ntfs_light_unusual(vol, "Unusual MFT record");
+	if (attr == NULL || (type == NTFS_AT_DATA && attr[9] != 0))
+		return ntfs_light_unusual(vol, "Missing attribute");
+	if (!ntfs_light_attr_stream(vol, attr, stream))
+		return ntfs_light_unusual(vol, "Unusual attribute");
+	return NULL;
+}
+
+static const char *ntfs_light_open(struct ntfs_light *vol,
+			struct device *device)
+{
+	struct ntfs_light_stream mft;
+	uint8_t bs[512];
+	uint8_t *rec;
+	const uint8_t *attr;
+	unsigned sector_size;
+	unsigned spc;
+	int8_t cpr;
+	uint64_t total;
+	uint64_t mft_lcn;
+	gboolean bad;
+	const char *problem = NULL;
+
+	vol->device = device;
+	vol->fd = open(device->path, O_RDONLY);
+	if (vol->fd == -1)
+		return "Couldn't open device";
+	if (!io_read_full(vol->fd, bs, sizeof(bs), 0))
+		return "Couldn't read boot sector";
+	memcpy(vol->serial, bs + NTFS_SERIAL_OFFSET, sizeof(vol->serial));
+	sector_size = get_le16(bs + 11);
+	spc = bs[13];
+	/* Large clusters are stored as a negative shift */
+	if (spc > 0x80)
+		spc = spc >= 0xf4 ? 1U << (256 - spc) : 0;
+	total = get_le64(bs + 40);
+	mft_lcn = get_le64(bs + 48);
+	cpr = bs[64];
+	if (memcmp(bs + 3, "NTFS    ", 8) || bs[510] != 0x55 ||
+				bs[511] != 0xaa || sector_size < 512 ||
+				sector_size > 4096 ||
+				(sector_size & (sector_size - 1)) || spc == 0 ||
+				(spc & (spc - 1)))
+		return ntfs_light_unusual(vol, "Unusual boot sector");
+	vol->cluster_size = sector_size * spc;
+	vol->nr_clusters = total / spc;
+	if (cpr > 0)
+		vol->record_size = cpr * vol->cluster_size;
+	else if (cpr > -31)
+		vol->record_size = 1U << -cpr;
+	if (vol->record_size < NTFS_MIN_RECORD_SIZE ||
+				vol->record_size > NTFS_MAX_RECORD_SIZE ||
+				(vol->record_size & (vol->record_size - 1)) ||
+				mft_lcn >= vol->nr_clusters)
+		return ntfs_light_unusual(vol, "Unusual boot sector");
+	if (total * sector_size / 512 > device->sectors)
+		return ntfs_light_unusual(vol, "Filesystem larger than device");
+
+	/* Bootstrap from $MFT's own record, which holds the runlist for
+	   the rest */
+	rec = g_malloc(vol->record_size);
+	if (!io_read_full(vol->fd, rec, vol->record_size,
+				mft_lcn * vol->cluster_size) ||
+				!ntfs_light_fixup(rec, vol->record_size,
+				"FILE") || get_le32(rec + 24) >
+				vol->record_size) {
+		problem = ntfs_light_unusual(vol, "Couldn't read $MFT");
+		goto out;
+	}
+	attr = ntfs_light_find_attr(rec, NTFS_AT_DATA, &bad);
+	if (attr == NULL || attr[9] != 0 || !attr[8] ||
+				!ntfs_light_attr_stream(vol, attr, &mft)) {
+		problem = ntfs_light_unusual(vol, "Unusual $MFT");
+		goto out;
+	}
+	if (g_array_index(mft.runs, struct ntfs_run, 0).lcn != mft_lcn) {
+		ntfs_light_stream_free(&mft);
+		problem = ntfs_light_unusual(vol, "Unusual $MFT");
+		goto out;
+	}
+	vol->mft_runs = mft.runs;
+out:
+	g_free(rec);
+	return problem;
+}
+
+static void ntfs_light_close(struct ntfs_light *vol)
+{
+	if (vol->mft_runs != NULL)
+		g_array_free(vol->mft_runs, TRUE);
+	if (vol->fd != -1)
+		close(vol->fd);
+}
+
+/* The checks ntfs_version_is_supported() and NVolWasDirty() would make */
+static const char *ntfs_light_check_volume(struct ntfs_light *vol)
+{
+	struct ntfs_light_stream info;
+	uint8_t *rec;
+	const char *problem;
+
+	rec = g_malloc(vol->record_size);
+	problem = ntfs_light_open_attr(vol, NTFS_FILE_VOLUME,
+				NTFS_AT_VOLUME_INFORMATION, rec, &info);
+	if (problem != NULL)
+		goto out;
+	if (info.runs != NULL || info.data_size < 12) {
+		ntfs_light_stream_free(&info);
+		problem = ntfs_light_unusual(vol, "Unusual $Volume");
+		goto out;
+	}
+	if (!(info.value[8] == 1 && info.value[9] == 2) &&
+				!(info.value[8] == 3 && info.value[9] <= 1))
+		problem = "Unsupported filesystem version";
+	else if (get_le16(info.value + 10) & NTFS_VOLUME_IS_DIRTY)
+		problem = "Filesystem needs checking";
+out:
+	g_free(rec);
+	return problem;
+}
+
+/* Read the $LogFile restart pages, raw, into buf of
+   NTFS_LOGFILE_RESTART_BYTES.  Returns the length read.  Sets *empty if
+   the log has been reset, as ntfs_check_logfile() decides it: the first
+   word of every block it would look at for a restart page, at 0 and
+   then at each power of two from NTFS_BLOCK_SIZE, is the empty magic. */
+static const char *ntfs_light_read_restart(struct ntfs_light *vol,
+			uint8_t *buf, size_t *len, gboolean *empty)
+{
+	struct ntfs_light_stream log;
+	uint8_t *rec;
+	uint8_t word[4];
+	uint64_t pos;
+	const char *problem;
+
+	rec = g_malloc(vol->record_size);
+	problem = ntfs_light_open_attr(vol, NTFS_FILE_LOGFILE, NTFS_AT_DATA,
+				rec, &log);
+	if (problem != NULL)
+		goto out;
+	*len = MIN(log.data_size, NTFS_LOGFILE_RESTART_BYTES);
+	if (log.runs == NULL || *len < sizeof(word) ||
+				!ntfs_light_pread(&log, 0, buf, *len)) {
+		problem = ntfs_light_unusual(vol, "Couldn't read $LogFile");
+		goto out_free;
+	}
+	*empty = get_le32(buf) == NTFS_LOGFILE_EMPTY_MAGIC;
+	for (pos = NTFS_BLOCK_SIZE; *empty && pos < log.data_size;
+				pos <<= 1) {
+		if (pos + sizeof(word) <= *len) {
+			memcpy(word, buf + pos, sizeof(word));
+		} else if (!ntfs_light_pread(&log, pos, word, sizeof(word))) {
+			problem = ntfs_light_unusual(vol,
+						"Couldn't read $LogFile");
+			break;
+		}
+		*empty = get_le32(word) == NTFS_LOGFILE_EMPTY_MAGIC;
+	}
+out_free:
+	ntfs_light_stream_free(&log);
+out:
+	g_free(rec);
+	return problem;
+}
+
+/* Like ntfs_is_logfile_clean(): the more recent of the two restart
+   pages must show no clients, or a clean volume.  Sets *lsn to the
+   current LSN recorded there.  A log which has been reset, as the Linux
+   drivers do on mount, has no restart pages and is clean; *lsn is 0. */
+static const char *ntfs_light_check_logfile(struct ntfs_light *vol,
+			uint64_t *lsn)
+{
+	uint8_t buf[NTFS_LOGFILE_RESTART_BYTES];
+	uint8_t *page;
+	const uint8_t *ra = NULL;
+	unsigned page_size;
+	unsigned n;
+	size_t len;
+	gboolean empty;
+	const char *problem;
+
+	problem = ntfs_light_read_restart(vol, buf, &len, &empty);
+	if (problem != NULL)
+		return problem;
+	if (empty) {
+		*lsn = 0;
+		return NULL;
+	}
+	page_size = len >= 20 ? get_le32(buf + 16) : 0;
+	if (page_size < NTFS_BLOCK_SIZE || page_size > len / 2 ||
+				(page_size & (page_size - 1)))
+		return ntfs_light_unusual(vol, "Unusual $LogFile");
+	for (n = 0; n < 2; n++) {
+		page = buf + n * page_size;
+		if (!ntfs_light_fixup(page, page_size, "RSTR")) {
+			/* The first page must be valid */
+			if (n == 0)
+				return ntfs_light_unusual(vol,
+							"Unusual $LogFile");
+			continue;
+		}
+		if (get_le16(page + 24) > page_size - 16)
+			return ntfs_light_unusual(vol, "Unusual $LogFile");
+		if (ra == NULL || get_le64(page + get_le16(page + 24)) >
+					*lsn) {
+			ra = page + get_le16(page + 24);
+			*lsn = get_le64(ra);
+		}
+	}
+	if (get_le16(ra + 12) != NTFS_LOGFILE_NO_CLIENT &&
+				!(get_le16(ra + 14) & NTFS_RESTART_VOLUME_IS_CLEAN))
+		return "Filesystem was not shut down cleanly";
+	return NULL;
+}
+
+/* Look for hiberfil.sys among the index entries following hdr.  Sets
+   *mref to its file reference, if found.  Returns FALSE if the entries
+   are malformed. */
+static gboolean ntfs_light_index_find(const uint8_t *hdr, const uint8_t *end,
+			uint64_t *mref)
+{
+	const char *name = NTFS_HIBERFILE_NAME;
+	const uint8_t *entry;
+	const uint8_t *limit;
+	unsigned len;
+	unsigned key_len;
+	unsigned n;
+	uint16_t c;
+
+	if (get_le32(hdr) > (size_t) (end - hdr) ||
+				get_le32(hdr + 4) > (size_t) (end - hdr))
+		return FALSE;
+	entry = hdr + get_le32(hdr);
+	limit = hdr + get_le32(hdr + 4);
+	while (entry + 16 <= limit) {
+		len = get_le16(entry + 8);
+		key_len = get_le16(entry + 10);
+		if (get_le16(entry + 12) & NTFS_INDEX_ENTRY_END)
+			return TRUE;
+		if (len < 16 || len > limit - entry || key_len > len - 16)
+			return FALSE;
+		if (key_len >= 66 + 2 * strlen(name) &&
+					entry[16 + 64] == strlen(name)) {
+			for (n = 0; name[n]; n++) {
+				c = get_le16(entry + 16 + 66 + 2 * n);
+				if (c > 127 || g_ascii_tolower(c) != name[n])
+					break;
+			}
+			if (name[n] == 0) {
+				*mref = get_le64(entry);
+				return TRUE;
+			}
+		}
+		entry += len;
+	}
+	return entry == limit;
+}
+
+/* Find hiberfil.sys in the root directory.  Rather than descend the
+   index B+tree, which would need the upcase table for collation, we look
+   through every entry of the root and of every index block. */
+static const char *ntfs_light_find_hiberfile(struct ntfs_light *vol,
+			uint64_t *mref)
+{
+	struct ntfs_light_stream root;
+	struct ntfs_light_stream alloc = {0};
+	uint8_t *rec;
+	uint8_t *block = NULL;
+	const uint8_t *attr;
+	uint64_t offset;
+	uint32_t block_size;
+	gboolean bad;
+	const char *problem;
+
+	*mref = 0;
+	rec = g_malloc(vol->record_size);
+	problem = ntfs_light_open_attr(vol, NTFS_FILE_ROOT,
+				NTFS_AT_INDEX_ROOT, rec, &root);
+	if (problem != NULL)
+		goto out;
+	if (root.runs != NULL || root.data_size < 32 ||
+				!ntfs_light_index_find(root.value + 16,
+				root.value + root.data_size, mref)) {
+		ntfs_light_stream_free(&root);
+		problem = ntfs_light_unusual(vol, "Unusual root directory");
+		goto out;
+	}
+	block_size = get_le32(root.value + 8);
+	attr = ntfs_light_find_attr(rec, NTFS_AT_INDEX_ALLOCATION, &bad);
+	if (*mref || (attr == NULL && !bad))
+		goto out;
+	if (attr == NULL || !attr[8] || !ntfs_light_attr_stream(vol, attr, &alloc) ||
+				alloc.data_size > NTFS_MAX_INDEX_BYTES ||
+				block_size < NTFS_BLOCK_SIZE ||
+				block_size > NTFS_MAX_RECORD_SIZE ||
+				(block_size & (block_size - 1))) {
+		problem = ntfs_light_unusual(vol, "Unusual root directory");
+		goto out;
+	}
+	block = g_malloc(block_size);
+	for (offset = 0; offset + block_size <= alloc.initialized_size &&
+				*mref == 0; offset += block_size) {
+		if (!ntfs_light_pread(&alloc, offset, block, block_size)) {
+			problem = ntfs_light_unusual(vol,
+						"Couldn't read root directory");
+			break;
+		}
+		/* Blocks not in use needn't be valid */
+		if (!ntfs_light_fixup(block, block_size, "INDX"))
+			continue;
+		if (!ntfs_light_index_find(block + 24, block + block_size,
+					mref)) {
+			problem = ntfs_light_unusual(vol,
+						"Unusual root directory");
+			break;
+		}
+	}
+out:
+	ntfs_light_stream_free(&alloc);
+	g_free(block);
+	g_free(rec);
+	return problem;
+}
+
+/* Like ntfs_volume_check_hiberfile(): refuse a volume whose
+   hiberfil.sys holds a hibernation image. */
+static const char *ntfs_light_check_hiberfile(struct ntfs_light *vol)
+{
+	struct ntfs_light_stream data;
+	uint8_t *rec;
+	uint8_t magic[4];
+	uint64_t mref;
+	const char *problem;
+
+	problem = ntfs_light_find_hiberfile(vol, &mref);
+	if (problem != NULL || mref == 0)
+		return problem;
+	rec = g_malloc(vol->record_size);
+	problem = ntfs_light_open_attr(vol, mref, NTFS_AT_DATA, rec, &data);
+	if (problem != NULL)
+		goto out;
+	if (data.initialized_size >= sizeof(magic)) {
+		if (!ntfs_light_pread(&data, 0, magic, sizeof(magic)))
+			problem = ntfs_light_unusual(vol,
+						"Couldn't read hiberfil.sys");
+		else if (!g_ascii_strncasecmp((char *) magic, "hibr", 4))
+			problem = "Windows is hibernated";
+	}
+	ntfs_light_stream_free(&data);
+out:
+	g_free(rec);
+	return problem;
+}
+
+/* Feed the volume bitmap through the scanner.  Returns FALSE on a short
+   read, having added no extents. */
+static gboolean ntfs_scan_bitmap(struct device *device,
+			gboolean (*read)(void *ctx, uint64_t offset, void *buf,
+			size_t len), void *ctx, uint64_t nr_clusters,
+			unsigned cluster_size)
+{
+	struct bitmap_scan scan;
+	struct bitmap_reader reader;
+	struct bitmap_chunk *chunk;
+	struct extent_set *shared;
+	gboolean ok = TRUE;
+	gboolean done;
+
+	shared = device_extents_begin(device);
+	bitmap_scan_init(&scan, cluster_size / 512, NULL, device);
+	bitmap_reader_start(&reader, read, ctx, (nr_clusters + 7) / 8);
+	done = reader.len == 0;
+	while (!done) {
+		chunk = bitmap_reader_next(&reader);
+		if (chunk->error) {
+			ok = FALSE;
+			bitmap_reader_release(&reader, chunk);
+			break;
+		}
+		bitmap_scan_feed(&scan, chunk->data, chunk->offset * 8,
+					MIN(chunk->len * 8, nr_clusters -
+					chunk->offset * 8));
+		done = chunk->offset + chunk->len >= reader.len;
+		bitmap_reader_release(&reader, chunk);
+	}
+	bitmap_reader_finish(&reader);
+	if (ok)
+		bitmap_scan_finish(&scan, nr_clusters);
+	device_extents_commit(device, shared, ok);
+	return ok;
+}
+
+/* Returns ntfs_light_fallback if libntfs should handle the volume. */
+static const char *ntfs_light_scan(struct ntfs_light *vol,
+			struct device *device)
+{
+	struct ntfs_light_stream bitmap;
+	uint8_t *rec;
+	uint64_t lsn;
+	const char *problem;
+
+	problem = ntfs_light_open(vol, device);
+	if (problem == NULL)
+		problem = ntfs_light_check_volume(vol);
+	if (problem == NULL)
+		problem = ntfs_light_check_logfile(vol, &lsn);
+	if (problem == NULL)
+		problem = ntfs_light_check_hiberfile(vol);
+	if (problem != NULL)
+		return problem;
+
+	rec = g_malloc(vol->record_size);
+	problem = ntfs_light_open_attr(vol, NTFS_FILE_BITMAP, NTFS_AT_DATA,
+				rec, &bitmap);
+	if (problem != NULL)
+		goto out;
+	if (bitmap.data_size * 8 < vol->nr_clusters)
+		problem = "Unexpectedly short volume bitmap";
+	else if (bitmap.runs == NULL ||
+				bitmap.initialized_size * 8 < vol->nr_clusters)
+		problem = ntfs_light_unusual(vol, "Unusual $Bitmap");
+	else if (!ntfs_scan_bitmap(device, ntfs_light_read_bitmap, &bitmap,
+				vol->nr_clusters, vol->cluster_size))
+		problem = "Short read for volume bitmap";
+	ntfs_light_stream_free(&bitmap);
+out:
+	g_free(rec);
+	return problem;
+}
+
+static gboolean ntfs_read_bitmap(void *na, uint64_t offset, void *buf,
+			size_t len)
+{
+	return ntfs_attr_pread(na, offset, len, buf) == (int64_t) len;
+}
+
+static void ntfs_mount_scan(struct device *device)
+{
+	ntfs_volume *vol;
+	int64_t bitmap_len;
+
+	if (verbose)
+		ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	/* We ask for a forensic mount so that the volume header won't be
+	   updated.  That doesn't guarantee that the filesystem isn't
+	   changed at all; we'd also need NTFS_MNT_RDONLY for that.  However,
+	   we don't use that flag so that ntfs_mount() will fail the
+	   mount if the log is dirty or the filesystem has a Windows
+	   hibernate image. */
+	g_mutex_lock(&ntfs_lock);
+	vol = ntfs_mount(device->path, NTFS_MNT_FORENSIC);
+	g_mutex_unlock(&ntfs_lock);
+	if (vol == NULL) {
+		reject(device, "Couldn't open filesystem; it may be unclean "
+					"or hibernated");
+		return;
+	}
+	if (ntfs_version_is_supported(vol)) {
+		reject(device, "Unsupported filesystem version");
+		goto out;
+	}
+	if (NVolWasDirty(vol)) {
+		reject(device, "Filesystem needs checking");
+		goto out;
+	}
+	bitmap_len = vol->lcnbmp_na->data_size;
+	if (bitmap_len * 8 < vol->nr_clusters) {
+		reject(device, "Unexpectedly short volume bitmap");
+		goto out;
+	}
+	if (!ntfs_scan_bitmap(device, ntfs_read_bitmap, vol->lcnbmp_na,
+				vol->nr_clusters, vol->cluster_size))
+		reject(device, "Short read for volume bitmap");
+out:
+	g_mutex_lock(&ntfs_lock);
+	if (ntfs_umount(vol, FALSE))
+		die("Couldn't close filesystem on %s", device->path);
+	g_mutex_unlock(&ntfs_lock);
+}
+
+static void handle_ntfs(struct device *device)
+{
+	struct ntfs_light vol = {.fd = -1};
+	const char *problem;
+
+	problem = ntfs_light_scan(&vol, device);
+	ntfs_light_close(&vol);
+	if (problem == ntfs_light_fallback) {
+		msg("%s: %s, using libntfs", device->path, vol.unusual);
+		ntfs_mount_scan(device);
+	} else if (problem != NULL) {
+		reject(device, "%s", problem);
+	}
+}
+
+/* Append the LSN of an MFT record to str, followed by the data and
+   record change times from its $STANDARD_INFORMATION. */
+static gboolean ntfs_light_record_state(struct ntfs_light *vol,
+			uint64_t mref, GString *str)
+{
+	const uint8_t *attr;
+	const uint8_t *value;
+	uint8_t *rec;
+	gboolean bad;
+	gboolean ret = FALSE;
+
+	rec = g_malloc(vol->record_size);
+	if (!ntfs_light_read_record(vol, mref, rec))
+		goto out;
+	attr = ntfs_light_find_attr(rec, NTFS_AT_STANDARD_INFORMATION, &bad);
+	if (attr == NULL || attr[8] != 0 || get_le32(attr + 16) < 32 ||
+				get_le16(attr + 20) + 32u > get_le32(attr + 4))
+		goto out;
+	value = attr + get_le16(attr + 20);
+	g_string_append_printf(str, "-%"PRIx64"-%"PRIx64"-%"PRIx64,
+				get_le64(rec + 8), get_le64(value + 8),
+				get_le64(value + 16));
+	ret = TRUE;
+out:
+	g_free(rec);
+	return ret;
+}
+
+/* Windows journals every metadata change, cluster allocations included,
+   so the current LSN in the $LogFile restart area moves whenever it
+   writes to the volume.  The LSNs and change times of the $MFT, $Volume
+   and $Bitmap records are included as well.  Linux drivers don't
+   journal: ntfs-3g and ntfs3 empty the log on every read-write mount and
+   may leave those records alone, so a volume whose log is empty (and
+   has no LSN) isn't cached at all.  Neither is one which needs libntfs, since
+   keying it would take a second full mount.  The serial number comes
+   from the boot sector. */
+static gboolean ntfs_cache_key(struct device *device, gchar **ident,
+			gchar **state)
+{
+	struct ntfs_light light = {.fd = -1};
+	GString *str;
+	uint64_t lsn;
+	gboolean ret = FALSE;
+
+	if (ntfs_light_open(&light, device) != NULL ||
+				ntfs_light_check_volume(&light) != NULL ||
+				ntfs_light_check_logfile(&light, &lsn) != NULL ||
+				lsn == 0 ||
+				ntfs_light_check_hiberfile(&light) != NULL)
+		goto out;
+	str = g_string_new(NULL);
+	g_string_printf(str, "%"PRId64"-%u-%"PRIx64,
+				(int64_t) light.nr_clusters, light.cluster_size,
+				lsn);
+	if (!ntfs_light_record_state(&light, NTFS_FILE_MFT, str) ||
+				!ntfs_light_record_state(&light,
+				NTFS_FILE_VOLUME, str) ||
+				!ntfs_light_record_state(&light,
+				NTFS_FILE_BITMAP, str)) {
+		g_string_free(str, TRUE);
+		goto out;
+	}
+	*ident = cache_hex(light.serial, sizeof(light.serial));
+	*state = g_string_free(str, FALSE);
+	ret = TRUE;
+out:
+	ntfs_light_close(&light);
+	return ret;
+}
+
+/* xfs */
+
+/* XFS keeps free space as extents, in two B+trees per allocation group:
+   one indexed by block number and one by length (the cntbt).  We walk
+   the leaves of the cntbt from the largest extent down, and stop as soon
+   as the rest are too small to be accepted, so there's no bitmap to
+   scan at all.  Allocation groups are walked in parallel.  libxfs isn't
+   a public library, so the on-disk structures are parsed here.
+
+   The trees can only be trusted if the log is clean.  We find the head
+   of the log as the kernel does, by looking for the point where the
+   cycle number stamped on each log block drops, and require the last
+   record before the head to be an unmount record. */
+
+#define XFS_SB_MAGIC 0x58465342  /* XFSB */
+#define XFS_AGF_MAGIC 0x58414746  /* XAGF */
+#define XFS_ABTC_MAGIC 0x41425443  /* ABTC */
+#define XFS_ABTC_CRC_MAGIC 0x41423343  /* AB3C */
+#define XFS_SB_FEAT_INCOMPAT_NEEDSREPAIR (1 << 4)
+#define XFS_BTREE_MAXLEVELS 9
+#define XFS_NULL_AGBLOCK 0xffffffff
+#define XLOG_HEADER_MAGIC 0xfeedbabe
+#define XLOG_VERSION_2 2
+#define XLOG_HEADER_CYCLE_SIZE 32768
+#define XLOG_UNMOUNT_TRANS 0x20
+/* More than the log can have in flight */
+#define XLOG_VERIFY_BLOCKS 1024
+
+struct xfs_scan {
+	struct device *device;
+	int fd;
+	uint8_t uuid[16];
+	uint64_t dblocks;
+	uint32_t blocksize;
+	uint32_t sectsize;
+	uint32_t agblocks;
+	uint32_t agcount;
+	unsigned unit_sectors;
+	gboolean crc;
+	uint64_t log_offset;  /* bytes */
+	uint64_t log_blocks;  /* 512-byte basic blocks */
+	uint32_t log_cycle;
+	uint64_t log_head;
+	volatile gint next_ag;
+};
+
+struct xfs_worker {
+	GThread *thread;
+	struct xfs_scan *scan;
+	struct extent_set *extents;
+	uint64_t free_sectors;
+	uint64_t align_loss_sectors;
+	unsigned free_extents;
+	gboolean failed;
+};
+
+static uint16_t get_be16(const uint8_t *p)
+{
+	return (uint16_t) p[0] << 8 | p[1];
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t) get_be16(p) << 16 | get_be16(p + 2);
+}
+
+static uint64_t get_be64(const uint8_t *p)
+{
+	return (uint64_t) get_be32(p) << 32 | get_be32(p + 4);
+}
+
+/* Returns a problem description, or NULL. */
+static const char *xfs_read_super(struct xfs_scan *scan)
+{
+	uint8_t sb[512];
+	uint64_t logstart;
+	unsigned version;
+	unsigned agblklog;
+
+	if (!io_read_full(scan->fd, sb, sizeof(sb), 0))
+		return "Couldn't read superblock";
+	if (get_be32(sb) != XFS_SB_MAGIC)
+		return "Bad superblock";
+	version = get_be16(sb + 100) & 0xf;
+	if (version != 4 && version != 5)
+		return "Unsupported filesystem version";
+	if (sb[126])
+		return "Filesystem creation incomplete";
+	if (version == 5 && (get_be32(sb + 216) &
+				XFS_SB_FEAT_INCOMPAT_NEEDSREPAIR))
+		return "Filesystem needs repair";
+	scan->blocksize = get_be32(sb + 4);
+	scan->dblocks = get_be64(sb + 8);
+	memcpy(scan->uuid, sb + 32, sizeof(scan->uuid));
+	scan->agblocks = get_be32(sb + 84);
+	scan->agcount = get_be32(sb + 88);
+	scan->sectsize = get_be16(sb + 102);
+	agblklog = sb[124];
+	scan->crc = version == 5;
+	if (scan->blocksize < 512 || scan->blocksize > 65536 ||
+				(scan->blocksize & (scan->blocksize - 1)) ||
+				scan->sectsize < 512 ||
+				scan->sectsize > scan->blocksize ||
+				(scan->sectsize & (scan->sectsize - 1)) ||
+				scan->agblocks == 0 || scan->agcount == 0 ||
+				agblklog >= 32 ||
+				scan->dblocks > (uint64_t) scan->agcount *
+				scan->agblocks)
+		return "Bad superblock";
+	scan->unit_sectors = scan->blocksize / 512;
+	if (scan->dblocks * scan->unit_sectors > scan->device->sectors)
+		return "Filesystem larger than device";
+
+	logstart = get_be64(sb + 48);
+	if (logstart == 0)
+		return "External log not supported";
+	/* A filesystem block number is an AG number and a block offset */
+	scan->log_offset = ((logstart >> agblklog) * scan->agblocks +
+				(logstart & ((1ULL << agblklog) - 1))) *
+				scan->blocksize;
+	scan->log_blocks = (uint64_t) get_be32(sb + 96) * scan->unit_sectors;
+	if (scan->log_blocks < 2)
+		return "Bad superblock";
+	return NULL;
+}
+
+static gboolean xlog_read(struct xfs_scan *scan, uint64_t blk, void *buf,
+			unsigned count)
+{
+	return io_read_full(scan->fd, buf, count * 512,
+				scan->log_offset + blk * 512);
+}
+
+/* The first word of each log block is its cycle number, except in
+   record headers, where it follows the magic number. */
+static uint32_t xlog_block_cycle(const uint8_t *buf)
+{
+	if (get_be32(buf) == XLOG_HEADER_MAGIC)
+		return get_be32(buf + 4);
+	return get_be32(buf);
+}
+
+static gboolean xlog_cycle(struct xfs_scan *scan, uint64_t blk,
+			uint32_t *cycle)
+{
+	uint8_t buf[512];
+
+	if (!xlog_read(scan, blk, buf, 1))
+		return FALSE;
+	*cycle = xlog_block_cycle(buf);
+	return TRUE;
+}
+
+/* Find the head of the log.  Blocks before it carry the current cycle
+   number and blocks after it the previous one; if the log wrapped
+   exactly, the head is at block 0 and everything carries the previous
+   cycle. */
+static const char *xlog_find_head(struct xfs_scan *scan)
+{
+	uint64_t n = scan->log_blocks;
+	uint64_t lo;
+	uint64_t hi;
+	uint64_t mid;
+	uint32_t first;
+	uint32_t last;
+	uint32_t cycle;
+	uint8_t *buf;
+	unsigned window;
+	unsigned i;
+	gboolean ok;
+
+	if (!xlog_cycle(scan, 0, &first) || !xlog_cycle(scan, n - 1, &last))
+		return "Couldn't read log";
+	if (first == 0)
+		return "Log is empty";
+	if (first == last) {
+		scan->log_head = 0;
+		scan->log_cycle = first + 1;
+	} else if (first == last + 1) {
+		lo = 0;
+		hi = n - 1;
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo) / 2;
+			if (!xlog_cycle(scan, mid, &cycle))
+				return "Couldn't read log";
+			if (cycle == first)
+				lo = mid;
+			else if (cycle == last)
+				hi = mid;
+			else
+				return "Couldn't find log head";
+		}
+		scan->log_head = hi;
+		scan->log_cycle = first;
+	} else {
+		return "Couldn't find log head";
+	}
+
+	/* Any block after the head from the current cycle would mean that
+	   writes were in flight when the log was last used */
+	window = MIN(XLOG_VERIFY_BLOCKS, n - scan->log_head);
+	buf = g_malloc(window * 512);
+	ok = xlog_read(scan, scan->log_head, buf, window);
+	for (i = 0; ok && i < window; i++)
+		if (xlog_block_cycle(buf + i * 512) != scan->log_cycle - 1)
+			ok = FALSE;
+	g_free(buf);
+	if (!ok)
+		return "Log is dirty; filesystem needs recovery";
+	return NULL;
+}
+
+/* Returns a problem description, or NULL if the log is clean. */
+static const char *xlog_check_clean(struct xfs_scan *scan)
+{
+	uint64_t n = scan->log_blocks;
+	uint8_t head[512];
+	uint8_t op[512];
+	const char *problem;
+	uint64_t blk;
+	uint32_t size;
+	unsigned hblks;
+	unsigned i;
+
+	problem = xlog_find_head(scan);
+	if (problem != NULL)
+		return problem;
+	for (i = 1; i <= MIN(XLOG_VERIFY_BLOCKS, n); i++) {
+		blk = (scan->log_head + n - i) % n;
+		if (!xlog_read(scan, blk, head, 1))
+			return "Couldn't read log";
+		if (get_be32(head) == XLOG_HEADER_MAGIC)
+			break;
+	}
+	if (get_be32(head) != XLOG_HEADER_MAGIC)
+		return "Couldn't find last log record";
+	/* Large v2 records have extra header blocks */
+	size = get_be32(head + 320);
+	hblks = 1;
+	if ((get_be32(head + 8) & XLOG_VERSION_2) &&
+				size > XLOG_HEADER_CYCLE_SIZE)
+		hblks = (size + XLOG_HEADER_CYCLE_SIZE - 1) /
+					XLOG_HEADER_CYCLE_SIZE;
+	if (!xlog_read(scan, (blk + hblks) % n, op, 1))
+		return "Couldn't read log";
+	/* One operation, flagged as an unmount.  The first word of the
+	   block holds the cycle number, but the flags are intact. */
+	if (get_be32(head + 40) != 1 || !(op[9] & XLOG_UNMOUNT_TRANS))
+		return "Log is dirty; filesystem needs recovery";
+	return NULL;
+}
+
+static gboolean xfs_read_block(struct xfs_scan *scan, uint32_t agno,
+			uint32_t agbno, uint8_t *buf)
+{
+	if (agbno >= scan->agblocks)
+		return FALSE;
+	return io_read_full(scan->fd, buf, scan->blocksize,
+				((uint64_t) agno * scan->agblocks + agbno) *
+				scan->blocksize);
+}
+
+static unsigned xfs_btree_header(struct xfs_scan *scan)
+{
+	return scan->crc ? 56 : 16;
+}
+
+/* Returns the number of records in a cntbt block, or -1 if the block
+   isn't one. */
+static int xfs_btree_check(struct xfs_scan *scan, const uint8_t *buf,
+			unsigned level)
+{
+	unsigned hdr = xfs_btree_header(scan);
+	unsigned maxrecs;
+	unsigned numrecs;
+
+	if (get_be32(buf) != (scan->crc ? XFS_ABTC_CRC_MAGIC :
+				XFS_ABTC_MAGIC) || get_be16(buf + 4) != level)
+		return -1;
+	/* Leaves hold (start, length) records; nodes hold keys of the same
+	   size, followed by 32-bit pointers */
+	maxrecs = (scan->blocksize - hdr) / (level ? 12 : 8);
+	numrecs = get_be16(buf + 6);
+	if (numrecs > maxrecs || (level && numrecs == 0))
+		return -1;
+	return numrecs;
+}
+
+static gboolean xfs_stop(struct xfs_worker *worker, uint64_t sectors)
+{
+	/* --dump and --trace want to see everything */
+	if (log_extents || trace_file != NULL)
+		return FALSE;
+	return sectors < min_extent_sectors ||
+				sectors < extent_set_threshold(worker->extents) ||
+				sectors < extent_set_threshold(
+				worker->scan->device->extents);
+}
+
+static gboolean xfs_scan_ag(struct xfs_worker *worker, uint32_t agno,
+			uint8_t *buf)
+{
+	struct xfs_scan *scan = worker->scan;
+	unsigned hdr = xfs_btree_header(scan);
+	const uint8_t *rec;
+	uint32_t length;
+	uint32_t blk;
+	uint32_t levels;
+	uint32_t start;
+	uint32_t count;
+	uint64_t steps;
+	unsigned level;
+	int numrecs;
+	int i;
+
+	/* The AGF is in the second sector of the AG */
+	if (!io_read_full(scan->fd, buf, scan->sectsize,
+				(uint64_t) agno * scan->agblocks *
+				scan->blocksize + scan->sectsize))
+		return FALSE;
+	if (get_be32(buf) != XFS_AGF_MAGIC || get_be32(buf + 8) != agno)
+		return FALSE;
+	length = get_be32(buf + 12);
+	blk = get_be32(buf + 20);
+	levels = get_be32(buf + 32);
+	if (length > scan->agblocks || levels == 0 ||
+				levels > XFS_BTREE_MAXLEVELS)
+		return FALSE;
+	worker->free_sectors += (uint64_t) get_be32(buf + 52) *
+				scan->unit_sectors;
+
+	/* Descend to the rightmost leaf */
+	for (level = levels - 1; level > 0; level--) {
+		if (!xfs_read_block(scan, agno, blk, buf))
+			return FALSE;
+		numrecs = xfs_btree_check(scan, buf, level);
+		if (numrecs <= 0)
+			return FALSE;
+		blk = get_be32(buf + hdr + (scan->blocksize - hdr) / 12 * 8 +
+					(numrecs - 1) * 4);
+	}
+
+	/* Walk the leaves leftward, from the largest extent down */
+	for (steps = 0; blk != XFS_NULL_AGBLOCK; steps++) {
+		if (steps > length || !xfs_read_block(scan, agno, blk, buf))
+			return FALSE;
+		numrecs = xfs_btree_check(scan, buf, 0);
+		if (numrecs < 0)
+			return FALSE;
+		for (i = numrecs - 1; i >= 0; i--) {
+			rec = buf + hdr + i * 8;
+			start = get_be32(rec);
+			count = get_be32(rec + 4);
+			if ((uint64_t) start + count > length)
+				return FALSE;
+			if (xfs_stop(worker, (uint64_t) count *
+						scan->unit_sectors))
+				return TRUE;
+			worker->free_extents++;
+			worker->align_loss_sectors += offer_extent(
+						worker->extents, scan->device,
+						((uint64_t) agno *
+						scan->agblocks + start) *
+						scan->unit_sectors,
+						(uint64_t) count *
+						scan->unit_sectors);
+		}
+		/* Left sibling */
+		blk = get_be32(buf + 8);
+	}
+	return TRUE;
+}
+
+static void *xfs_worker_run(void *_worker)
+{
+	struct xfs_worker *worker = _worker;
+	struct xfs_scan *scan = worker->scan;
+	uint8_t *buf;
+	gint agno;
+
+	buf = g_malloc(scan->blocksize);
+	while ((agno = g_atomic_int_add(&scan->next_ag, 1)) <
+				(gint) scan->agcount) {
+		if (!xfs_scan_ag(worker, agno, buf)) {
+			worker->failed = TRUE;
+			break;
+		}
+	}
+	g_free(buf);
+	return NULL;
+}
+
+/* Returns a problem description, or NULL. */
+static const char *xfs_open(struct xfs_scan *scan, struct device *device)
+{
+	const char *problem;
+
+	scan->device = device;
+	scan->fd = open(device->path, O_RDONLY);
+	if (scan->fd == -1)
+		return "Couldn't open device";
+	problem = xfs_read_super(scan);
+	if (problem == NULL)
+		problem = xlog_check_clean(scan);
+	if (problem != NULL) {
+		close(scan->fd);
+		scan->fd = -1;
+	}
+	return problem;
+}
+
+static void handle_xfs(struct device *device)
+{
+	struct xfs_scan scan = {0};
+	struct xfs_worker *workers;
+	const char *problem;
+	unsigned count;
+	unsigned n;
+
+	problem = xfs_open(&scan, device);
+	if (problem != NULL) {
+		reject(device, "%s", problem);
+		return;
+	}
+	count = fs_jobs ? fs_jobs : g_get_num_processors();
+	count = MAX(MIN(count, scan.agcount), 1);
+	workers = g_new0(struct xfs_worker, count);
+	for (n = 0; n < count; n++) {
+		workers[n].scan = &scan;
+		workers[n].extents = extent_set_new();
+		workers[n].thread = g_thread_new("xfs-scan", xfs_worker_run,
+					&workers[n]);
+	}
+	for (n = 0; n < count; n++) {
+		g_thread_join(workers[n].thread);
+		if (workers[n].failed)
+			reject(device, "Couldn't read free space btree");
+	}
+	for (n = 0; n < count; n++) {
+		if (device->problem == NULL) {
+			device->free_sectors += workers[n].free_sectors;
+			device->free_extents += workers[n].free_extents;
+			device->align_loss_sectors +=
+						workers[n].align_loss_sectors;
+			extent_set_merge(device->extents, workers[n].extents);
+		}
+		extent_set_free(workers[n].extents);
+	}
+	g_free(workers);
+	close(scan.fd);
+}
+
+/* Every mount which writes to the filesystem, and every clean unmount,
+   moves the head of the log. */
+static gboolean xfs_cache_key(struct device *device, gchar **ident,
+			gchar **state)
+{
+	struct xfs_scan scan = {0};
+
+	if (xfs_open(&scan, device) != NULL)
+		return FALSE;
+	close(scan.fd);
+	*ident = cache_hex(scan.uuid, sizeof(scan.uuid));
+	*state = g_strdup_printf("%u-%"PRIu64"-%"PRIu64, scan.log_cycle,
+				scan.log_head, scan.dblocks);
+	return TRUE;
+}
+
+/* vfat and exfat */
+
+/* FAT32 records free clusters as zero entries in the FAT itself, so we
+   stream the active FAT through the bitmap reader and pack each chunk
+   into an allocation bitmap, comparing eight entries at a time where
+   the CPU allows.  exFAT keeps a real allocation bitmap, which we read
+   through its cluster chain.  In both cases the bitmap scanner numbers
+   units by cluster, and cluster 2 is the first one in the data area. */
+
+#define FAT32_ENTRY_MASK 0x0fffffff
+#define FAT32_CLEAN_SHUTDOWN 0x08000000
+#define FAT32_NO_HARD_ERROR 0x04000000
+#define FAT32_MIN_CLUSTERS 65525
+#define FAT_FIRST_CLUSTER 2
+#define EXFAT_ACTIVE_FAT 0x1
+#define EXFAT_VOLUME_DIRTY 0x2
+#define EXFAT_MEDIA_FAILURE 0x4
+#define EXFAT_ENTRY_END 0x00
+#define EXFAT_ENTRY_BITMAP 0x81
+#define EXFAT_MAX_BITMAP_CLUSTERS (1 << 20)
+
+struct fat_volume {
+	struct device *device;
+	int fd;
+	uint64_t fat_offset;  /* bytes */
+	uint64_t heap_sect;  /* first sector of cluster 2 */
+	unsigned cluster_sectors;
+	uint32_t clusters;
+	/* exFAT allocation bitmap */
+	uint32_t *chain;
+	unsigned chain_len;
+};
+
+/* Set bit n of bitmap if FAT32 entry n is in use. */
+static void (*fat_pack)(const uint8_t *fat, size_t count, uint8_t *bitmap);
+
+static void fat_pack_scalar(const uint8_t *fat, size_t count, uint8_t *bitmap)
+{
+	size_t n;
+
+	memset(bitmap, 0, (count + 7) / 8);
+	for (n = 0; n < count; n++)
+		if (get_le32(fat + 4 * n) & FAT32_ENTRY_MASK)
+			bitmap[n / 8] |= 1 << (n % 8);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((target("sse2")))
+static void fat_pack_sse2(const uint8_t *fat, size_t count, uint8_t *bitmap)
+{
+	__m128i mask = _mm_set1_epi32(FAT32_ENTRY_MASK);
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo;
+	__m128i hi;
+	unsigned free;
+	size_t n;
+
+	for (n = 0; n + 8 <= count; n += 8) {
+		lo = _mm_loadu_si128((const __m128i *) (fat + 4 * n));
+		hi = _mm_loadu_si128((const __m128i *) (fat + 4 * n + 16));
+		lo = _mm_cmpeq_epi32(_mm_and_si128(lo, mask), zero);
+		hi = _mm_cmpeq_epi32(_mm_and_si128(hi, mask), zero);
+		free = _mm_movemask_ps(_mm_castsi128_ps(lo)) |
+					_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4;
+		bitmap[n / 8] = ~free;
+	}
+	fat_pack_scalar(fat + 4 * n, count - n, bitmap + n / 8);
+}
+
+__attribute__((target("avx2")))
+static void fat_pack_avx2(const uint8_t *fat, size_t count, uint8_t *bitmap)
+{
+	__m256i mask = _mm256_set1_epi32(FAT32_ENTRY_MASK);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i cur;
+	size_t n;
+
+	for (n = 0; n + 8 <= count; n += 8) {
+		cur = _mm256_loadu_si256((const __m256i *) (fat + 4 * n));
+		cur = _mm256_cmpeq_epi32(_mm256_and_si256(cur, mask), zero);
+		bitmap[n / 8] = ~_mm256_movemask_ps(_mm256_castsi256_ps(cur));
+	}
+	fat_pack_scalar(fat + 4 * n, count - n, bitmap + n / 8);
+}
+#endif
+
+static void fat_pack_select(void)
+{
+	fat_pack = fat_pack_scalar;
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fat_pack = fat_pack_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		fat_pack = fat_pack_sse2;
+#endif
+}
+
+static void fat_emit(void *_vol, uint64_t start_sect, uint64_t sect_count)
+{
+	struct fat_volume *vol = _vol;
+
+	add_extent(vol->device, vol->heap_sect + start_sect -
+				FAT_FIRST_CLUSTER * vol->cluster_sectors,
+				sect_count);
+}
+
+static gboolean fat_read(void *_vol, uint64_t offset, void *buf, size_t len)
+{
+	struct fat_volume *vol = _vol;
+
+	return io_read_full(vol->fd, buf, len, vol->fat_offset + offset);
+}
+
+static gboolean fat_next_cluster(struct fat_volume *vol, uint32_t cluster,
+			uint32_t *next)
+{
+	uint8_t entry[4];
+
+	if (!fat_read(vol, (uint64_t) cluster * 4, entry, sizeof(entry)))
+		return FALSE;
+	*next = get_le32(entry);
+	return TRUE;
+}
+
+static gboolean fat_valid_cluster(struct fat_volume *vol, uint32_t cluster)
+{
+	return cluster >= FAT_FIRST_CLUSTER &&
+				cluster - FAT_FIRST_CLUSTER < vol->clusters;
+}
+
+static uint64_t fat_cluster_offset(struct fat_volume *vol, uint32_t cluster)
+{
+	return (vol->heap_sect + (uint64_t) (cluster - FAT_FIRST_CLUSTER) *
+				vol->cluster_sectors) * 512;
+}
+
+static gboolean fat_open(struct fat_volume *vol, struct device *device,
+			uint8_t *bs)
+{
+	vol->device = device;
+	vol->fd = open(device->path, O_RDONLY);
+	if (vol->fd == -1) {
+		reject(device, "Couldn't open device");
+		return FALSE;
+	}
+	if (!io_read_full(vol->fd, bs, 512, 0)) {
+		reject(device, "Couldn't read boot sector");
+		close(vol->fd);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Feed the scanner with bitmap chunks from the reader.  Bit 0 of the
+   stream describes unit first.  Returns FALSE on a short read, having
+   added no extents. */
+static gboolean fat_scan_stream(struct fat_volume *vol,
+			struct bitmap_reader *reader, struct bitmap_scan *scan,
+			gboolean packed)
+{
+	struct bitmap_chunk *chunk;
+	struct extent_set *shared;
+	uint8_t *bitmap = NULL;
+	uint64_t first;
+	uint64_t units;
+	gboolean ok = TRUE;
+	gboolean done;
+
+	shared = device_extents_begin(vol->device);
+	if (packed)
+		bitmap = g_malloc(bitmap_chunk_bytes() / 32 + 1);
+	done = reader->len == 0;
+	while (!done) {
+		chunk = bitmap_reader_next(reader);
+		if (chunk->error) {
+			ok = FALSE;
+			bitmap_reader_release(reader, chunk);
+			break;
+		}
+		if (packed) {
+			/* One FAT entry per cluster, starting at 0 */
+			first = chunk->offset / 4;
+			units = chunk->len / 4;
+			fat_pack(chunk->data, units, bitmap);
+			/* Entries 0 and 1 aren't clusters */
+			if (first == 0)
+				bitmap[0] |= 0x3;
+		} else {
+			/* One bit per cluster, starting at cluster 2 */
+			first = chunk->offset * 8 + FAT_FIRST_CLUSTER;
+			units = MIN(chunk->len * 8, vol->clusters -
+						chunk->offset * 8);
+		}
+		bitmap_scan_feed(scan, packed ? bitmap : chunk->data, first,
+					units);
+		done = chunk->offset + chunk->len >= reader->len;
+		bitmap_reader_release(reader, chunk);
+	}
+	bitmap_reader_finish(reader);
+	g_free(bitmap);
+	if (ok)
+		bitmap_scan_finish(scan, (uint64_t) vol->clusters +
+					FAT_FIRST_CLUSTER);
+	device_extents_commit(vol->device, shared, ok);
+	return ok;
+}
+
+static void handle_vfat(struct device *device)
+{
+	struct fat_volume vol = {0};
+	struct bitmap_reader reader;
+	struct bitmap_scan scan;
+	uint8_t bs[512];
+	uint32_t bps;
+	uint32_t spc;
+	uint32_t reserved;
+	uint32_t nfats;
+	uint32_t total;
+	uint32_t fat_size;
+	uint32_t data_start;
+	uint32_t active;
+	uint32_t flags;
+
+	if (!fat_open(&vol, device, bs))
+		return;
+	bps = get_le16(bs + 11);
+	spc = bs[13];
+	reserved = get_le16(bs + 14);
+	nfats = bs[16];
+	total = get_le16(bs + 19) ? get_le16(bs + 19) : get_le32(bs + 32);
+	fat_size = get_le32(bs + 36);
+	if (bs[510] != 0x55 || bs[511] != 0xaa || bps < 512 || bps > 4096 ||
+				(bps & (bps - 1)) || spc == 0 ||
+				(spc & (spc - 1)) || reserved == 0 ||
+				nfats == 0) {
+		reject(device, "Bad boot sector");
+		goto out;
+	}
+	/* FAT12 and FAT16 have a fixed root directory and a 16-bit FAT
+	   size */
+	if (get_le16(bs + 17) != 0 || get_le16(bs + 22) != 0 ||
+				fat_size == 0) {
+		reject(device, "Only FAT32 is supported");
+		goto out;
+	}
+	data_start = reserved + nfats * fat_size;
+	if (total <= data_start) {
+		reject(device, "Bad boot sector");
+		goto out;
+	}
+	vol.clusters = (total - data_start) / spc;
+	if (vol.clusters < FAT32_MIN_CLUSTERS) {
+		reject(device, "Only FAT32 is supported");
+		goto out;
+	}
+	if (((uint64_t) vol.clusters + FAT_FIRST_CLUSTER) * 4 >
+				(uint64_t) fat_size * bps) {
+		reject(device, "FAT too small for volume");
+		goto out;
+	}
+	if ((uint64_t) total * (bps / 512) > device->sectors) {
+		reject(device, "Filesystem larger than device");
+		goto out;
+	}
+	/* Bit 7 of the extended flags disables mirroring, leaving only the
+	   FAT in the low bits active */
+	flags = get_le16(bs + 40);
+	active = (flags & 0x80) ? (flags & 0xf) : 0;
+	if (active >= nfats) {
+		reject(device, "Bad boot sector");
+		goto out;
+	}
+	vol.fat_offset = ((uint64_t) reserved + active * fat_size) * bps;
+	vol.heap_sect = (uint64_t) data_start * (bps / 512);
+	vol.cluster_sectors = spc * (bps / 512);
+
+	/* The dirty flags are in FAT entry 1 and, for Windows, the boot
+	   sector */
+	if (!fat_next_cluster(&vol, 1, &flags)) {
+		reject(device, "Couldn't read FAT");
+		goto out;
+	}
+	if (!(flags & FAT32_CLEAN_SHUTDOWN) || (bs[65] & 0x1)) {
+		reject(device, "Filesystem needs checking");
+		goto out;
+	}
+	if (!(flags & FAT32_NO_HARD_ERROR)) {
+		reject(device, "Filesystem has errors");
+		goto out;
+	}
+
+	bitmap_scan_init(&scan, vol.cluster_sectors, fat_emit, &vol);
+	bitmap_reader_start(&reader, fat_read, &vol,
+				((uint64_t) vol.clusters + FAT_FIRST_CLUSTER) *
+				4);
+	if (!fat_scan_stream(&vol, &reader, &scan, TRUE))
+		reject(device, "Short read for FAT");
+out:
+	close(vol.fd);
+}
+
+static gboolean exfat_read_bitmap(void *_vol, uint64_t offset, void *buf,
+			size_t len)
+{
+	struct fat_volume *vol = _vol;
+	uint64_t cluster_bytes = (uint64_t) vol->cluster_sectors * 512;
+	uint64_t idx;
+	uint64_t within;
+	size_t count;
+
+	while (len) {
+		idx = offset / cluster_bytes;
+		within = offset % cluster_bytes;
+		if (idx >= vol->chain_len)
+			return FALSE;
+		count = MIN(len, cluster_bytes - within);
+		if (!io_read_full(vol->fd, buf, count,
+					fat_cluster_offset(vol,
+					vol->chain[idx]) + within))
+			return FALSE;
+		buf = (uint8_t *) buf + count;
+		offset += count;
+		len -= count;
+	}
+	return TRUE;
+}
+
+/* Find the allocation bitmap for the active FAT in the root directory.
+   Returns its first cluster, or 0. */
+static uint32_t exfat_find_bitmap(struct fat_volume *vol, uint32_t root,
+			unsigned active, unsigned nfats)
+{
+	uint64_t cluster_bytes = (uint64_t) vol->cluster_sectors * 512;
+	uint32_t cluster = root;
+	uint32_t found = 0;
+	uint8_t *buf;
+	uint8_t *entry;
+	unsigned steps;
+	size_t n;
+
+	buf = g_malloc(cluster_bytes);
+	for (steps = 0; steps < vol->clusters &&
+				fat_valid_cluster(vol, cluster); steps++) {
+		if (!io_read_full(vol->fd, buf, cluster_bytes,
+					fat_cluster_offset(vol, cluster)))
+			break;
+		for (n = 0; n < cluster_bytes; n += 32) {
+			entry = buf + n;
+			if (entry[0] == EXFAT_ENTRY_END)
+				goto out;
+			/* Bit 0 of the flags selects the FAT, if there are
+			   two */
+			if (entry[0] == EXFAT_ENTRY_BITMAP &&
+						(nfats == 1 ||
+						(entry[1] & 0x1) == active)) {
+				found = get_le32(entry + 20);
+				if (get_le64(entry + 24) <
+						((uint64_t) vol->clusters + 7) /
+						8)
+					found = 0;
+				goto out;
+			}
+		}
+		if (!fat_next_cluster(vol, cluster, &cluster))
+			break;
+	}
+out:
+	g_free(buf);
+	return found;
+}
+
+static void handle_exfat(struct device *device)
+{
+	struct fat_volume vol = {0};
+	struct bitmap_reader reader;
+	struct bitmap_scan scan;
+	uint8_t bs[512];
+	unsigned sect_shift;
+	unsigned cluster_shift;
+	unsigned nfats;
+	unsigned flags;
+	uint64_t bitmap_len;
+	uint32_t cluster;
+	unsigned n;
+
+	if (!fat_open(&vol, device, bs))
+		return;
+	sect_shift = bs[108];
+	cluster_shift = bs[109];
+	nfats = bs[110];
+	flags = get_le16(bs + 106);
+	if (memcmp(bs + 3, "EXFAT   ", 8) || sect_shift < 9 ||
+				sect_shift > 12 || sect_shift + cluster_shift > 25 ||
+				nfats < 1 || nfats > 2) {
+		reject(device, "Bad boot sector");
+		goto out;
+	}
+	if (flags & EXFAT_VOLUME_DIRTY) {
+		reject(device, "Filesystem needs checking");
+		goto out;
+	}
+	if (flags & EXFAT_MEDIA_FAILURE) {
+		reject(device, "Filesystem has errors");
+		goto out;
+	}
+	if (get_le64(bs + 72) << (sect_shift - 9) > device->sectors) {
+		reject(device, "Filesystem larger than device");
+		goto out;
+	}
+	vol.clusters = get_le32(bs + 92);
+	vol.heap_sect = (uint64_t) get_le32(bs + 88) << (sect_shift - 9);
+	vol.cluster_sectors = 1 << (sect_shift + cluster_shift - 9);
+	vol.fat_offset = ((uint64_t) get_le32(bs + 80) +
+				(nfats == 2 && (flags & EXFAT_ACTIVE_FAT) ?
+				get_le32(bs + 84) : 0)) << sect_shift;
+	if (((uint64_t) vol.clusters + FAT_FIRST_CLUSTER) * 4 >
+				(uint64_t) get_le32(bs + 84) << sect_shift ||
+				vol.heap_sect + (uint64_t) vol.clusters *
+				vol.cluster_sectors > device->sectors) {
+		reject(device, "Bad boot sector");
+		goto out;
+	}
+
+	cluster = exfat_find_bitmap(&vol, get_le32(bs + 96),
+				flags & EXFAT_ACTIVE_FAT, nfats);
+	if (cluster == 0) {
+		reject(device, "Couldn't find allocation bitmap");
+		goto out;
+	}
+	bitmap_len = ((uint64_t) vol.clusters + 7) / 8;
+	vol.chain_len = (bitmap_len + (uint64_t) vol.cluster_sectors * 512 -
+				1) / ((uint64_t) vol.cluster_sectors * 512);
+	if (vol.chain_len > EXFAT_MAX_BITMAP_CLUSTERS) {
+		reject(device, "Allocation bitmap too large");
+		goto out;
+	}
+	vol.chain = g_new(uint32_t, vol.chain_len);
+	for (n = 0; n < vol.chain_len; n++) {
+		if (!fat_valid_cluster(&vol, cluster)) {
+			reject(device, "Bad allocation bitmap chain");
+			goto out;
+		}
+		vol.chain[n] = cluster;
+		if (n + 1 < vol.chain_len &&
+					!fat_next_cluster(&vol, cluster, &cluster)) {
+			reject(device, "Couldn't read FAT");
+			goto out;
+		}
+	}
+
+	bitmap_scan_init(&scan, vol.cluster_sectors, fat_emit, &vol);
+	bitmap_reader_start(&reader, exfat_read_bitmap, &vol, bitmap_len);
+	if (!fat_scan_stream(&vol, &reader, &scan, FALSE))
+		reject(device, "Short read for allocation bitmap");
+out:
+	g_free(vol.chain);
+	close(vol.fd);
+}
+
+/* partition tables and blank disks */
+
+/* Space outside the partitions of a whole disk is collected from the
+   disk itself.  The partition list is the union of what libblkid finds
+   in the table and what the kernel is using, so that a partition known
+   to only one of them is never handed out. */
+
+#define PTABLE_RESERVED_SECTORS 2048  /* boot loaders live below 1 MB */
+#define PTABLE_DOS_LDM_TYPE 0x42
+#define GPT_HEADER_SIGNATURE "EFI PART"
+#define BLANK_CHECK_BYTES (1 << 20)
+
+static int sector_range_compare(const void *_a, const void *_b)
+{
+	const struct sector_range *a = _a;
+	const struct sector_range *b = _b;
+
+	if (a->start != b->start)
+		return a->start < b->start ? -1 : 1;
+	return 0;
+}
+
+/* Get the part of a GPT disk which may hold partitions, outside of the
+   partition entry arrays */
+static gboolean gpt_usable_range(struct device *device, unsigned sector_size,
+			struct sector_range *range)
+{
+	uint8_t *buf;
+	gboolean ret = FALSE;
+	int fd;
+
+	fd = open(device->path, O_RDONLY);
+	if (fd == -1)
+		return FALSE;
+	buf = g_malloc(sector_size);
+	if (io_read_full(fd, buf, sector_size, sector_size) &&
+				!memcmp(buf, GPT_HEADER_SIGNATURE, 8)) {
+		range->start = get_le64(buf + 40) * (sector_size / 512);
+		range->end = (get_le64(buf + 48) + 1) * (sector_size / 512);
+		ret = range->start < range->end;
+	}
+	g_free(buf);
+	close(fd);
+	return ret;
+}
+
+/* Add the parts of usable which no partition covers.  Partitions may
+   be listed twice and may overlap. */
+static void ptable_add_gaps(struct device *device, GArray *ranges,
+			struct sector_range usable)
+{
+	struct sector_range *cur;
+	unsigned n;
+
+	g_array_sort(ranges, sector_range_compare);
+	for (n = 0; n < ranges->len && usable.start < usable.end; n++) {
+		cur = &g_array_index(ranges, struct sector_range, n);
+		if (cur->start > usable.start)
+			add_extent(device, usable.start, MIN(cur->start,
+						usable.end) - usable.start);
+		usable.start = MAX(usable.start, cur->end);
+	}
+	if (usable.start < usable.end)
+		add_extent(device, usable.start, usable.end - usable.start);
+}
+
+static void handle_ptable(struct device *device)
+{
+	struct sector_range usable = {PTABLE_RESERVED_SECTORS,
+				device->sectors};
+	struct sector_range range;
+	blkid_probe pr;
+	blkid_partlist ls;
+	blkid_parttable tab;
+	blkid_partition part;
+	GArray *ranges;
+	char *dir;
+	int count;
+	int n;
+
+	ranges = g_array_new(FALSE, FALSE, sizeof(struct sector_range));
+	pr = blkid_new_probe_from_filename(device->path);
+	if (pr == NULL) {
+		reject(device, "Couldn't open device");
+		goto out;
+	}
+	ls = blkid_probe_get_partitions(pr);
+	tab = ls ? blkid_partlist_get_table(ls) : NULL;
+	count = ls ? blkid_partlist_numof_partitions(ls) : -1;
+	if (tab == NULL || count < 0) {
+		reject(device, "Couldn't read partition table");
+		goto out;
+	}
+	if (strcmp(blkid_parttable_get_type(tab), device->fstype)) {
+		reject(device, "Partition table changed while scanning");
+		goto out;
+	}
+	if (!strcmp(device->fstype, "gpt")) {
+		if (!gpt_usable_range(device, blkid_probe_get_sectorsize(pr),
+					&range)) {
+			reject(device, "Couldn't read GPT header");
+			goto out;
+		}
+		usable.start = MAX(usable.start, range.start);
+		usable.end = MIN(usable.end, range.end);
+	}
+	for (n = 0; n < count; n++) {
+		part = blkid_partlist_get_partition(ls, n);
+		/* Windows keeps its dynamic disk database after the last
+		   partition */
+		if (!strcmp(device->fstype, "dos") &&
+					blkid_partition_get_type(part) ==
+					PTABLE_DOS_LDM_TYPE) {
+			reject(device, "Disk has Windows dynamic volumes");
+			goto out;
+		}
+		range.start = blkid_partition_get_start(part);
+		range.end = range.start + blkid_partition_get_size(part);
+		g_array_append_val(ranges, range);
+	}
+	dir = sysfs_device_dir(device->path);
+	if (dir == NULL || !sysfs_partitions(dir, ranges)) {
+		reject(device, "Couldn't list partitions");
+		free(dir);
+		goto out;
+	}
+	free(dir);
+	ptable_add_gaps(device, ranges, usable);
+out:
+	if (pr != NULL)
+		blkid_free_probe(pr);
+	g_array_free(ranges, TRUE);
+}
+
+/* blkid found nothing on the disk.  Make sure that the kernel hasn't
+   found partitions on it either, and that both ends of it are zeroed,
+   before using all of it. */
+static void handle_blank(struct device *device)
+{
+	GArray *ranges;
+	uint8_t *buf = NULL;
+	size_t len;
+	char *dir;
+	int fd = -1;
+
+	ranges = g_array_new(FALSE, FALSE, sizeof(struct sector_range));
+	dir = sysfs_device_dir(device->path);
+	if (dir == NULL || !sysfs_partitions(dir, ranges)) {
+		reject(device, "Couldn't list partitions");
+		goto out;
+	}
+	if (ranges->len) {
+		reject(device, "Disk has partitions");
+		goto out;
+	}
+	fd = open(device->path, O_RDONLY);
+	if (fd == -1) {
+		reject(device, "Couldn't open device");
+		goto out;
+	}
+	len = MIN(BLANK_CHECK_BYTES, device->sectors * 512);
+	buf = g_malloc(len);
+	if (!io_read_full(fd, buf, len, 0) ||
+				bitmap_skip(buf, len, 0) != len ||
+				!io_read_full(fd, buf, len,
+				device->sectors * 512 - len) ||
+				bitmap_skip(buf, len, 0) != len) {
+		reject(device, "Disk contains unrecognized data");
+		goto out;
+	}
+	add_extent(device, 0, device->sectors);
+out:
+	if (fd != -1)
+		close(fd);
+	g_free(buf);
+	free(dir);
+	g_array_free(ranges, TRUE);
+}
+
+/* LVM */
+
+/* Free extents in a volume group which isn't in use.  (If it were, its
+   PVs would have failed the busy check.)  The PV label leads to a
+   metadata area holding the VG's text metadata, which lists the PV
+   extents under every LV segment.  Any segment area which names this PV
+   marks extents in use; everything else from pe_start to the end of the
+   last extent is free.  A PV in no VG is free from the start of its data
+   area to the end of the device. */
+
+#define LVM_LABEL_SCAN_SECTORS 4
+#define LVM_LABEL_ID "LABELONE"
+#define LVM_LABEL_TYPE "LVM2 001"
+#define LVM_ID_LEN 32
+#define LVM_MDA_HEADER_SIZE 512
+#define LVM_MDA_MAGIC "\040\114\126\115\062\040\170\133\065\101\045\162\060\116\052\076"
+#define LVM_MDA_VERSION 1
+#define LVM_INITIAL_CRC 0xf597a6cf
+#define LVM_RAW_LOCN_IGNORED 0x1
+#define LVM_MAX_METADATA (64 << 20)
+#define LVM_MAX_EXTENTS (1 << 28)
+#define LVM_PARSE_DEPTH 16
+
+struct lvm_pv {
+	struct device *device;
+	int fd;
+	char uuid[LVM_ID_LEN];
+	uint64_t data_start;  /* sectors */
+	uint64_t data_end;
+	GArray *mdas;  /* struct sector_range, in bytes */
+	gchar *metadata;  /* NULL if the PV is in no VG */
+	size_t metadata_len;
+};
+
+/* A section has children; a setting has values, with strings unquoted
+   and numbers as text. */
+struct lvm_node {
+	gchar *name;
+	GPtrArray *children;
+	GPtrArray *values;
+};
+
+struct lvm_parser {
+	const char *p;
+	const char *end;
+};
+
+struct lvm_data {
+	struct device *device;
+	uint64_t pe_start;
+};
+
+/* CRC-32 without the final inversion, as LVM uses it */
+static uint32_t lvm_crc(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	unsigned bit;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return crc;
+}
+
+static const char *lvm_read_label(struct lvm_pv *pv)
 {
-	struct device *device = _device;
+	uint8_t buf[LVM_LABEL_SCAN_SECTORS * 512];
+	struct sector_range area;
+	uint8_t *label;
+	uint8_t *locn;
+	uint32_t offset;
+	unsigned sector;
+	gboolean data = TRUE;
 
-	g_free(device->path);
-	g_free(device->fstype);
-	g_slice_free(struct device, device);
+	if (!io_read_full(pv->fd, buf, sizeof(buf), 0))
+		return "Couldn't read PV label";
+	for (sector = 0; sector < LVM_LABEL_SCAN_SECTORS; sector++) {
+		label = buf + sector * 512;
+		if (!memcmp(label, LVM_LABEL_ID, 8) &&
+					get_le64(label + 8) == sector)
+			break;
+	}
+	if (sector == LVM_LABEL_SCAN_SECTORS)
+		return "Couldn't find PV label";
+	offset = get_le32(label + 20);
+	if (get_le32(label + 16) != lvm_crc(LVM_INITIAL_CRC, label + 20,
+				512 - 20) || memcmp(label + 24, LVM_LABEL_TYPE,
+				8) || offset < 32 || offset > 512 - 56)
+		return "Bad PV label";
+	memcpy(pv->uuid, label + offset, LVM_ID_LEN);
+
+	/* Data areas, then metadata areas, each list ending with a zero
+	   offset */
+	for (locn = label + offset + 40; locn + 16 <= label + 512;
+				locn += 16) {
+		area.start = get_le64(locn);
+		area.end = area.start + get_le64(locn + 8);
+		if (area.start == 0) {
+			if (!data)
+				return pv->data_start ? NULL :
+							"Bad PV label";
+			data = FALSE;
+		} else if (data) {
+			/* Zero size means to the end of the device */
+			pv->data_start = area.start / 512;
+			pv->data_end = area.end > area.start ? area.end / 512 :
+						pv->device->sectors;
+		} else {
+			g_array_append_val(pv->mdas, area);
+		}
+	}
+	return "Bad PV label";
 }
 
-static int compare_device_names(const void *a, const void *b, void *data)
+static gboolean lvm_read_metadata(struct lvm_pv *pv,
+			const struct sector_range *mda, const uint8_t *hdr)
 {
-	(void) data;
-	return strcmp(a, b);
+	uint64_t mda_size = mda->end - mda->start;
+	uint64_t offset = get_le64(hdr + 40);
+	uint64_t len = get_le64(hdr + 48);
+	uint64_t first;
+
+	if (len == 0 || len > LVM_MAX_METADATA || offset < LVM_MDA_HEADER_SIZE ||
+				offset >= mda_size ||
+				len > mda_size - LVM_MDA_HEADER_SIZE)
+		return FALSE;
+	pv->metadata = g_malloc(len + 1);
+	pv->metadata_len = len;
+	/* The area is a ring buffer following the header */
+	first = MIN(len, mda_size - offset);
+	if (!io_read_full(pv->fd, pv->metadata, first, mda->start + offset) ||
+				!io_read_full(pv->fd, pv->metadata + first,
+				len - first, mda->start + LVM_MDA_HEADER_SIZE) ||
+				lvm_crc(LVM_INITIAL_CRC,
+				(uint8_t *) pv->metadata, len) !=
+				get_le32(hdr + 56)) {
+		g_free(pv->metadata);
+		pv->metadata = NULL;
+		return FALSE;
+	}
+	pv->metadata[len] = 0;
+	return TRUE;
 }
 
-static GTree *device_tree_new(void)
+/* Read the VG metadata from the first metadata area which has a valid
+   copy */
+static const char *lvm_read_mdas(struct lvm_pv *pv)
 {
-	return g_tree_new_full(compare_device_names, NULL, NULL, device_free);
+	uint8_t hdr[LVM_MDA_HEADER_SIZE];
+	struct sector_range *mda;
+	unsigned n;
+
+	for (n = 0; n < pv->mdas->len; n++) {
+		mda = &g_array_index(pv->mdas, struct sector_range, n);
+		if (!io_read_full(pv->fd, hdr, sizeof(hdr), mda->start) ||
+					get_le32(hdr) != lvm_crc(LVM_INITIAL_CRC,
+					hdr + 4, sizeof(hdr) - 4) ||
+					memcmp(hdr + 4, LVM_MDA_MAGIC, 16) ||
+					get_le32(hdr + 20) != LVM_MDA_VERSION ||
+					get_le64(hdr + 24) != mda->start ||
+					get_le64(hdr + 32) !=
+					mda->end - mda->start)
+			continue;
+		if (get_le32(hdr + 60) & LVM_RAW_LOCN_IGNORED)
+			continue;
+		/* An empty area means the PV isn't in a VG */
+		if (get_le64(hdr + 40) == 0 && get_le64(hdr + 48) == 0)
+			return NULL;
+		if (lvm_read_metadata(pv, mda, hdr))
+			return NULL;
+	}
+	return "No usable LVM metadata area";
 }
 
-static const char *blkid_dev_get_value(blkid_dev dev, const char *tag)
+static void lvm_node_free(void *_node)
 {
-	blkid_tag_iterate iter;
-	const char *cur_tag;
-	const char *value;
-	const char *ret = NULL;
+	struct lvm_node *node = _node;
+
+	g_free(node->name);
+	if (node->children != NULL)
+		g_ptr_array_free(node->children, TRUE);
+	if (node->values != NULL)
+		g_ptr_array_free(node->values, TRUE);
+	g_slice_free(struct lvm_node, node);
+}
 
-	iter = blkid_tag_iterate_begin(dev);
-	while (!blkid_tag_next(iter, &cur_tag, &value)) {
-		if (!strcmp(cur_tag, tag)) {
-			ret = value;
+static void lvm_skip(struct lvm_parser *parser)
+{
+	while (parser->p < parser->end) {
+		if (*parser->p == '#') {
+			while (parser->p < parser->end && *parser->p != '\n')
+				parser->p++;
+		} else if (g_ascii_isspace(*parser->p)) {
+			parser->p++;
+		} else {
 			break;
 		}
 	}
-	blkid_tag_iterate_end(iter);
-	return ret;
 }
 
-static void add_all_devices(blkid_cache cache, GTree *devices)
+static gchar *lvm_token(struct lvm_parser *parser)
 {
-	blkid_dev_iterate iter;
-	blkid_dev dev;
-	const char *path;
-	const char *fstype;
+	const char *start = parser->p;
 
-	if (blkid_probe_all(cache))
-		die("Couldn't probe devices");
-	iter = blkid_dev_iterate_begin(cache);
-	while (!blkid_dev_next(iter, &dev)) {
-		path = blkid_dev_devname(dev);
-		fstype = blkid_dev_get_value(dev, "TYPE");
-		if (fstype != NULL)
-			device_tree_insert(devices, path, fstype);
-	}
-	blkid_dev_iterate_end(iter);
+	while (parser->p < parser->end && (g_ascii_isalnum(*parser->p) ||
+				strchr("_.+-", *parser->p) != NULL))
+		parser->p++;
+	if (parser->p == start)
+		return NULL;
+	return g_strndup(start, parser->p - start);
 }
 
-static void add_device(blkid_cache cache, GTree *devices, const char *path)
+static gboolean lvm_value(struct lvm_parser *parser, GPtrArray *values)
 {
-	blkid_dev dev;
-	const char *fstype;
+	GString *str;
+	gchar *token;
 
-	dev = blkid_get_dev(cache, path, BLKID_DEV_NORMAL);
-	if (dev == NULL) {
-		_reject(path, NULL, 0, "Couldn't probe device");
-		return;
+	if (parser->p == parser->end || *parser->p != '"') {
+		token = lvm_token(parser);
+		if (token == NULL)
+			return FALSE;
+		g_ptr_array_add(values, token);
+		return TRUE;
 	}
-	fstype = blkid_dev_get_value(dev, "TYPE");
-	if (fstype == NULL) {
-		_reject(path, NULL, 0, "Couldn't determine filesystem type");
-		return;
+	str = g_string_new("");
+	for (parser->p++; parser->p < parser->end && *parser->p != '"';
+				parser->p++) {
+		if (*parser->p == '\\' && parser->p + 1 < parser->end)
+			parser->p++;
+		g_string_append_c(str, *parser->p);
 	}
-	device_tree_insert(devices, path, fstype);
+	if (parser->p == parser->end) {
+		g_string_free(str, TRUE);
+		return FALSE;
+	}
+	parser->p++;
+	g_ptr_array_add(values, g_string_free(str, FALSE));
+	return TRUE;
 }
 
-/* dm helpers */
-
-struct extent {
-	struct device *device;
-	uint64_t start_sect;
-	uint64_t sect_count;
-};
-
-static gboolean dm_device_exists(const char *name)
+static gboolean lvm_parse_section(struct lvm_parser *parser,
+			struct lvm_node *section, unsigned depth)
 {
-	struct dm_task *dmt;
-	struct dm_info info;
+	struct lvm_node *node;
+	gchar *name;
 
-	dmt = dm_task_create(DM_DEVICE_INFO);
-	if (dmt == NULL)
-		die("Couldn't create DM task");
-	if (!dm_task_set_name(dmt, name))
-		die("Couldn't configure device name");
-	if (!dm_task_run(dmt))
-		die("Couldn't query device");
-	if (!dm_task_get_info(dmt, &info))
-		die("Couldn't get device info");
-	dm_task_destroy(dmt);
-	return info.exists;
+	for (;;) {
+		lvm_skip(parser);
+		if (parser->p == parser->end || *parser->p == '}')
+			return TRUE;
+		name = lvm_token(parser);
+		if (name == NULL)
+			return FALSE;
+		node = g_slice_new0(struct lvm_node);
+		node->name = name;
+		g_ptr_array_add(section->children, node);
+		lvm_skip(parser);
+		if (parser->p == parser->end)
+			return FALSE;
+		if (*parser->p == '{') {
+			parser->p++;
+			node->children = g_ptr_array_new_with_free_func(
+						lvm_node_free);
+			if (depth == LVM_PARSE_DEPTH ||
+						!lvm_parse_section(parser, node,
+						depth + 1) ||
+						parser->p == parser->end)
+				return FALSE;
+			parser->p++;
+		} else if (*parser->p == '=') {
+			parser->p++;
+			lvm_skip(parser);
+			node->values = g_ptr_array_new_with_free_func(g_free);
+			if (parser->p == parser->end || *parser->p != '[') {
+				if (!lvm_value(parser, node->values))
+					return FALSE;
+				continue;
+			}
+			for (parser->p++; ; ) {
+				lvm_skip(parser);
+				if (parser->p < parser->end &&
+							*parser->p == ']')
+					break;
+				if (!lvm_value(parser, node->values))
+					return FALSE;
+				lvm_skip(parser);
+				if (parser->p < parser->end &&
+							*parser->p == ',')
+					parser->p++;
+			}
+			parser->p++;
+		} else {
+			return FALSE;
+		}
+	}
 }
 
-static void dm_add_extent(struct dm_task *task, struct extent *extent,
-			uint64_t offset)
+static struct lvm_node *lvm_parse(const char *text, size_t len)
 {
-	gchar *args;
+	struct lvm_parser parser = {text, text + strnlen(text, len)};
+	struct lvm_node *root;
 
-	args = g_strdup_printf("%s %"PRIu64, extent->device->path,
-				extent->start_sect);
-	if (!dm_task_add_target(task, offset, extent->sect_count, "linear",
-				args))
-		die("Couldn't add %"PRIu64" sectors of %s at %"PRIu64
-					" to map", extent->sect_count,
-					extent->device->path,
-					extent->start_sect);
-	g_free(args);
+	root = g_slice_new0(struct lvm_node);
+	root->children = g_ptr_array_new_with_free_func(lvm_node_free);
+	if (!lvm_parse_section(&parser, root, 0) ||
+				parser.p != parser.end) {
+		lvm_node_free(root);
+		return NULL;
+	}
+	return root;
 }
 
-/* Extent list */
-
-/* The length of the DM table needs to be bounded, since it's just a
-   vmalloc'd array in kernel memory, and vmalloc space is generally
-   limited to 128 MiB.  We want the table to contain the largest
-   available extents, sorted by device and sector number.  (We don't
-   want to interleave extents from different devices because they may
-   be different partitions on the same physical disk.)
-
-   Algorithm:
-
-   1. Allocate an array of length max_extent_count.
-   2. Insert extents into the array in sequential order until the array
-      fills up.
-   3. If this occurs, convert the array to a binary min-heap based on the
-      length of each extent.  Continue inserting extents, but only if they
-      are larger than the smallest extent.  Before inserting a new extent,
-      remove the smallest extent.
-   4. Sort the array by device and sector number and add its entries to a
-      DM table.
- */
+static struct lvm_node *lvm_child(struct lvm_node *node, unsigned n)
+{
+	return g_ptr_array_index(node->children, n);
+}
 
-static void extent_swap(struct extent *a, struct extent *b)
+static struct lvm_node *lvm_find(struct lvm_node *node, const char *name)
 {
-	struct extent tmp;
+	unsigned n;
 
-	tmp = *a;
-	*a = *b;
-	*b = tmp;
+	if (node == NULL || node->children == NULL)
+		return NULL;
+	for (n = 0; n < node->children->len; n++)
+		if (!strcmp(lvm_child(node, n)->name, name))
+			return lvm_child(node, n);
+	return NULL;
 }
 
-static void extent_sift_down(unsigned node)
+static const char *lvm_string(struct lvm_node *node, const char *name)
 {
-	unsigned left = 2 * node + 1;
-	unsigned right = 2 * node + 2;
-	uint64_t min = extents[node].sect_count;
-	unsigned min_node = node;
+	struct lvm_node *setting = lvm_find(node, name);
 
-	if (left < used_extents && extents[left].sect_count < min) {
-		min = extents[left].sect_count;
-		min_node = left;
-	}
-	if (right < used_extents && extents[right].sect_count < min) {
-		min = extents[right].sect_count;
-		min_node = right;
-	}
-	if (min_node != node) {
-		extent_swap(&extents[min_node], &extents[node]);
-		extent_sift_down(min_node);
-	}
+	if (setting == NULL || setting->values == NULL ||
+				setting->values->len != 1)
+		return NULL;
+	return g_ptr_array_index(setting->values, 0);
 }
 
-static void extent_make_heap(void)
+static gboolean lvm_parse_u64(const char *str, uint64_t *val)
 {
-	int node;
+	gchar *end;
 
-	for (node = (int) (used_extents / 2) - 1; node >= 0; node--)
-		extent_sift_down(node);
+	if (str == NULL || !g_ascii_isdigit(*str))
+		return FALSE;
+	*val = g_ascii_strtoull(str, &end, 10);
+	return *end == 0;
 }
 
-static void add_extent(struct device *device, uint64_t start_sect,
-			uint64_t sect_count)
+static gboolean lvm_u64(struct lvm_node *node, const char *name,
+			uint64_t *val)
 {
-	struct extent new = {
-		.device = device,
-		.start_sect = start_sect,
-		.sect_count = sect_count
-	};
-
-	if (log_extents)
-		printf("%s %"PRIu64" %"PRIu64"\n", device->path, start_sect,
-					sect_count);
-	device->free_extents++;
-	device->free_sectors += sect_count;
-	if (sect_count < min_extent_sectors)
-		return;
-	if (used_extents < max_extent_count) {
-		extents[used_extents] = new;
-		if (++used_extents == max_extent_count)
-			extent_make_heap();
-	} else {
-		if (extents[0].sect_count >= sect_count)
-			return;
-		extents[0].device->accepted_extents--;
-		extents[0].device->accepted_sectors -= extents[0].sect_count;
-		extents[0] = new;
-		extent_sift_down(0);
-	}
-	device->accepted_extents++;
-	device->accepted_sectors += sect_count;
+	return lvm_parse_u64(lvm_string(node, name), val);
 }
 
-static int extent_compare_offsets(const void *_a, const void *_b)
+/* Find the VG's section for this PV */
+static struct lvm_node *lvm_find_pv(struct lvm_pv *pv, struct lvm_node *vg)
 {
-	const struct extent *a = _a;
-	const struct extent *b = _b;
+	struct lvm_node *pvs = lvm_find(vg, "physical_volumes");
+	struct lvm_node *node;
+	const char *id;
+	unsigned n;
+	unsigned len;
 
-	if (a->device->id != b->device->id)
-		return a->device->id < b->device->id ? -1 : 1;
-	if (a->start_sect != b->start_sect)
-		return a->start_sect < b->start_sect ? -1 : 1;
-	return 0;
+	if (pvs == NULL || pvs->children == NULL)
+		return NULL;
+	for (n = 0; n < pvs->children->len; n++) {
+		node = lvm_child(pvs, n);
+		id = lvm_string(node, "id");
+		if (id == NULL)
+			continue;
+		/* The text form is dashed */
+		for (len = 0; *id && len < LVM_ID_LEN; id++)
+			if (*id != '-' && *id != pv->uuid[len++])
+				break;
+		if (*id == 0 && len == LVM_ID_LEN)
+			return node;
+	}
+	return NULL;
 }
 
-static void extent_populate_table(struct dm_task *task,
-			uint64_t *smallest_extent)
+/* Mark the extents of pv_name used by one LV segment.  Areas are listed
+   as name/extent pairs; for stripes, each area holds its share of the
+   segment, otherwise (mirrors, pvmove) all of it. */
+static gboolean lvm_mark_segment(struct lvm_node *seg, const char *pv_name,
+			uint8_t *used, uint64_t pe_count)
 {
-	uint64_t sector = 0;
+	struct lvm_node *setting;
+	uint64_t extents;
+	uint64_t stripes = 1;
+	uint64_t len;
+	uint64_t pe;
+	uint64_t end;
 	unsigned n;
-	uint64_t smallest = UINT64_MAX;
+	unsigned i;
 
-	qsort(extents, used_extents, sizeof(*extents), extent_compare_offsets);
-	for (n = 0; n < used_extents; n++) {
-		dm_add_extent(task, &extents[n], sector);
-		sector += extents[n].sect_count;
-		if (extents[n].sect_count < smallest)
-			smallest = extents[n].sect_count;
+	if (!lvm_u64(seg, "extent_count", &extents))
+		return FALSE;
+	if (lvm_find(seg, "stripe_count") != NULL &&
+				(!lvm_u64(seg, "stripe_count", &stripes) ||
+				stripes == 0))
+		return FALSE;
+	for (n = 0; n < seg->children->len; n++) {
+		setting = lvm_child(seg, n);
+		if (setting->values == NULL)
+			continue;
+		len = strcmp(setting->name, "stripes") ? extents :
+					extents / stripes;
+		for (i = 0; i + 1 < setting->values->len; i++) {
+			if (strcmp(g_ptr_array_index(setting->values, i),
+						pv_name) ||
+						!lvm_parse_u64(
+						g_ptr_array_index(
+						setting->values, i + 1), &pe))
+				continue;
+			if (pe > pe_count || len > pe_count - pe)
+				return FALSE;
+			for (end = pe + len; pe < end; pe++)
+				used[pe / 8] |= 1 << (pe % 8);
+		}
 	}
-	if (used_extents)
-		*smallest_extent = smallest;
-	else
-		*smallest_extent = 0;
+	return TRUE;
 }
 
-/* ext[234] */
+static void lvm_emit(void *_data, uint64_t start_sect, uint64_t sect_count)
+{
+	struct lvm_data *data = _data;
 
-static void handle_ext(struct device *device)
+	add_extent(data->device, data->pe_start + start_sect, sect_count);
+}
+
+static const char *lvm_scan_vg(struct lvm_pv *pv, struct lvm_node *root)
 {
-	ext2_filsys fs;
-	blk_t blk;
-	uint64_t run;
-	unsigned block_sectors;
+	struct lvm_node *vg = NULL;
+	struct lvm_node *lvs;
+	struct lvm_node *lv;
+	struct lvm_node *node;
+	struct lvm_data data = {pv->device, 0};
+	struct bitmap_scan scan;
+	const char *lock_type;
+	const char *pv_name;
+	uint64_t extent_size;
+	uint64_t pe_count;
+	uint8_t *used;
+	unsigned n;
+	unsigned i;
 
-	if (ext2fs_open(device->path, 0, 0, 0, unix_io_manager, &fs)) {
-		reject(device, "Couldn't read filesystem");
-		return;
-	}
-	if (fs->super->s_state & EXT2_ERROR_FS) {
-		reject(device, "Filesystem has errors");
-		goto out;
-	}
-	if (!(fs->super->s_state & EXT2_VALID_FS)) {
-		reject(device, "Unclean filesystem");
-		goto out;
-	}
-	if (ext2fs_read_block_bitmap(fs)) {
-		reject(device, "Couldn't read block bitmap");
-		goto out;
+	for (n = 0; n < root->children->len; n++) {
+		if (lvm_child(root, n)->children == NULL)
+			continue;
+		if (vg != NULL)
+			return "Bad LVM metadata";
+		vg = lvm_child(root, n);
 	}
-	block_sectors = fs->blocksize / 512;
-	for (blk = fs->super->s_first_data_block, run = 0;
-				blk < fs->super->s_blocks_count; blk++) {
-		if (!ext2fs_fast_test_block_bitmap(fs->block_map, blk)) {
-			run++;
-		} else if (run) {
-			add_extent(device, (blk - run) * block_sectors,
-						run * block_sectors);
-			run = 0;
+	if (vg == NULL || !lvm_u64(vg, "extent_size", &extent_size) ||
+				extent_size == 0 || extent_size > G_MAXUINT)
+		return "Bad LVM metadata";
+	lock_type = lvm_string(vg, "lock_type");
+	if (lock_type != NULL && strcmp(lock_type, "none"))
+		return "Volume group is shared";
+	node = lvm_find_pv(pv, vg);
+	if (node == NULL)
+		return "PV missing from its volume group";
+	pv_name = node->name;
+	if (!lvm_u64(node, "pe_start", &data.pe_start) ||
+				!lvm_u64(node, "pe_count", &pe_count))
+		return "Bad LVM metadata";
+	if (pe_count > LVM_MAX_EXTENTS)
+		return "Too many physical extents";
+	if (data.pe_start > pv->device->sectors ||
+				pe_count * extent_size >
+				pv->device->sectors - data.pe_start)
+		return "Volume group larger than device";
+
+	used = g_malloc0((pe_count + 7) / 8);
+	lvs = lvm_find(vg, "logical_volumes");
+	for (n = 0; lvs != NULL && lvs->children != NULL &&
+				n < lvs->children->len; n++) {
+		lv = lvm_child(lvs, n);
+		for (i = 0; lv->children != NULL && i < lv->children->len;
+					i++) {
+			node = lvm_child(lv, i);
+			if (node->children == NULL ||
+						!g_str_has_prefix(node->name,
+						"segment"))
+				continue;
+			if (!lvm_mark_segment(node, pv_name, used,
+						pe_count)) {
+				g_free(used);
+				return "Bad LVM metadata";
+			}
 		}
 	}
-	if (run)
-		add_extent(device, (blk - run) * block_sectors,
-					run * block_sectors);
-out:
-	if (ext2fs_close(fs))
-		die("Couldn't close filesystem on %s", device->path);
+	bitmap_scan_init(&scan, extent_size, lvm_emit, &data);
+	bitmap_scan_feed(&scan, used, 0, pe_count);
+	bitmap_scan_finish(&scan, pe_count);
+	g_free(used);
+	return NULL;
 }
 
-/* ntfs */
-
-static void handle_ntfs(struct device *device)
+static void handle_lvm(struct device *device)
 {
-	ntfs_volume *vol;
-	uint8_t *bitmap;
-	int64_t bitmap_len;
-	int64_t lcn;
-	uint64_t run;
-	unsigned cluster_sectors;
-
-	if (verbose)
-		ntfs_log_set_handler(ntfs_log_handler_stderr);
+	struct lvm_pv pv = {0};
+	struct lvm_node *root;
+	struct sector_range *mda;
+	const char *problem;
+	unsigned n;
 
-	/* We ask for a forensic mount so that the volume header won't be
-	   updated.  That doesn't guarantee that the filesystem isn't
-	   changed at all; we'd also need NTFS_MNT_RDONLY for that.  However,
-	   we don't use that flag so that ntfs_mount() will fail the
-	   mount if the log is dirty or the filesystem has a Windows
-	   hibernate image. */
-	vol = ntfs_mount(device->path, NTFS_MNT_FORENSIC);
-	if (vol == NULL) {
-		reject(device, "Couldn't open filesystem; it may be unclean "
-					"or hibernated");
+	if (!unallocated) {
+		reject(device, "LVM physical volume; not collecting "
+					"unallocated space");
 		return;
 	}
-	if (ntfs_version_is_supported(vol)) {
-		reject(device, "Unsupported filesystem version");
+	pv.device = device;
+	pv.mdas = g_array_new(FALSE, FALSE, sizeof(struct sector_range));
+	pv.fd = open(device->path, O_RDONLY);
+	if (pv.fd == -1) {
+		reject(device, "Couldn't open device");
 		goto out;
 	}
-	if (NVolWasDirty(vol)) {
-		reject(device, "Filesystem needs checking");
+	problem = lvm_read_label(&pv);
+	if (problem == NULL)
+		problem = lvm_read_mdas(&pv);
+	if (problem != NULL) {
+		reject(device, "%s", problem);
 		goto out;
 	}
-	bitmap_len = vol->lcnbmp_na->data_size;
-	if (bitmap_len * 8 < vol->nr_clusters) {
-		reject(device, "Unexpectedly short volume bitmap");
+	if (pv.metadata == NULL) {
+		/* Stop short of a metadata area at the end of the device */
+		for (n = 0; n < pv.mdas->len; n++) {
+			mda = &g_array_index(pv.mdas, struct sector_range, n);
+			if (mda->start / 512 >= pv.data_start)
+				pv.data_end = MIN(pv.data_end,
+							mda->start / 512);
+		}
+		if (pv.data_end > pv.data_start)
+			add_extent(device, pv.data_start,
+						pv.data_end - pv.data_start);
 		goto out;
 	}
-	bitmap = g_malloc(bitmap_len);
-	if (ntfs_attr_pread(vol->lcnbmp_na, 0, bitmap_len, bitmap) !=
-				bitmap_len) {
-		reject(device, "Short read for volume bitmap");
-		g_free(bitmap);
+	root = lvm_parse(pv.metadata, pv.metadata_len);
+	if (root == NULL) {
+		reject(device, "Couldn't parse LVM metadata");
 		goto out;
 	}
-	cluster_sectors = vol->cluster_size / 512;
-	for (lcn = 0, run = 0; lcn < vol->nr_clusters; lcn++) {
-		if (!ntfs_bit_get(bitmap, lcn)) {
-			run++;
-		} else if (run) {
-			add_extent(device, (lcn - run) * cluster_sectors,
-						run * cluster_sectors);
-			run = 0;
-		}
-	}
-	if (run)
-		add_extent(device, (lcn - run) * cluster_sectors,
-					run * cluster_sectors);
-	g_free(bitmap);
+	problem = lvm_scan_vg(&pv, root);
+	if (problem != NULL)
+		reject(device, "%s", problem);
+	lvm_node_free(root);
 out:
-	if (ntfs_umount(vol, FALSE))
-		die("Couldn't close filesystem on %s", device->path);
+	if (pv.fd != -1)
+		close(pv.fd);
+	g_free(pv.metadata);
+	g_array_free(pv.mdas, TRUE);
 }
 
 /* swap */
@@ -581,25 +6582,34 @@ out:
 static const struct handler {
 	const char *fstype;
 	void (*run)(struct device *device);
+	/* Identify the filesystem and its current state for --cache.
+	   Returns FALSE if the filesystem can't be cached. */
+	gboolean (*cache_key)(struct device *device, gchar **ident,
+				gchar **state);
 } handlers[] = {
-	{"ext2", handle_ext},
-	{"ext3", handle_ext},
-	{"ext4", handle_ext},
-	{"ntfs", handle_ntfs},
-	{"swap", handle_swap},
-	{NULL, NULL}
+	{"ext2", handle_ext, ext_cache_key},
+	{"ext3", handle_ext, ext_cache_key},
+	{"ext4", handle_ext, ext_cache_key},
+	{"ntfs", handle_ntfs, ntfs_cache_key},
+	{"xfs", handle_xfs, xfs_cache_key},
+	{"vfat", handle_vfat, NULL},
+	{"exfat", handle_exfat, NULL},
+	{"dos", handle_ptable, NULL},
+	{"gpt", handle_ptable, NULL},
+	{"blank", handle_blank, NULL},
+	{"LVM2_member", handle_lvm, NULL},
+	{"swap", handle_swap, NULL},
+	{NULL, NULL, NULL}
 };
 
-static gboolean handle_one(void *path, void *_device, void *data)
+/* Returns TRUE if the device can be scanned.  libext2fs reads the mount
+   table with getmntent(), which isn't thread-safe, so this runs before
+   the scan threads are started. */
+static gboolean check_one(struct device *device)
 {
-	struct device *device = _device;
-	const struct handler *hdlr;
 	const char *reason = NULL;
 	int flags;
 
-	(void) path;
-	(void) data;
-
 	/* Do this early for the benefit of reject() */
 	if (ext2fs_get_device_size2(device->path, 512,
 				(blk64_t *) &device->sectors)) {
@@ -607,6 +6617,9 @@ static gboolean handle_one(void *path, void *_device, void *data)
 		return FALSE;
 	}
 
+	/* Planning never writes to the device */
+	if (plan_only)
+		return TRUE;
 	if (ext2fs_check_if_mounted(device->path, &flags)) {
 		reject(device, "Couldn't check mount status");
 		return FALSE;
@@ -621,15 +6634,229 @@ static gboolean handle_one(void *path, void *_device, void *data)
 		reject(device, "Device is %s", reason);
 		return FALSE;
 	}
+	return TRUE;
+}
+
+static void handle_one(struct device *device)
+{
+	const struct handler *hdlr;
+	gchar *ident;
+	gchar *state;
 
 	for (hdlr = handlers; hdlr->fstype != NULL; hdlr++) {
 		if (!strcmp(device->fstype, hdlr->fstype)) {
 			msg("%s: Detected %s", device->path, device->fstype);
-			hdlr->run(device);
-			return FALSE;
+			if (cache_in == NULL || hdlr->cache_key == NULL ||
+						!hdlr->cache_key(device, &ident,
+						&state)) {
+				hdlr->run(device);
+				return;
+			}
+			if (!cache_load(device, ident, state))
+				hdlr->run(device);
+			cache_store(device, ident, state);
+			g_free(ident);
+			g_free(state);
+			return;
 		}
 	}
 	reject(device, "Unknown filesystem %s", device->fstype);
+}
+
+/* Each worker takes the next unscanned device from the queue and feeds
+   its extents into the worker's own extent set. */
+struct scan_queue {
+	GPtrArray *devices;
+	volatile gint next;
+};
+
+struct scan_worker {
+	GThread *thread;
+	struct scan_queue *queue;
+	struct extent_set *extents;
+};
+
+static void *scan_worker_run(void *_worker)
+{
+	struct scan_worker *worker = _worker;
+	struct scan_queue *queue = worker->queue;
+	struct device *device;
+	int64_t start;
+	gint n;
+
+	while ((n = g_atomic_int_add(&queue->next, 1)) <
+				(gint) queue->devices->len) {
+		device = g_ptr_array_index(queue->devices, n);
+		if (cache_in != NULL)
+			device->extents = extent_set_new();
+		else
+			device->extents = worker->extents;
+		start = g_get_monotonic_time();
+		handle_one(device);
+		device->scan_usec = g_get_monotonic_time() - start;
+		if (cache_in != NULL) {
+			extent_set_merge(worker->extents, device->extents);
+			extent_set_free(device->extents);
+		}
+		device->extents = NULL;
+		msg("%s: Scanned in %"PRIu64" ms", device->path,
+					device->scan_usec / 1000);
+	}
+	return NULL;
+}
+
+static gboolean queue_one(void *path, void *_device, void *_devices)
+{
+	struct device *device = _device;
+	GPtrArray *devices = _devices;
+
+	(void) path;
+
+	g_ptr_array_add(devices, device);
+	return FALSE;
+}
+
+/* One worker per physical disk, so that scans don't compete for the same
+   spindle, but no more than we have CPUs. */
+static unsigned default_jobs(GPtrArray *devices)
+{
+	GHashTable *used;
+	struct device *device;
+	unsigned count;
+	unsigned n;
+
+	used = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (n = 0; n < devices->len; n++) {
+		device = g_ptr_array_index(devices, n);
+		g_hash_table_insert(used, device->disk, device->disk);
+	}
+	count = MIN(g_hash_table_size(used), g_get_num_processors());
+	g_hash_table_destroy(used);
+	return count;
+}
+
+/* The device-mapper table claims its devices exclusively, and the kernel
+   won't let a disk be claimed along with one of its partitions.  Where
+   both a whole disk (for the space outside its partitions) and its
+   partitions produced extents, keep whichever side offers more. */
+static gboolean disk_conflict_loses(struct device *device, uint64_t *whole,
+			uint64_t *parts)
+{
+	unsigned n = device->disk->index;
+
+	if (whole[n] == 0 || parts[n] == 0)
+		return FALSE;
+	return device->whole_disk ? whole[n] <= parts[n] : whole[n] > parts[n];
+}
+
+static void resolve_disk_conflicts(void)
+{
+	struct extent *extent;
+	struct device *device;
+	uint64_t *whole;
+	uint64_t *parts;
+	unsigned kept = 0;
+	unsigned n;
+
+	whole = g_new0(uint64_t, g_hash_table_size(disks));
+	parts = g_new0(uint64_t, g_hash_table_size(disks));
+	for (n = 0; n < extents->used; n++) {
+		extent = &extents->extents[n];
+		device = extent_device(extent);
+		if (device->whole_disk)
+			whole[device->disk->index] += extent->sect_count;
+		else
+			parts[device->disk->index] += extent->sect_count;
+	}
+	for (n = 0; n < extents->used; n++) {
+		extent = &extents->extents[n];
+		if (!disk_conflict_loses(extent_device(extent), whole, parts))
+			extents->extents[kept++] = *extent;
+	}
+	extents->used = kept;
+	for (n = 0; n < device_list->len; n++) {
+		device = g_ptr_array_index(device_list, n);
+		if (device->free_extents &&
+					disk_conflict_loses(device, whole,
+					parts))
+			reject(device, device->whole_disk ? "Partitions of "
+						"this disk are being used" :
+						"Space outside this disk's "
+						"partitions is being used");
+	}
+	g_free(whole);
+	g_free(parts);
+}
+
+/* Choose the extents to use, after a scan or a replay */
+static void scan_finish(void)
+{
+	resolve_disk_conflicts();
+	extent_set_select(extents);
+	if (target_mb) {
+		extent_set_limit(extents, ((uint64_t) target_mb << 11) *
+					(100 + headroom_pct) / 100);
+		msg("Using %u extents for the target size", extents->used);
+	}
+	extent_count_accepted();
+}
+
+static void scan_devices(GTree *devices)
+{
+	struct scan_queue queue = {0};
+	struct scan_worker *workers;
+	struct device *device;
+	unsigned count;
+	unsigned n;
+
+	device_list = g_ptr_array_new();
+	g_tree_foreach(devices, queue_one, device_list);
+	if (device_list->len > EXTENT_MAX_DEVICES)
+		die("Too many devices");
+	queue.devices = g_ptr_array_new();
+	for (n = 0; n < device_list->len; n++) {
+		device = g_ptr_array_index(device_list, n);
+		device->index = n;
+		device_resolve_disk(device);
+		if (check_one(device))
+			g_ptr_array_add(queue.devices, device);
+	}
+	disks_assign_order();
+	if (trace_out != NULL)
+		trace_write_header();
+
+	count = jobs ? jobs : default_jobs(queue.devices);
+	count = MAX(MIN(count, queue.devices->len), 1);
+	msg("Scanning %u devices with %u threads", queue.devices->len, count);
+	workers = g_new0(struct scan_worker, count);
+	for (n = 0; n < count; n++) {
+		workers[n].queue = &queue;
+		workers[n].extents = extent_set_new();
+		workers[n].thread = g_thread_new("scan", scan_worker_run,
+					&workers[n]);
+	}
+	for (n = 0; n < count; n++) {
+		g_thread_join(workers[n].thread);
+		extent_set_merge(extents, workers[n].extents);
+		extent_set_free(workers[n].extents);
+	}
+	g_free(workers);
+	g_ptr_array_free(queue.devices, TRUE);
+	if (trace_out != NULL)
+		trace_close();
+	scan_finish();
+}
+
+static gboolean report_problems(void *path, void *_device, void *data)
+{
+	struct device *device = _device;
+
+	(void) path;
+	(void) data;
+
+	if (device->problem != NULL)
+		report_rejection(device->path, device->fstype,
+					device->sectors, device->problem);
 	return FALSE;
 }
 
@@ -641,7 +6868,7 @@ static gboolean print_stats(void *path, void *_device, void *_total)
 	(void) path;
 
 	*total += device->accepted_sectors;
-	if (device->free_sectors == 0)
+	if (device->free_sectors == 0 || device->problem != NULL)
 		return FALSE;
 
 	info("%s (%s): %"PRIu64"/%"PRIu64"/%"PRIu64" MB, %u/%u extents",
@@ -655,11 +6882,19 @@ static gboolean print_stats(void *path, void *_device, void *_total)
 	report(1, "- device: %s", device->path);
 	report(2, "error: false");
 	report(2, "filesystem: %s", device->fstype);
+	report(2, "disk: %s", device->disk->path);
+	report(2, "tier: %s", tier_names[device->disk->tier]);
+	if (device->disk->read_kbps)
+		report(2, "read-kbps: %"PRIu64, device->disk->read_kbps);
 	report(2, "size-kb: %"PRIu64, device->sectors / 2);
 	report(2, "free-kb: %"PRIu64, device->free_sectors / 2);
 	report(2, "accepted-kb: %"PRIu64, device->accepted_sectors / 2);
 	report(2, "free-extents: %u", device->free_extents);
 	report(2, "accepted-extents: %u", device->accepted_extents);
+	report(2, "alignment-kb: %u", device->disk->align_sectors / 2);
+	report(2, "alignment-loss-kb: %"PRIu64,
+				device->align_loss_sectors / 2);
+	report(2, "scan-ms: %"PRIu64, device->scan_usec / 1000);
 	return FALSE;
 }
 
@@ -668,11 +6903,16 @@ int main(int argc, char **argv)
 	GOptionContext *opt_ctx;
 	GError *err = NULL;
 	const char *device_name;
-	blkid_cache blkid_cache;
+	GHashTable *excluded;
+	GPtrArray *probes;
 	GTree *devices;
 	struct dm_task *task;
+	struct table table;
 	uint64_t accepted_sectors = 0;
 	uint64_t smallest_extent;
+	unsigned first_child = 0;
+	struct rusage usage;
+	int64_t start;
 	int ret = 0;
 
 	opt_ctx = g_option_context_new("NODE [DEVICE ...]");
@@ -685,65 +6925,182 @@ int main(int argc, char **argv)
 	min_extent_sectors = min_extent_kb << 1;
 	if (max_extent_count == 0)
 		die("--max-extent-count must be at least 1.");
+	if (bitmap_chunk_mb == 0)
+		die("--bitmap-chunk-size must be at least 1.");
+	if (io_depth == 0)
+		die("--io-depth must be at least 1.");
+	if (!strcmp(layout_name, "linear"))
+		layout = LAYOUT_LINEAR;
+	else if (!strcmp(layout_name, "stripe"))
+		layout = LAYOUT_STRIPE;
+	else
+		die("Unknown layout %s", layout_name);
+	if (!strcmp(placement_name, "physical"))
+		placement = PLACEMENT_PHYSICAL;
+	else if (!strcmp(placement_name, "fast-first"))
+		placement = PLACEMENT_FAST_FIRST;
+	else
+		die("Unknown placement policy %s", placement_name);
+	if (stripe_chunk_kb < 4 || (stripe_chunk_kb & (stripe_chunk_kb - 1)))
+		die("--stripe-chunk-size must be a power of two, at least 4.");
+	if (stack_prefix != NULL && swap_mb == 0)
+		die("--swap-size must be at least 1.");
+	if (replay_file != NULL && (trace_file != NULL || cache_file != NULL ||
+				probe_disks))
+		die("--replay can't be used with --trace, --cache, or --probe.");
+	if (trace_file != NULL && cache_file != NULL)
+		die("--trace can't be used with --cache.");
+	if (replay_file != NULL)
+		plan_only = TRUE;
+	if (plan_only && (extend || stack_prefix != NULL))
+		die("--plan-only can't be used with --extend or --stack.");
+	/* The table goes to stdout */
+	if (plan_only && (log_extents || (report_file != NULL &&
+				!strcmp(report_file, "-"))))
+		die("--plan-only and --replay can't be used with --dump or "
+					"--report -.");
 
 	if (argc < 2)
 		die("You must specify a device name.");
 	device_name = argv[1];
 	argc -= 2;
 	argv += 2;
+	if (replay_file != NULL && argc)
+		die("Devices can't be specified with --replay.");
 
-	if (geteuid() != 0)
+	if (geteuid() != 0 && !plan_only)
 		die("You must be root.");
 
-	extents = g_new(struct extent, max_extent_count);
+	bitmap_skip_select();
+	fat_pack_select();
+	if (cache_file != NULL)
+		cache_open();
+	if (trace_file != NULL)
+		trace_open();
+
+	extents = extent_set_new();
+	stages = g_array_new(FALSE, FALSE, sizeof(struct stage));
 	if (report_file != NULL)
 		report_str = g_string_sized_new(0);
 	report(0, "devices:");
 
 	dm_log_init(_dm_log);
-	if (dm_device_exists(device_name))
-		die("Device %s already exists", device_name);
+	if (!plan_only) {
+		if (extend && !dm_device_exists(device_name))
+			die("Device %s doesn't exist", device_name);
+		else if (!extend && dm_device_exists(device_name))
+			die("Device %s already exists", device_name);
+	}
 
 	devices = device_tree_new();
-	/* Avoid using a cache file, since we want to ensure we don't get
-	   stale data, and if we use a real cache file there's nothing in
-	   the API that allows us to detect/reject stale entries. */
-	if (blkid_get_cache(&blkid_cache, "/dev/null"))
-		die("Couldn't get blkid cache");
-	if (argc)
-		for (; argc; argc--, argv++)
-			add_device(blkid_cache, devices, *argv);
-	else
-		add_all_devices(blkid_cache, devices);
-	if (exclude != NULL)
-		for (; *exclude != NULL; exclude++)
-			g_tree_remove(devices, *exclude);
-	g_tree_foreach(devices, handle_one, NULL);
+	disks = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+				disk_free);
+	/* We use the low-level probing API, so there's no blkid cache to
+	   return stale data. */
+	start = g_get_monotonic_time();
+	if (replay_file != NULL) {
+		trace_replay(devices);
+		scan_finish();
+		stage_done("replay", &start);
+	} else {
+		excluded = excluded_new();
+		if (extend)
+			first_child = extend_exclude(device_name, excluded);
+		probes = g_ptr_array_new();
+		if (argc)
+			find_devices(excluded, probes, argc, argv);
+		else
+			find_all_devices(excluded, probes);
+		probe_devices(probes, devices);
+		g_ptr_array_free(probes, TRUE);
+		g_hash_table_destroy(excluded);
+		stage_done("probe", &start);
+		scan_devices(devices);
+		stage_done("scan", &start);
+	}
+	g_tree_foreach(devices, report_problems, NULL);
+	if (cache_file != NULL)
+		cache_close();
 
-	task = dm_task_create(DM_DEVICE_CREATE);
+	task = dm_task_create(extend ? DM_DEVICE_RELOAD : DM_DEVICE_CREATE);
 	if (task == NULL)
 		die("Couldn't create DM task");
 	if (!dm_task_set_name(task, device_name))
 		die("Couldn't set device name");
-	extent_populate_table(task, &smallest_extent);
+	table_init(&table, task, device_name);
+	if (extend)
+		table_init_extend(&table, first_child);
+	extent_populate_table(&table, &smallest_extent);
+	stage_done("plan", &start);
 
 	g_tree_foreach(devices, print_stats, &accepted_sectors);
 	info("Total accepted: %"PRIu64" MB, %u extents, smallest %"
-				PRIu64" KB", accepted_sectors >> 11,
-				used_extents, smallest_extent >> 1);
+				PRIu64" KB, %u targets", accepted_sectors >> 11,
+				extents->used, smallest_extent >> 1,
+				table.targets);
 	report(0, "smallest-extent-kb: %"PRIu64, smallest_extent >> 1);
+	report(0, "extent-count: %u", extents->used);
+	report(0, "average-extent-kb: %"PRIu64, extents->used ?
+				accepted_sectors / 2 / extents->used : 0);
+	report(0, "targets: %u", table.targets);
+	if (target_mb)
+		report(0, "target-size-kb: %"PRIu64,
+					(uint64_t) target_mb << 10);
+	report(0, "layout: %s", layout_name);
+	report(0, "placement: %s", placement_name);
+	if (extend)
+		report(0, "extended-from-kb: %"PRIu64,
+					table.base_sectors / 2);
+	if (table.stripe_width) {
+		info("Striped %"PRIu64" MB across %u disks, %"PRIu64" MB "
+					"linear", table.striped_sectors >> 11,
+					table.stripe_width,
+					(table.sectors - table.base_sectors -
+					table.striped_sectors) >> 11);
+		report(0, "stripe-width: %u", table.stripe_width);
+		report(0, "striped-kb: %"PRIu64, table.striped_sectors / 2);
+	}
+	table_report(&table);
 
 	if (minsize && (accepted_sectors >> 11) < minsize) {
 		/* We still write out the report file, if requested */
 		warn("Minimum size requirement not met, aborting");
 		ret = 1;
+	} else if (stack_prefix != NULL && !extend &&
+				table.sectors <= (uint64_t) swap_mb << 11) {
+		warn("Not enough space for swap and home, aborting");
+		ret = 1;
+	} else if (extend && !extents->used) {
+		info("No new free space found");
+	} else if (plan_only) {
+		table_print(&table);
 	} else if (dry_run) {
-		info("Test mode, not creating device");
+		info("Test mode, not %s device", extend ? "extending" :
+					"creating");
+	} else if (extend) {
+		if (!table_create(&table))
+			die("Couldn't extend device");
+		stage_done("reload", &start);
+		if (stack_prefix != NULL) {
+			stack_grow(&table);
+			stage_done("grow", &start);
+		}
+		info("Extended device %s from %"PRIu64" MB to %"PRIu64" MB",
+					device_name, table.base_sectors >> 11,
+					table.sectors >> 11);
 	} else {
-		if (!dm_task_run(task))
+		if (!table_create(&table))
 			die("Couldn't create device");
+		stage_done("create", &start);
+		if (stack_prefix != NULL && !stack_create(&table, &start)) {
+			table_remove(&table);
+			die("Couldn't create scratch stack");
+		}
 		info("Created device %s", device_name);
 	}
+	stage_report();
+	if (!getrusage(RUSAGE_SELF, &usage))
+		report(0, "peak-rss-kb: %ld", usage.ru_maxrss);
 
 	if (report_str != NULL) {
 		if (!strcmp("-", report_file)) {
@@ -757,10 +7114,12 @@ int main(int argc, char **argv)
 		g_string_free(report_str, TRUE);
 	}
 
-	dm_task_destroy(task);
-	g_free(extents);
-	blkid_put_cache(blkid_cache);
+	table_free(&table);
+	g_array_free(stages, TRUE);
+	extent_set_free(extents);
+	g_ptr_array_free(device_list, TRUE);
 	g_tree_destroy(devices);
+	g_hash_table_destroy(disks);
 
 	return ret;
 }
@@ -0,0 +1,111 @@
+# Helpers for the image-based tests, sourced by each script.  A test
+# which can't run here, e.g. because a mkfs tool is missing, exits 77 to be
+# reported as skipped.
+
+gfs=${GATHER_FREE_SPACE:-./gather_free_space}
+# mkfs tools usually live in sbin, which isn't always in PATH
+PATH=$PATH:/sbin:/usr/sbin
+workdir=$(mktemp -d "${TMPDIR:-/tmp}/gfs-test.XXXXXX") || exit 99
+shmdir=
+trap 'rm -rf "$workdir" $shmdir' EXIT
+
+skip() {
+	echo "SKIP: $*"
+	exit 77
+}
+
+fail() {
+	echo "FAIL: $*"
+	exit 1
+}
+
+require() {
+	for tool in "$@"; do
+		command -v "$tool" >/dev/null 2>&1 || skip "$tool not found"
+	done
+}
+
+# sparse_image NAME SIZE
+# Create a sparse file and set $image to its path.  Many filesystems cap
+# files at 16 TiB, so fall back to tmpfs for larger images.
+sparse_image() {
+	image=$workdir/$1
+	truncate -s "$2" "$image" 2>/dev/null && return
+	rm -f "$image"
+	if [ -z "$shmdir" ] && [ -d /dev/shm ]; then
+		shmdir=$(mktemp -d /dev/shm/gfs-test.XXXXXX) || shmdir=
+	fi
+	[ -n "$shmdir" ] || skip "nowhere to create a $2 sparse file"
+	image=$shmdir/$1
+	truncate -s "$2" "$image" 2>/dev/null ||
+				skip "nowhere to create a $2 sparse file"
+}
+
+# plan [OPTION...] IMAGE...
+# Plan a map over every free extent, writing the table to $workdir/table
+# and the report to $workdir/report.
+plan() {
+	"$gfs" --plan-only -q -m 0 -e 0 -E 100000000 \
+				-r "$workdir/report" "$@" test-node \
+				> "$workdir/table" ||
+				fail "gather_free_space $* failed"
+}
+
+# report_value KEY
+# Print the first value of KEY in the report
+report_value() {
+	awk -v key="$1:" '$1 == key || ($1 == "-" && $2 == key) \
+				{print $NF; exit}' "$workdir/report"
+}
+
+# expect_free_kb KB
+expect_free_kb() {
+	found=$(report_value free-kb)
+	[ "$found" = "$1" ] || fail "found $found KB free, expected $1 KB"
+}
+
+# table_sectors IMAGE
+# Print the number of sectors of IMAGE mapped by the planned table
+table_sectors() {
+	awk -v dev="$1" '$3 == "linear" && $4 == dev {n += $2} \
+				END {printf "%.0f\n", n}' "$workdir/table"
+}
+
+# table_end IMAGE
+# Print the sector following the last one of IMAGE in the planned table
+table_end() {
+	awk -v dev="$1" '$3 == "linear" && $4 == dev && $5 + $2 > end \
+				{end = $5 + $2} END {printf "%.0f\n", end}' \
+				"$workdir/table"
+}
+
+# get_le FILE OFFSET SIZE
+# Print the little-endian unsigned integer of SIZE bytes at OFFSET
+get_le() {
+	od -An -tu1 -j "$2" -N "$3" "$1" |
+				awk '{for (i = NF; i > 0; i--) v = v * 256 + $i}
+				END {printf "%.0f\n", v}'
+}
+
+# put_le32 FILE OFFSET VALUE
+put_le32() {
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(($3 & 255)) \
+				$((($3 >> 8) & 255)) $((($3 >> 16) & 255)) \
+				$((($3 >> 24) & 255)))" |
+				dd of="$1" bs=1 seek="$2" conv=notrunc \
+				2>/dev/null
+}
+
+# expect_rejected PROBLEM
+expect_rejected() {
+	grep -q "problem: $1" "$workdir/report" ||
+				fail "expected the device to be rejected: $1"
+}
+
+# table_start IMAGE
+# Print the lowest sector of IMAGE in the planned table
+table_start() {
+	awk -v dev="$1" '$3 == "linear" && $4 == dev && \
+				(start == "" || $5 < start) {start = $5} \
+				END {printf "%.0f\n", start}' "$workdir/table"
+}
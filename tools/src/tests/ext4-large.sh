@@ -0,0 +1,22 @@
+#!/bin/sh
+# A sparse ext4 image over 16 TiB, whose block numbers don't fit in 32
+# bits.  Every free block must be found, including those past block 2^32.
+
+. "$srcdir/tests/common.sh"
+
+require mkfs.ext4 dumpe2fs truncate
+sparse_image ext4-large.img 17T
+mkfs.ext4 -q -F -O 64bit -E nodiscard,lazy_itable_init=1,lazy_journal_init=1 \
+			"$image" || fail "mkfs.ext4 failed"
+
+plan "$image"
+free_blocks=$(dumpe2fs -h "$image" 2>/dev/null |
+			awk '/^Free blocks:/ {print $3}')
+block_size=$(dumpe2fs -h "$image" 2>/dev/null |
+			awk '/^Block size:/ {print $3}')
+expect_free_kb $((free_blocks * block_size / 1024))
+[ "$(table_sectors "$image")" -eq $((free_blocks * block_size / 512)) ] ||
+			fail "table doesn't map every free block"
+[ "$(table_end "$image")" -gt $(((1 << 32) * block_size / 512)) ] ||
+			fail "no extent past block 2^32"
+exit 0
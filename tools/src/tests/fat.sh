@@ -0,0 +1,70 @@
+#!/bin/sh
+# FAT32 and exFAT images made by mkfs.vfat and mkfs.exfat.  Free clusters
+# must be found and mapped to the right sectors, and a volume marked dirty
+# must be rejected.
+
+. "$srcdir/tests/common.sh"
+
+require truncate od dd
+ran=
+
+if command -v mkfs.vfat >/dev/null 2>&1; then
+	ran=1
+	sparse_image fat32.img 300M
+	# 4 KB clusters, enough of them for FAT32
+	mkfs.vfat -F 32 -s 8 -S 512 "$image" >/dev/null ||
+				fail "mkfs.vfat failed"
+	bps=$(get_le "$image" 11 2)
+	spc=$(get_le "$image" 13 1)
+	reserved=$(get_le "$image" 14 2)
+	nfats=$(get_le "$image" 16 1)
+	fat_size=$(get_le "$image" 36 4)
+	fsinfo=$(get_le "$image" 48 2)
+	# The free count in the FSInfo sector is exact after mkfs
+	free_clusters=$(get_le "$image" $((fsinfo * bps + 488)) 4)
+	plan "$image"
+	expect_free_kb $((free_clusters * spc * bps / 1024))
+	[ "$(table_sectors "$image")" -eq \
+				$((free_clusters * spc * bps / 512)) ] ||
+				fail "table doesn't map every free FAT32 cluster"
+	# Cluster 2 holds the root directory; cluster 3 is the first free
+	data_start=$(((reserved + nfats * fat_size) * bps / 512))
+	[ "$(table_start "$image")" -eq $((data_start + spc * bps / 512)) ] ||
+				fail "first free FAT32 cluster mapped to the" \
+				"wrong sector"
+
+	# Clear the clean shutdown bit in FAT entry 1
+	entry=$(get_le "$image" $((reserved * bps + 4)) 4)
+	put_le32 "$image" $((reserved * bps + 4)) $((entry & ~0x08000000))
+	plan "$image"
+	expect_rejected "Filesystem needs checking"
+fi
+
+if command -v mkfs.exfat >/dev/null 2>&1; then
+	ran=1
+	sparse_image exfat.img 300M
+	mkfs.exfat "$image" >/dev/null || fail "mkfs.exfat failed"
+	clusters=$(get_le "$image" 92 4)
+	cluster_bytes=$((1 << ($(get_le "$image" 108 1) + \
+				$(get_le "$image" 109 1))))
+	plan "$image"
+	found=$(($(report_value free-kb) * 1024 / cluster_bytes))
+	# An empty volume only holds the allocation bitmap, the upcase
+	# table (at most 128 KB) and the root directory
+	used=$(((clusters + 8 * cluster_bytes - 1) / (8 * cluster_bytes) + \
+				(131072 + cluster_bytes - 1) / cluster_bytes + 1))
+	[ "$found" -lt "$clusters" ] && [ "$found" -ge $((clusters - used)) ] ||
+				fail "found $found free exFAT clusters of $clusters"
+	[ "$(table_sectors "$image")" -eq \
+				$(($(report_value free-kb) * 2)) ] ||
+				fail "table doesn't map every free exFAT cluster"
+
+	# Set VolumeDirty in VolumeFlags, the upper half of this word
+	flags=$(get_le "$image" 104 4)
+	put_le32 "$image" 104 $((flags | 0x20000))
+	plan "$image"
+	expect_rejected "Filesystem needs checking"
+fi
+
+[ -n "$ran" ] || skip "neither mkfs.vfat nor mkfs.exfat found"
+exit 0
@@ -0,0 +1,282 @@
+/*
+ * test_bitmap - Check the word-at-a-time bitmap scanner against a bit loop
+ *
+ * Copyright (C) 2009-2010 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#define main gather_free_space_main
+#include "../gather_free_space.c"
+#undef main
+
+#define TEST_UNITS (1 << 16)
+#define TEST_ROUNDS 200
+
+struct skip_variant {
+	const char *name;
+	size_t (*skip)(const uint8_t *buf, size_t len, uint8_t fill);
+	gboolean (*supported)(void);
+};
+
+static gboolean cpu_any(void)
+{
+	return TRUE;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static gboolean cpu_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static gboolean cpu_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static const struct skip_variant skip_variants[] = {
+	{"scalar", bitmap_skip_scalar, cpu_any},
+#if defined(__i386__) || defined(__x86_64__)
+	{"sse2", bitmap_skip_sse2, cpu_sse2},
+	{"avx2", bitmap_skip_avx2, cpu_avx2},
+#endif
+};
+
+static void collect_run(void *runs, uint64_t start_sect, uint64_t sect_count)
+{
+	struct sector_range range = {start_sect, start_sect + sect_count};
+
+	g_assert_cmpuint(sect_count, >, 0);
+	g_array_append_val(runs, range);
+}
+
+/* The loop bitmap_scan_feed() replaced: one bit at a time, no skipping */
+static GArray *reference_runs(const uint8_t *bitmap, uint64_t units,
+			unsigned unit_sectors)
+{
+	GArray *runs = g_array_new(FALSE, FALSE, sizeof(struct sector_range));
+	uint64_t start = 0;
+	gboolean in_run = FALSE;
+	gboolean used;
+	uint64_t n;
+
+	for (n = 0; n < units; n++) {
+		used = (bitmap[n / 8] >> (n % 8)) & 1;
+		if (!used && !in_run) {
+			in_run = TRUE;
+			start = n;
+		} else if (used && in_run) {
+			collect_run(runs, start * unit_sectors,
+						(n - start) * unit_sectors);
+			in_run = FALSE;
+		}
+	}
+	if (in_run)
+		collect_run(runs, start * unit_sectors,
+					(units - start) * unit_sectors);
+	return runs;
+}
+
+/* Fill bitmap with alternating used and free runs.  Run lengths are drawn
+   from a range that mixes single bits, partial words and whole vectors, so
+   every path through the scanner gets exercised. */
+static void fill_bitmap(uint8_t *bitmap, uint64_t units, unsigned max_run)
+{
+	gboolean used = g_test_rand_bit();
+	uint64_t n = 0;
+	uint64_t len;
+
+	memset(bitmap, 0, (units + 7) / 8);
+	while (n < units) {
+		len = g_test_rand_int_range(1, max_run + 1);
+		for (; len && n < units; len--, n++)
+			if (used)
+				bitmap[n / 8] |= 1 << (n % 8);
+		used = !used;
+	}
+	/* Bits past the end must be ignored */
+	if (units % 8)
+		bitmap[units / 8] |= 0xff << (units % 8);
+}
+
+/* Scan bitmap in pieces of random size.  Some pieces which happen to be
+   uniform are passed to bitmap_scan_span() instead of being fed. */
+static GArray *scan_runs(const uint8_t *bitmap, uint64_t units,
+			unsigned unit_sectors)
+{
+	GArray *runs = g_array_new(FALSE, FALSE, sizeof(struct sector_range));
+	struct bitmap_scan scan;
+	uint64_t first = 0;
+	uint64_t len;
+	uint64_t n;
+	gboolean uniform;
+	gboolean used;
+
+	bitmap_scan_init(&scan, unit_sectors, collect_run, runs);
+	while (first < units) {
+		/* Pieces must start on a byte boundary */
+		len = 8 * g_test_rand_int_range(1, 1024);
+		len = MIN(len, units - first);
+		used = (bitmap[first / 8] >> (first % 8)) & 1;
+		uniform = TRUE;
+		for (n = first; n < first + len && uniform; n++)
+			if (((bitmap[n / 8] >> (n % 8)) & 1) != used)
+				uniform = FALSE;
+		if (uniform && g_test_rand_bit())
+			bitmap_scan_span(&scan, first, !used);
+		else
+			bitmap_scan_feed(&scan, bitmap + first / 8, first,
+						len);
+		first += len;
+	}
+	bitmap_scan_finish(&scan, units);
+	return runs;
+}
+
+static void assert_same_runs(GArray *expected, GArray *actual)
+{
+	struct sector_range *a;
+	struct sector_range *b;
+	unsigned n;
+
+	g_assert_cmpuint(actual->len, ==, expected->len);
+	for (n = 0; n < expected->len; n++) {
+		a = &g_array_index(expected, struct sector_range, n);
+		b = &g_array_index(actual, struct sector_range, n);
+		g_assert_cmpuint(b->start, ==, a->start);
+		g_assert_cmpuint(b->end, ==, a->end);
+	}
+}
+
+static void test_variant(const void *data)
+{
+	const struct skip_variant *variant = data;
+	static const unsigned max_runs[] = {1, 7, 70, 700, 7000, TEST_UNITS};
+	static const unsigned unit_sectors[] = {1, 8};
+	uint8_t *bitmap = g_malloc(TEST_UNITS / 8 + 1);
+	GArray *expected;
+	GArray *actual;
+	uint64_t units;
+	unsigned round;
+
+	if (!variant->supported()) {
+		g_test_message("CPU lacks %s, skipping", variant->name);
+		g_free(bitmap);
+		return;
+	}
+	bitmap_skip = variant->skip;
+	for (round = 0; round < TEST_ROUNDS; round++) {
+		units = g_test_rand_int_range(1, TEST_UNITS + 1);
+		fill_bitmap(bitmap, units,
+					max_runs[round % G_N_ELEMENTS(max_runs)]);
+		expected = reference_runs(bitmap, units,
+					unit_sectors[round % 2]);
+		actual = scan_runs(bitmap, units, unit_sectors[round % 2]);
+		assert_same_runs(expected, actual);
+		g_array_free(expected, TRUE);
+		g_array_free(actual, TRUE);
+	}
+	g_free(bitmap);
+}
+
+/* All free and all used, which the scanner should handle entirely in the
+   skip kernels */
+static void test_uniform(void)
+{
+	uint8_t *bitmap = g_malloc(TEST_UNITS / 8);
+	GArray *runs;
+	int fill;
+
+	bitmap_skip_select();
+	for (fill = 0; fill <= 0xff; fill += 0xff) {
+		memset(bitmap, fill, TEST_UNITS / 8);
+		runs = scan_runs(bitmap, TEST_UNITS, 1);
+		if (fill) {
+			g_assert_cmpuint(runs->len, ==, 0);
+		} else {
+			g_assert_cmpuint(runs->len, ==, 1);
+			g_assert_cmpuint(g_array_index(runs,
+						struct sector_range, 0).end,
+						==, TEST_UNITS);
+		}
+		g_array_free(runs, TRUE);
+	}
+	g_free(bitmap);
+}
+
+/* A bitmap of alternating runs of four used and four free units, which
+   can't be read past *fail_offset */
+static gboolean short_read(void *fail_offset, uint64_t offset, void *buf,
+			size_t len)
+{
+	if (offset + len > *(uint64_t *) fail_offset)
+		return FALSE;
+	memset(buf, 0x0f, len);
+	return TRUE;
+}
+
+/* A volume bitmap which can't be read in full adds no extents, even from
+   the chunks read before the failure */
+static void test_short_read(void)
+{
+	struct disk disk = {
+		.align_sectors = 1,
+	};
+	struct device device = {
+		.path = (gchar *) "test-ntfs",
+		.disk = &disk,
+	};
+	uint64_t fail_offset;
+	gboolean ok;
+
+	bitmap_chunk_mb = 1;
+	max_extent_count = 1000;
+	device_list = g_ptr_array_new();
+	g_ptr_array_add(device_list, &device);
+	device.extents = extent_set_new();
+
+	fail_offset = 2 << 20;
+	ok = ntfs_scan_bitmap(&device, short_read, &fail_offset,
+				(uint64_t) 3 << 23, 4096);
+	g_assert(!ok);
+	g_assert_cmpuint(device.extents->used, ==, 0);
+
+	fail_offset = G_MAXUINT64;
+	ok = ntfs_scan_bitmap(&device, short_read, &fail_offset,
+				(uint64_t) 3 << 23, 4096);
+	g_assert(ok);
+	g_assert_cmpuint(device.extents->used, ==, max_extent_count);
+
+	extent_set_free(device.extents);
+	g_ptr_array_free(device_list, TRUE);
+}
+
+int main(int argc, char **argv)
+{
+	gchar *path;
+	unsigned n;
+
+	g_test_init(&argc, &argv, NULL);
+	for (n = 0; n < G_N_ELEMENTS(skip_variants); n++) {
+		path = g_strdup_printf("/bitmap/random/%s",
+					skip_variants[n].name);
+		g_test_add_data_func(path, &skip_variants[n], test_variant);
+		g_free(path);
+	}
+	g_test_add_func("/bitmap/uniform", test_uniform);
+	g_test_add_func("/bitmap/short-read", test_short_read);
+	return g_test_run();
+}
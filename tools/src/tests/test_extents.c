@@ -0,0 +1,250 @@
+/*
+ * test_extents - Check batched extent selection against the old heap, and
+ *                time the two
+ *
+ * Copyright (C) 2009-2010 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#define main gather_free_space_main
+#include "../gather_free_space.c"
+#undef main
+
+#define TEST_DEVICES 8
+#define TEST_CANDIDATES 100000
+/* With -m perf */
+#define PERF_CANDIDATES 20000000
+#define PERF_KEEP 1000000
+
+/* The selection extent_set_add() replaced: a min-heap of the largest
+   extents seen so far, with unpacked extents */
+
+struct heap_extent {
+	struct device *device;
+	uint64_t start_sect;
+	uint64_t sect_count;
+};
+
+struct heap {
+	struct heap_extent *extents;
+	unsigned used;
+	unsigned allocated;
+	unsigned keep;
+};
+
+static struct device test_devices[TEST_DEVICES];
+
+static gboolean heap_less(const struct heap_extent *a,
+			const struct heap_extent *b)
+{
+	if (a->sect_count != b->sect_count)
+		return a->sect_count < b->sect_count;
+	if (a->device->index != b->device->index)
+		return a->device->index > b->device->index;
+	return a->start_sect > b->start_sect;
+}
+
+static void heap_sift_down(struct heap *heap, unsigned node)
+{
+	unsigned left = 2 * node + 1;
+	unsigned right = 2 * node + 2;
+	unsigned min_node = node;
+	struct heap_extent tmp;
+
+	if (left < heap->used && heap_less(&heap->extents[left],
+				&heap->extents[min_node]))
+		min_node = left;
+	if (right < heap->used && heap_less(&heap->extents[right],
+				&heap->extents[min_node]))
+		min_node = right;
+	if (min_node != node) {
+		tmp = heap->extents[min_node];
+		heap->extents[min_node] = heap->extents[node];
+		heap->extents[node] = tmp;
+		heap_sift_down(heap, min_node);
+	}
+}
+
+static void heap_add(struct heap *heap, const struct heap_extent *new)
+{
+	int node;
+
+	if (heap->used < heap->keep) {
+		if (heap->used == heap->allocated) {
+			heap->allocated = MIN(MAX(2 * heap->allocated, 1024),
+						heap->keep);
+			heap->extents = g_renew(struct heap_extent,
+						heap->extents,
+						heap->allocated);
+		}
+		heap->extents[heap->used] = *new;
+		if (++heap->used == heap->keep)
+			for (node = (int) (heap->used / 2) - 1; node >= 0;
+						node--)
+				heap_sift_down(heap, node);
+	} else {
+		if (!heap_less(&heap->extents[0], new))
+			return;
+		heap->extents[0] = *new;
+		heap_sift_down(heap, 0);
+	}
+}
+
+/* Candidates are drawn from a few size classes, so that there are many
+   ties for the comparison to break by device and start. */
+static struct heap_extent *make_candidates(unsigned count)
+{
+	struct heap_extent *list = g_new(struct heap_extent, count);
+	unsigned n;
+
+	for (n = 0; n < TEST_DEVICES; n++)
+		test_devices[n].index = n;
+	for (n = 0; n < count; n++) {
+		list[n].device = &test_devices[g_test_rand_int_range(0,
+					TEST_DEVICES)];
+		list[n].start_sect = (uint64_t) g_test_rand_int() << 8;
+		list[n].sect_count = 1 + ((uint64_t) 1 <<
+					g_test_rand_int_range(0, 20)) +
+					g_test_rand_int_range(0, 4);
+	}
+	return list;
+}
+
+static struct extent pack(const struct heap_extent *old)
+{
+	struct extent extent = {
+		.start_sect = old->start_sect,
+		.device = old->device->index,
+		.sect_count = old->sect_count,
+	};
+
+	return extent;
+}
+
+static double run_heap(struct heap *heap, const struct heap_extent *list,
+			unsigned count, unsigned keep)
+{
+	unsigned n;
+
+	memset(heap, 0, sizeof(*heap));
+	heap->keep = keep;
+	g_test_timer_start();
+	for (n = 0; n < count; n++)
+		heap_add(heap, &list[n]);
+	return g_test_timer_elapsed();
+}
+
+static double run_set(struct extent_set **set, const struct extent *list,
+			unsigned count, unsigned keep)
+{
+	unsigned n;
+
+	max_extent_count = keep;
+	*set = extent_set_new();
+	g_test_timer_start();
+	for (n = 0; n < count; n++)
+		extent_set_add(*set, &list[n]);
+	extent_set_select(*set);
+	return g_test_timer_elapsed();
+}
+
+static void compare(unsigned count, unsigned keep)
+{
+	struct heap_extent *candidates = make_candidates(count);
+	struct extent *packed = g_new(struct extent, count);
+	struct extent *expected;
+	struct extent_set *set;
+	struct heap heap;
+	unsigned n;
+
+	for (n = 0; n < count; n++)
+		packed[n] = pack(&candidates[n]);
+	run_heap(&heap, candidates, count, keep);
+	run_set(&set, packed, count, keep);
+
+	g_assert_cmpuint(set->used, ==, heap.used);
+	expected = g_new(struct extent, heap.used);
+	for (n = 0; n < heap.used; n++)
+		expected[n] = pack(&heap.extents[n]);
+	qsort(expected, heap.used, sizeof(*expected), extent_compare_rank);
+	qsort(set->extents, set->used, sizeof(*set->extents),
+				extent_compare_rank);
+	for (n = 0; n < heap.used; n++) {
+		g_assert_cmpuint(set->extents[n].sect_count, ==,
+					expected[n].sect_count);
+		g_assert_cmpuint(set->extents[n].device, ==,
+					expected[n].device);
+		g_assert_cmpuint(set->extents[n].start_sect, ==,
+					expected[n].start_sect);
+	}
+
+	g_free(expected);
+	extent_set_free(set);
+	g_free(heap.extents);
+	g_free(packed);
+	g_free(candidates);
+}
+
+static void test_same_set(void)
+{
+	static const unsigned keep[] = {1, 2, 17, 1000, 30000,
+				TEST_CANDIDATES, TEST_CANDIDATES + 5};
+	unsigned n;
+
+	min_extent_sectors = 0;
+	for (n = 0; n < G_N_ELEMENTS(keep); n++)
+		compare(TEST_CANDIDATES, keep[n]);
+}
+
+/* Run with -m perf */
+static void test_perf(void)
+{
+	struct heap_extent *candidates;
+	struct extent *packed;
+	struct extent_set *set;
+	struct heap heap;
+	double heap_secs;
+	double set_secs;
+	unsigned n;
+
+	if (!g_test_perf())
+		return;
+	min_extent_sectors = 0;
+	candidates = make_candidates(PERF_CANDIDATES);
+	packed = g_new(struct extent, PERF_CANDIDATES);
+	for (n = 0; n < PERF_CANDIDATES; n++)
+		packed[n] = pack(&candidates[n]);
+
+	heap_secs = run_heap(&heap, candidates, PERF_CANDIDATES, PERF_KEEP);
+	set_secs = run_set(&set, packed, PERF_CANDIDATES, PERF_KEEP);
+	g_test_minimized_result(heap_secs, "heap: %u of %u extents in %.3f s, "
+				"%zu bytes each", PERF_KEEP, PERF_CANDIDATES,
+				heap_secs, sizeof(struct heap_extent));
+	g_test_minimized_result(set_secs, "batched: %u of %u extents in "
+				"%.3f s, %zu bytes each", PERF_KEEP,
+				PERF_CANDIDATES, set_secs,
+				sizeof(struct extent));
+
+	extent_set_free(set);
+	g_free(heap.extents);
+	g_free(packed);
+	g_free(candidates);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/extents/same-set", test_same_set);
+	g_test_add_func("/extents/perf", test_perf);
+	return g_test_run();
+}
@@ -0,0 +1,221 @@
+/*
+ * test_fat - Check the vectorized FAT packers against the scalar one, and
+ *            that a short read of the FAT adds no extents
+ *
+ * Copyright (C) 2009-2010 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#define main gather_free_space_main
+#include "../gather_free_space.c"
+#undef main
+
+#define TEST_ENTRIES 4099
+#define TEST_ROUNDS 100
+/* A FAT32 volume of 512-byte clusters whose FAT spans three 1 MB bitmap
+   chunks */
+#define VOL_RESERVED 32
+#define VOL_CLUSTERS (3 << 18)
+#define VOL_FAT_SECTORS (((VOL_CLUSTERS + FAT_FIRST_CLUSTER) * 4 + 511) / 512)
+#define VOL_SECTORS (VOL_RESERVED + VOL_FAT_SECTORS + VOL_CLUSTERS)
+
+struct pack_variant {
+	const char *name;
+	void (*pack)(const uint8_t *fat, size_t count, uint8_t *bitmap);
+	gboolean (*supported)(void);
+};
+
+static gboolean cpu_any(void)
+{
+	return TRUE;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static gboolean cpu_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static gboolean cpu_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static const struct pack_variant pack_variants[] = {
+	{"scalar", fat_pack_scalar, cpu_any},
+#if defined(__i386__) || defined(__x86_64__)
+	{"sse2", fat_pack_sse2, cpu_sse2},
+	{"avx2", fat_pack_avx2, cpu_avx2},
+#endif
+};
+
+/* Free entries, entries which are free apart from the reserved high
+   bits, chain links and end-of-chain markers */
+static uint32_t random_entry(void)
+{
+	switch (g_test_rand_int_range(0, 4)) {
+	case 0:
+		return 0;
+	case 1:
+		return (uint32_t) g_test_rand_int_range(1, 16) << 28;
+	case 2:
+		return g_test_rand_int_range(FAT_FIRST_CLUSTER,
+					FAT32_ENTRY_MASK);
+	default:
+		return 0x0ffffff8 | (uint32_t) g_test_rand_int_range(0, 8);
+	}
+}
+
+static void test_variant(const void *data)
+{
+	const struct pack_variant *variant = data;
+	uint8_t *fat = g_malloc(4 * TEST_ENTRIES);
+	uint8_t *bitmap = g_malloc((TEST_ENTRIES + 7) / 8);
+	uint32_t entry;
+	size_t count;
+	size_t n;
+	unsigned round;
+	gboolean used;
+
+	if (!variant->supported()) {
+		g_test_message("CPU lacks %s, skipping", variant->name);
+		goto out;
+	}
+	for (round = 0; round < TEST_ROUNDS; round++) {
+		count = g_test_rand_int_range(1, TEST_ENTRIES + 1);
+		for (n = 0; n < count; n++) {
+			entry = GUINT32_TO_LE(random_entry());
+			memcpy(fat + 4 * n, &entry, 4);
+		}
+		variant->pack(fat, count, bitmap);
+		for (n = 0; n < count; n++) {
+			used = (get_le32(fat + 4 * n) & FAT32_ENTRY_MASK) != 0;
+			g_assert_cmpuint((bitmap[n / 8] >> (n % 8)) & 1, ==,
+						used);
+		}
+	}
+out:
+	g_free(bitmap);
+	g_free(fat);
+}
+
+static void put_le16(uint8_t *buf, uint16_t val)
+{
+	val = GUINT16_TO_LE(val);
+	memcpy(buf, &val, 2);
+}
+
+static void put_le32(uint8_t *buf, uint32_t val)
+{
+	val = GUINT32_TO_LE(val);
+	memcpy(buf, &val, 4);
+}
+
+/* Write a clean FAT32 volume with every other cluster in use, and
+   return its path */
+static gchar *make_volume(void)
+{
+	uint8_t *fat = g_malloc0(VOL_FAT_SECTORS * 512);
+	uint8_t bs[512] = {0};
+	gchar *path;
+	uint32_t n;
+	ssize_t ret;
+	int fd;
+
+	fd = g_file_open_tmp("test_fat-XXXXXX", &path, NULL);
+	g_assert(fd != -1);
+	put_le16(bs + 11, 512);
+	bs[13] = 1;
+	put_le16(bs + 14, VOL_RESERVED);
+	bs[16] = 1;
+	put_le32(bs + 32, VOL_SECTORS);
+	put_le32(bs + 36, VOL_FAT_SECTORS);
+	bs[510] = 0x55;
+	bs[511] = 0xaa;
+	ret = pwrite(fd, bs, sizeof(bs), 0);
+	g_assert_cmpint(ret, ==, sizeof(bs));
+
+	put_le32(fat, 0x0ffffff8);
+	put_le32(fat + 4, 0x0fffffff);
+	for (n = FAT_FIRST_CLUSTER; n < VOL_CLUSTERS + FAT_FIRST_CLUSTER;
+				n += 2)
+		put_le32(fat + 4 * n, 0x0fffffff);
+	ret = pwrite(fd, fat, VOL_FAT_SECTORS * 512, VOL_RESERVED * 512);
+	g_assert_cmpint(ret, ==, VOL_FAT_SECTORS * 512);
+	close(fd);
+	g_free(fat);
+	return path;
+}
+
+/* A FAT which can't be read in full rejects the volume without adding
+   extents from the chunks read before the failure.  The device keeps
+   its full size, so that only the FAT read comes up short. */
+static void test_short_read(void)
+{
+	struct disk disk = {
+		.align_sectors = 1,
+	};
+	struct device device = {
+		.fstype = (gchar *) "vfat",
+		.disk = &disk,
+		.sectors = VOL_SECTORS,
+	};
+	int ret;
+
+	bitmap_chunk_mb = 1;
+	max_extent_count = 1000;
+	fat_pack_select();
+	bitmap_skip_select();
+	device.path = make_volume();
+	device_list = g_ptr_array_new();
+	g_ptr_array_add(device_list, &device);
+	device.extents = extent_set_new();
+
+	ret = truncate(device.path, (VOL_RESERVED << 9) + (2 << 20));
+	g_assert_cmpint(ret, ==, 0);
+	handle_vfat(&device);
+	g_assert_cmpstr(device.problem, ==, "Short read for FAT");
+	g_assert_cmpuint(device.extents->used, ==, 0);
+
+	g_free(device.problem);
+	device.problem = NULL;
+	ret = truncate(device.path, (off_t) VOL_SECTORS << 9);
+	g_assert_cmpint(ret, ==, 0);
+	handle_vfat(&device);
+	g_assert(device.problem == NULL);
+	extent_set_select(device.extents);
+	g_assert_cmpuint(device.extents->used, ==, max_extent_count);
+
+	extent_set_free(device.extents);
+	g_ptr_array_free(device_list, TRUE);
+	unlink(device.path);
+	g_free(device.path);
+}
+
+int main(int argc, char **argv)
+{
+	gchar *path;
+	unsigned n;
+
+	g_test_init(&argc, &argv, NULL);
+	for (n = 0; n < G_N_ELEMENTS(pack_variants); n++) {
+		path = g_strdup_printf("/fat/pack/%s", pack_variants[n].name);
+		g_test_add_data_func(path, &pack_variants[n], test_variant);
+		g_free(path);
+	}
+	g_test_add_func("/fat/short-read", test_short_read);
+	return g_test_run();
+}
@@ -0,0 +1,379 @@
+/*
+ * test_lvm - Check LVM metadata handling on hand-built physical volumes
+ *
+ * Copyright (C) 2009-2010 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#define main gather_free_space_main
+#include "../gather_free_space.c"
+#undef main
+
+#define PV_SECTORS (64 << 11)
+#define PV_LABEL_SECTOR 1
+#define PV_MDA_START 4096
+#define PV_MDA_SIZE ((1 << 20) - PV_MDA_START)
+#define PV_DATA_START (1 << 20)
+#define PV_UUID "abcdefghijklmnopqrstuvwxyz012345"
+#define PV_UUID_TEXT "abcdef-ghij-klmn-opqr-stuv-wxyz-012345"
+#define PV_EXTENT_SECTORS 8192
+#define PV_PE_START 2048
+#define PV_PE_COUNT 15
+
+/* pe_count and a list of logical volumes go in the blanks.  The
+   comments and odd spacing are part of the test. */
+#define VG_TEMPLATE \
+	"# Generated by test_lvm\n" \
+	"vg0 {\n" \
+	"\tid = \"0123456789abcdefghijklmnopqrstuv\"\n" \
+	"\tseqno = 3\n" \
+	"\tstatus = [\"RESIZEABLE\", \"READ\", \"WRITE\"]\n" \
+	"\textent_size = 8192\t# 4 MB\n" \
+	"%s" \
+	"\tphysical_volumes {\n" \
+	"\t\tpv1 {\n" \
+	"\t\t\tid = \"zyxwvu-tsrq-ponm-lkji-hgfe-dcba-543210\"\n" \
+	"\t\t\tpe_start = 2048\n" \
+	"\t\t\tpe_count = 100\n" \
+	"\t\t}\n" \
+	"\t\tpv0 {\n" \
+	"\t\t\tid = \"" PV_UUID_TEXT "\"\n" \
+	"\t\t\tdevice = \"/dev/sdz1\"\n" \
+	"\t\t\tpe_start = 2048\n" \
+	"\t\t\tpe_count = %u\n" \
+	"\t\t}\n" \
+	"\t}\n" \
+	"\tlogical_volumes {\n" \
+	"%s" \
+	"\t}\n" \
+	"}\n" \
+	"contents = \"Text Format Volume Group\"\n" \
+	"version = 1\n"
+
+/* Uses extents 1-2 linearly, 5-6 as one of two stripes and 10-11 as a
+   mirror leg.  Extents of pv1 don't count. */
+#define VG_LVS \
+	"\t\tlinear {\n" \
+	"\t\t\tsegment_count = 1\n" \
+	"\t\t\tsegment1 {\n" \
+	"\t\t\t\tstart_extent = 0\n" \
+	"\t\t\t\textent_count = 2\n" \
+	"\t\t\t\ttype = \"striped\"\n" \
+	"\t\t\t\tstripe_count = 1\n" \
+	"\t\t\t\tstripes = [\"pv0\", 1]\n" \
+	"\t\t\t}\n" \
+	"\t\t}\n" \
+	"\t\tstriped {\n" \
+	"\t\t\tsegment1 {\n" \
+	"\t\t\t\tstart_extent = 0\n" \
+	"\t\t\t\textent_count = 4\n" \
+	"\t\t\t\ttype = \"striped\"\n" \
+	"\t\t\t\tstripe_count = 2\n" \
+	"\t\t\t\tstripe_size = 128\n" \
+	"\t\t\t\tstripes = [\n" \
+	"\t\t\t\t\t\"pv1\", 0,\n" \
+	"\t\t\t\t\t\"pv0\", 5\n" \
+	"\t\t\t\t]\n" \
+	"\t\t\t}\n" \
+	"\t\t}\n" \
+	"\t\tmirrored_mimage_0 {\n" \
+	"\t\t\tsegment1 {\n" \
+	"\t\t\t\tstart_extent = 0\n" \
+	"\t\t\t\textent_count = 2\n" \
+	"\t\t\t\ttype = \"mirror\"\n" \
+	"\t\t\t\tmirror_count = 2\n" \
+	"\t\t\t\tmirrors = [\"pv0\", 10, \"pv1\", 10]\n" \
+	"\t\t\t}\n" \
+	"\t\t}\n"
+
+struct test_pv {
+	gchar *path;
+	int fd;
+};
+
+static struct disk test_disk = {
+	.align_sectors = 1,
+};
+
+static void put_le32(uint8_t *buf, uint32_t val)
+{
+	val = GUINT32_TO_LE(val);
+	memcpy(buf, &val, sizeof(val));
+}
+
+static void put_le64(uint8_t *buf, uint64_t val)
+{
+	val = GUINT64_TO_LE(val);
+	memcpy(buf, &val, sizeof(val));
+}
+
+static void write_full(int fd, const void *buf, size_t len, off_t offset)
+{
+	ssize_t ret = pwrite(fd, buf, len, offset);
+
+	g_assert_cmpint(ret, ==, (ssize_t) len);
+}
+
+/* Write a PV label and metadata area header to a new sparse file.  If
+   metadata is NULL, the PV is in no VG. */
+static void pv_create(struct test_pv *pv, const char *metadata)
+{
+	uint8_t label[512] = {0};
+	uint8_t hdr[LVM_MDA_HEADER_SIZE] = {0};
+	uint8_t *locn;
+	size_t len = metadata ? strlen(metadata) : 0;
+
+	pv->fd = g_file_open_tmp("test_lvm-XXXXXX", &pv->path, NULL);
+	g_assert(pv->fd != -1);
+	if (ftruncate(pv->fd, (off_t) PV_SECTORS * 512))
+		g_error("Couldn't extend %s", pv->path);
+
+	memcpy(label, LVM_LABEL_ID, 8);
+	put_le64(label + 8, PV_LABEL_SECTOR);
+	put_le32(label + 20, 32);
+	memcpy(label + 24, LVM_LABEL_TYPE, 8);
+	memcpy(label + 32, PV_UUID, LVM_ID_LEN);
+	put_le64(label + 64, (uint64_t) PV_SECTORS * 512);
+	/* One data area to the end of the device, then one metadata area */
+	locn = label + 72;
+	put_le64(locn, PV_DATA_START);
+	put_le64(locn + 32, PV_MDA_START);
+	put_le64(locn + 40, PV_MDA_SIZE);
+	put_le32(label + 16, lvm_crc(LVM_INITIAL_CRC, label + 20, 512 - 20));
+	write_full(pv->fd, label, sizeof(label), PV_LABEL_SECTOR * 512);
+
+	memcpy(hdr + 4, LVM_MDA_MAGIC, 16);
+	put_le32(hdr + 20, LVM_MDA_VERSION);
+	put_le64(hdr + 24, PV_MDA_START);
+	put_le64(hdr + 32, PV_MDA_SIZE);
+	if (metadata != NULL) {
+		put_le64(hdr + 40, LVM_MDA_HEADER_SIZE);
+		put_le64(hdr + 48, len);
+		put_le32(hdr + 56, lvm_crc(LVM_INITIAL_CRC,
+					(const uint8_t *) metadata, len));
+		write_full(pv->fd, metadata, len, PV_MDA_START +
+					LVM_MDA_HEADER_SIZE);
+	}
+	put_le32(hdr, lvm_crc(LVM_INITIAL_CRC, hdr + 4, sizeof(hdr) - 4));
+	write_full(pv->fd, hdr, sizeof(hdr), PV_MDA_START);
+}
+
+static void pv_destroy(struct test_pv *pv)
+{
+	close(pv->fd);
+	unlink(pv->path);
+	g_free(pv->path);
+}
+
+static gchar *vg_metadata(const char *vg_settings, unsigned pe_count,
+			const char *lvs)
+{
+	return g_strdup_printf(VG_TEMPLATE, vg_settings, pe_count, lvs);
+}
+
+static int extent_compare_start(const void *_a, const void *_b)
+{
+	const struct extent *a = _a;
+	const struct extent *b = _b;
+
+	if (a->start_sect != b->start_sect)
+		return a->start_sect < b->start_sect ? -1 : 1;
+	return 0;
+}
+
+/* Run handle_lvm() on the PV and check for the expected problem, or for
+   the expected extents in start/count pairs */
+static void check_pv(struct test_pv *pv, const char *problem,
+			const uint64_t *expected, unsigned count)
+{
+	struct device device = {
+		.path = pv->path,
+		.fstype = (gchar *) "LVM2_member",
+		.disk = &test_disk,
+		.sectors = PV_SECTORS,
+	};
+	struct extent *found;
+	unsigned n;
+
+	device.extents = extent_set_new();
+	g_ptr_array_add(device_list, &device);
+	handle_lvm(&device);
+	g_ptr_array_remove_index(device_list, device_list->len - 1);
+
+	if (problem != NULL) {
+		g_assert_cmpstr(device.problem, ==, problem);
+	} else {
+		g_assert(device.problem == NULL);
+		g_assert_cmpuint(device.extents->used, ==, count);
+		found = device.extents->extents;
+		qsort(found, count, sizeof(*found), extent_compare_start);
+		for (n = 0; n < count; n++) {
+			g_assert_cmpuint(found[n].start_sect, ==,
+						expected[2 * n]);
+			g_assert_cmpuint(found[n].sect_count, ==,
+						expected[2 * n + 1]);
+		}
+	}
+	g_free(device.problem);
+	extent_set_free(device.extents);
+}
+
+#define PE(n) (PV_PE_START + (uint64_t) (n) * PV_EXTENT_SECTORS)
+
+static void test_vg(void)
+{
+	static const uint64_t expected[] = {
+		PE(0), PV_EXTENT_SECTORS,
+		PE(3), 2 * PV_EXTENT_SECTORS,
+		PE(7), 3 * PV_EXTENT_SECTORS,
+		PE(12), 3 * PV_EXTENT_SECTORS,
+	};
+	struct test_pv pv;
+	gchar *metadata;
+
+	metadata = vg_metadata("", PV_PE_COUNT, VG_LVS);
+	pv_create(&pv, metadata);
+	check_pv(&pv, NULL, expected, G_N_ELEMENTS(expected) / 2);
+	pv_destroy(&pv);
+	g_free(metadata);
+
+	/* A local lock type is fine */
+	metadata = vg_metadata("\tlock_type = \"none\"\n", PV_PE_COUNT,
+				VG_LVS);
+	pv_create(&pv, metadata);
+	check_pv(&pv, NULL, expected, G_N_ELEMENTS(expected) / 2);
+	pv_destroy(&pv);
+	g_free(metadata);
+}
+
+/* A PV in no VG is free from its data area to the end of the device */
+static void test_orphan(void)
+{
+	static const uint64_t expected[] = {
+		PV_DATA_START / 512, PV_SECTORS - PV_DATA_START / 512,
+	};
+	struct test_pv pv;
+
+	pv_create(&pv, NULL);
+	check_pv(&pv, NULL, expected, 1);
+	pv_destroy(&pv);
+}
+
+static void test_reject(void)
+{
+	static const struct {
+		const char *vg_settings;
+		unsigned pe_count;
+		const char *lvs;
+		const char *problem;
+	} cases[] = {
+		{"\tlock_type = \"sanlock\"\n", PV_PE_COUNT, VG_LVS,
+					"Volume group is shared"},
+		{"", PV_SECTORS / PV_EXTENT_SECTORS, VG_LVS,
+					"Volume group larger than device"},
+		/* Extent 10 of a 10-extent PV */
+		{"", 10, VG_LVS, "Bad LVM metadata"},
+		{"", PV_PE_COUNT, "\t\tbroken {\n\t\t\tsegment1 {\n"
+					"\t\t\t\tstripes = [\"pv0\", 0]\n"
+					"\t\t\t}\n\t\t}\n",
+					"Bad LVM metadata"},
+		{"", PV_PE_COUNT, "\t\tunbalanced {\n",
+					"Couldn't parse LVM metadata"},
+	};
+	struct test_pv pv;
+	gchar *metadata;
+	uint8_t byte;
+	unsigned n;
+
+	for (n = 0; n < G_N_ELEMENTS(cases); n++) {
+		metadata = vg_metadata(cases[n].vg_settings,
+					cases[n].pe_count, cases[n].lvs);
+		pv_create(&pv, metadata);
+		check_pv(&pv, cases[n].problem, NULL, 0);
+		pv_destroy(&pv);
+		g_free(metadata);
+	}
+
+	/* Corrupt the metadata after its checksum was computed */
+	metadata = vg_metadata("", PV_PE_COUNT, VG_LVS);
+	pv_create(&pv, metadata);
+	byte = 'X';
+	write_full(pv.fd, &byte, 1, PV_MDA_START + LVM_MDA_HEADER_SIZE + 10);
+	check_pv(&pv, "No usable LVM metadata area", NULL, 0);
+	pv_destroy(&pv);
+
+	/* And the label */
+	pv_create(&pv, metadata);
+	write_full(pv.fd, &byte, 1, PV_LABEL_SECTOR * 512 + 40);
+	check_pv(&pv, "Bad PV label", NULL, 0);
+	pv_destroy(&pv);
+	g_free(metadata);
+}
+
+static void test_parse(void)
+{
+	static const char *const bad[] = {
+		"a {",
+		"a }",
+		"a = ",
+		"a = [1, 2",
+		"a = \"unterminated",
+		"{ a = 1 }",
+		"a b",
+	};
+	struct lvm_node *root;
+	struct lvm_node *node;
+	gchar *deep;
+	unsigned n;
+
+	root = lvm_parse("# comment\na{b=[\"x\\\"y\",2]c=\"z\" # more\n"
+				"d{}}e=3", 100);
+	g_assert(root != NULL);
+	g_assert_cmpuint(root->children->len, ==, 2);
+	node = lvm_find(lvm_child(root, 0), "b");
+	g_assert(node != NULL && node->values != NULL);
+	g_assert_cmpuint(node->values->len, ==, 2);
+	g_assert_cmpstr(g_ptr_array_index(node->values, 0), ==, "x\"y");
+	g_assert_cmpstr(g_ptr_array_index(node->values, 1), ==, "2");
+	g_assert_cmpstr(lvm_string(lvm_child(root, 0), "c"), ==, "z");
+	g_assert(lvm_find(lvm_child(root, 0), "d")->children != NULL);
+	g_assert_cmpstr(lvm_string(root, "e"), ==, "3");
+	lvm_node_free(root);
+
+	for (n = 0; n < G_N_ELEMENTS(bad); n++) {
+		root = lvm_parse(bad[n], strlen(bad[n]));
+		g_assert(root == NULL);
+	}
+
+	/* Nesting is bounded */
+	deep = g_strnfill(3 * (LVM_PARSE_DEPTH + 2), '}');
+	for (n = 0; n < LVM_PARSE_DEPTH + 2; n++)
+		memcpy(deep + 2 * n, "a{", 2);
+	root = lvm_parse(deep, strlen(deep));
+	g_assert(root == NULL);
+	g_free(deep);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+	device_list = g_ptr_array_new();
+	unallocated = TRUE;
+	max_extent_count = 1000;
+	min_extent_sectors = 0;
+	g_test_add_func("/lvm/vg", test_vg);
+	g_test_add_func("/lvm/orphan", test_orphan);
+	g_test_add_func("/lvm/reject", test_reject);
+	g_test_add_func("/lvm/parse", test_parse);
+	return g_test_run();
+}
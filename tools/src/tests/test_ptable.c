@@ -0,0 +1,210 @@
+/*
+ * test_ptable - Check the gaps found between partitions
+ *
+ * Copyright (C) 2009-2010 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#define main gather_free_space_main
+#include "../gather_free_space.c"
+#undef main
+
+#define TEST_SECTORS 100000
+#define TEST_ROUNDS 500
+#define TEST_MAX_PARTITIONS 8
+
+static struct disk test_disk = {
+	.align_sectors = 1,
+};
+
+static struct device test_device = {
+	.path = (gchar *) "test-disk",
+	.disk = &test_disk,
+	.sectors = TEST_SECTORS,
+};
+
+static int extent_compare_start(const void *_a, const void *_b)
+{
+	const struct extent *a = _a;
+	const struct extent *b = _b;
+
+	if (a->start_sect != b->start_sect)
+		return a->start_sect < b->start_sect ? -1 : 1;
+	return 0;
+}
+
+/* Find the gaps of usable outside ranges, and check them against a map
+   of the disk's sectors */
+static void check_gaps(GArray *ranges, struct sector_range usable)
+{
+	uint8_t *covered = g_malloc0(TEST_SECTORS);
+	struct sector_range *range;
+	struct extent *found;
+	uint64_t sect;
+	unsigned n;
+
+	for (n = 0; n < ranges->len; n++) {
+		range = &g_array_index(ranges, struct sector_range, n);
+		for (sect = range->start; sect < MIN(range->end,
+					TEST_SECTORS); sect++)
+			covered[sect] = 1;
+	}
+
+	test_device.extents = extent_set_new();
+	ptable_add_gaps(&test_device, ranges, usable);
+	found = test_device.extents->extents;
+	qsort(found, test_device.extents->used, sizeof(*found),
+				extent_compare_start);
+	sect = 0;
+	for (n = 0; n < test_device.extents->used; n++) {
+		/* Extents are maximal: something used precedes each one */
+		g_assert_cmpuint(found[n].start_sect, >=, usable.start);
+		g_assert(found[n].start_sect == usable.start ||
+					covered[found[n].start_sect - 1]);
+		for (; sect < found[n].start_sect; sect++)
+			g_assert(covered[sect] || sect < usable.start);
+		for (; sect < found[n].start_sect + found[n].sect_count;
+					sect++)
+			g_assert(!covered[sect]);
+		g_assert(sect == usable.end || covered[sect]);
+	}
+	for (sect = MAX(sect, usable.start); sect < usable.end; sect++)
+		g_assert(covered[sect]);
+	extent_set_free(test_device.extents);
+	g_free(covered);
+}
+
+/* Random partitions, some overlapping, some duplicated as they would be
+   when libblkid and the kernel both list them, and some past the end of
+   the usable range */
+static void test_random(void)
+{
+	struct sector_range usable;
+	struct sector_range range;
+	GArray *ranges;
+	unsigned round;
+	unsigned count;
+	unsigned n;
+
+	for (round = 0; round < TEST_ROUNDS; round++) {
+		ranges = g_array_new(FALSE, FALSE,
+					sizeof(struct sector_range));
+		count = g_test_rand_int_range(0, TEST_MAX_PARTITIONS + 1);
+		for (n = 0; n < count; n++) {
+			range.start = g_test_rand_int_range(0, TEST_SECTORS);
+			range.end = range.start + g_test_rand_int_range(1,
+						TEST_SECTORS / 4);
+			g_array_append_val(ranges, range);
+			if (g_test_rand_bit())
+				g_array_append_val(ranges, range);
+		}
+		usable.start = g_test_rand_int_range(0, 4096);
+		usable.end = TEST_SECTORS - g_test_rand_int_range(0, 4096);
+		check_gaps(ranges, usable);
+		g_array_free(ranges, TRUE);
+	}
+}
+
+static void test_layouts(void)
+{
+	static const struct {
+		struct sector_range usable;
+		unsigned count;
+		struct sector_range parts[3];
+	} cases[] = {
+		/* Blank table */
+		{{2048, TEST_SECTORS}, 0, {{0, 0}}},
+		/* Partition filling the disk */
+		{{2048, TEST_SECTORS}, 1, {{2048, TEST_SECTORS}}},
+		/* Old-style partition at sector 63, below the reserved area */
+		{{2048, TEST_SECTORS}, 1, {{63, 50000}}},
+		/* Adjacent partitions, and one nested in another as with a
+		   DOS extended partition */
+		{{2048, TEST_SECTORS}, 3, {{2048, 10000}, {10000, 60000},
+					{20000, 30000}}},
+		/* GPT backup entries at the end */
+		{{34, TEST_SECTORS - 33}, 2, {{2048, 4096},
+					{TEST_SECTORS - 33, TEST_SECTORS}}},
+	};
+	GArray *ranges;
+	unsigned n;
+	unsigned i;
+
+	for (n = 0; n < G_N_ELEMENTS(cases); n++) {
+		ranges = g_array_new(FALSE, FALSE,
+					sizeof(struct sector_range));
+		for (i = 0; i < cases[n].count; i++)
+			g_array_append_val(ranges, cases[n].parts[i]);
+		check_gaps(ranges, cases[n].usable);
+		g_array_free(ranges, TRUE);
+	}
+}
+
+/* The usable range comes from the primary GPT header, in logical
+   sectors */
+static void test_gpt_header(void)
+{
+	static const unsigned sector_sizes[] = {512, 4096};
+	uint8_t header[4096] = {0};
+	struct device device = {0};
+	struct sector_range range;
+	uint64_t val;
+	unsigned scale;
+	unsigned n;
+	gboolean found;
+	ssize_t ret;
+	int fd;
+
+	for (n = 0; n < G_N_ELEMENTS(sector_sizes); n++) {
+		fd = g_file_open_tmp("test_ptable-XXXXXX", &device.path,
+					NULL);
+		g_assert(fd != -1);
+		scale = sector_sizes[n] / 512;
+		memcpy(header, GPT_HEADER_SIGNATURE, 8);
+		val = GUINT64_TO_LE(2 + 32 / scale);
+		memcpy(header + 40, &val, 8);
+		val = GUINT64_TO_LE(TEST_SECTORS / scale - 34 / scale);
+		memcpy(header + 48, &val, 8);
+		ret = pwrite(fd, header, sector_sizes[n], sector_sizes[n]);
+		g_assert_cmpint(ret, ==, sector_sizes[n]);
+		found = gpt_usable_range(&device, sector_sizes[n], &range);
+		g_assert(found);
+		g_assert_cmpuint(range.start, ==, (2 + 32 / scale) * scale);
+		g_assert_cmpuint(range.end, ==, TEST_SECTORS - 34 / scale *
+					scale + scale);
+
+		/* A protective MBR alone isn't enough */
+		memset(header, 0, sizeof(header));
+		ret = pwrite(fd, header, sector_sizes[n], sector_sizes[n]);
+		g_assert_cmpint(ret, ==, sector_sizes[n]);
+		found = gpt_usable_range(&device, sector_sizes[n], &range);
+		g_assert(!found);
+
+		close(fd);
+		unlink(device.path);
+		g_free(device.path);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+	device_list = g_ptr_array_new();
+	g_ptr_array_add(device_list, &test_device);
+	max_extent_count = 1000;
+	min_extent_sectors = 0;
+	g_test_add_func("/ptable/random", test_random);
+	g_test_add_func("/ptable/layouts", test_layouts);
+	g_test_add_func("/ptable/gpt-header", test_gpt_header);
+	return g_test_run();
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+# XFS images made by mkfs.xfs, empty and populated from a protofile.  The
+# free space found by walking the cntbt must match what xfs_db counts.
+
+. "$srcdir/tests/common.sh"
+
+require mkfs.xfs xfs_db truncate
+
+# check_xfs IMAGE
+check_xfs() {
+	plan "$1"
+	free_blocks=$(xfs_db -r -c "freesp -s" "$1" |
+				awk '/^total free blocks/ {print $4}')
+	block_size=$(xfs_db -r -c "sb 0" -c "print blocksize" "$1" |
+				awk '{print $3}')
+	[ -n "$free_blocks" ] && [ -n "$block_size" ] ||
+				fail "couldn't read free space with xfs_db"
+	expect_free_kb $((free_blocks * block_size / 1024))
+	[ "$(table_sectors "$1")" -eq $((free_blocks * block_size / 512)) ] ||
+				fail "table doesn't map every free block"
+}
+
+sparse_image empty.img 1G
+mkfs.xfs -q -f -d agcount=8 "$image" || fail "mkfs.xfs failed"
+check_xfs "$image"
+
+# Files of assorted sizes, so that the free space is split up
+proto=$workdir/proto
+printf '/dev/null\n0 0\nd--755 0 0\n' > "$proto"
+for n in 1 2 3 4 5 6 7 8 9 10 11 12; do
+	dd if=/dev/urandom of="$workdir/file$n" bs=64k count=$((n * n)) \
+				2>/dev/null || fail "couldn't write file$n"
+	echo "file$n ---644 0 0 $workdir/file$n" >> "$proto"
+done
+echo '$' >> "$proto"
+sparse_image populated.img 1G
+mkfs.xfs -q -f -d agcount=8 -p "$proto" "$image" ||
+			fail "mkfs.xfs -p failed"
+check_xfs "$image"
+exit 0